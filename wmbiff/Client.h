@@ -24,6 +24,11 @@
 #include <gcrypt.h>
 #endif
 
+#include "mboxScan.h"
+#include "mboxIndex.h"
+#include "maildirScan.h"
+#include "statBatch.h"
+
 #ifdef __LCLINT__
 typedef unsigned int off_t;
 #endif
@@ -33,6 +38,8 @@ typedef unsigned int off_t;
 #define BUF_SIZE 1024
 
 struct msglst;
+struct maildir_folder;
+struct thread_pool;
 typedef struct _mbox_t *Pop3;
 typedef struct _mbox_t {
 	char label[BUF_SMALL];		/* Printed at left; max 5 chars */
@@ -61,25 +68,62 @@ typedef struct _mbox_t {
 
 	union {
 		struct {
-			time_t mtime;
-			off_t size;
+			struct file_stamp stamp;
+			struct prefetched_stamp prefetch;
+			unsigned int remote:1;	/* on NFS or the like */
+			/* where the last scan stopped (always at the start
+			   of a line) and what it had counted by then, so an
+			   mbox that was only appended to can be scanned from
+			   there instead of from the top. */
+			off_t offset;
+			struct mbox_scan scan;
+			/* earlier places to resume from, saved across restarts */
+			struct mbox_index *index;
+			unsigned int content_length:1;	/* mbox::C: trust Content-Length */
+			unsigned int content_length_used:1;	/* and not compressed */
+			/* modified, and not yet closed, since the last event */
+			unsigned int writing:1;
+			time_t postponed_at;	/* first put off for a delivery */
 		} mbox;
 		struct {
 			char *detail;
 		} shell;
 		struct {
-			time_t mtime_new;
-			off_t size_new;
-			time_t mtime_cur;
-			off_t size_cur;
+			struct file_stamp stamp_new;
+			struct file_stamp stamp_cur;
+			struct prefetched_stamp prefetch_new;
+			struct prefetched_stamp prefetch_cur;
+			unsigned int remote:1;	/* on NFS or the like */
+			/* while watched, kept up to date by the events for
+			   new/ and cur/ instead of reading both directories */
+			struct maildir_counts counts;
+			time_t synced_at;	/* when they were last counted */
+			unsigned int synced:1;	/* no events were missed since */
+			unsigned int counting:1;	/* events now may be in the count */
 			unsigned int dircache_flush:1;	/* hack to flush directory caches */
+			/* maildir++: the folders below path, and path's
+			   stamp when they were found */
+			struct maildir_folder *folders;
+			int nfolders;
+			struct file_stamp stamp_root;
 		} maildir;
+		struct {
+			struct file_stamp stamp;	/* of the folder */
+			struct file_stamp stamp_seq;	/* of .mh_sequences */
+			int *msgs;			/* message numbers, ascending */
+			int nmsgs;
+			int alloc;
+			int unseen;
+		} mh;
 		struct {
 			char password[BUF_SMALL];
 			char userName[BUF_BIG];
 			char serverName[BUF_BIG];
 			int serverPort;
 			int localPort;
+			/* imap: of userName, serverName and serverPort, to
+			   find the connection in the pool */
+			unsigned long conn_hash;
 			char authList[100];
 			unsigned int dossl:1;	/* use tls. */
 			/* prompt the user if we can't login / password is empty */
@@ -87,11 +131,34 @@ typedef struct _mbox_t {
 			/* using the msglst feature, fetch the headers
 			   to have them on hand */
 			unsigned int wantCacheHeaders:1;
+			/* imap: the server said (IDLE, NOTIFY) that the
+			   folder changed since it was last checked */
+			unsigned int news:1;
+			/* imap: counts came in with the STATUS of the
+			   other folders due on the same connection */
+			unsigned int status_ready:1;
+			/* imap: headerCache has been read back from the
+			   cache directory */
+			unsigned int headers_loaded:1;
 			unsigned char password_len;	/* memfrob may shorten passwords */
+			/* imap: of the folder the headers in headerCache
+			   came from; their UIDs are good while it stays */
+			unsigned long uidvalidity;
+			/* imap, with CONDSTORE: HIGHESTMODSEQ in the last
+			   STATUS, and when headerCache was brought up to
+			   date; 0 if not known.  while they're the same,
+			   nothing in the folder has changed. */
+			unsigned long long modseq;
+			unsigned long long header_modseq;
 		} pop_imap;
 	} u;
 
 	int (*checkMail) ( /*@notnull@ */ Pop3);
+	/* if set, adds what checkMail will stat to a batch of all the
+	   mailboxes due, stamped together just before they're checked;
+	   or, for imap, readies the folder to be asked about along with
+	   the others due on its connection */
+	void (*prefetch) ( /*@notnull@ */ Pop3, struct stat_batch *);
 
 	/* collect the headers to show in a pop up */
 	struct msglst *(*getHeaders) ( /*@notnull@ */ Pop3);
@@ -101,6 +168,8 @@ typedef struct _mbox_t {
 	time_t prevtime;
 	time_t prevfetch_time;
 	int loopinterval;			/* loop interval for this mailbox */
+	int watched;				/* changes are reported by fileWatch.c,
+								   so it's polled only now and then */
 
 	/* command to execute to get a password, if needed */
 	const char *askpass;
@@ -112,20 +181,49 @@ int imap4Create( /*@notnull@ */ Pop3 pc, const char *str);
 int shellCreate( /*@notnull@ */ Pop3 pc, const char *str);
 int mboxCreate( /*@notnull@ */ Pop3 pc, const char *str);
 int maildirCreate( /*@notnull@ */ Pop3 pc, const char *str);
+int maildirppCreate( /*@notnull@ */ Pop3 pc, const char *str);
+int mhCreate( /*@notnull@ */ Pop3 pc, const char *str);
 
+/* connect to hostname's addresses, IPv6 and IPv4 raced, within
+   connect_timeout seconds */
 int sock_connect(const char *hostname, int port);
-FILE *openMailbox(Pop3 pc, const char *mbox_filename);
+extern int connect_timeout;
+#ifdef HAVE_GETADDRINFO
+/* hostname's addresses, from the cache if they're there, even if
+   out of date; they belong to the cache.  returns 0, or a
+   getaddrinfo() error */
+struct addrinfo;
+int sock_resolve(const char *hostname, int port,
+				 /*@out@ */ struct addrinfo **res);
+#endif
+
+/* IMAP connections waiting in IDLE: up to max of their sockets,
+   for the main loop to wait on, and a look at what arrived on one
+   of them, which makes its mailbox due if its folder changed */
+int imap_idle_fds( /*@out@ */ int *fds, int max);
+void imap_idle_dispatch(int fd);
+/* NOOP the IMAP connections that have been quiet a while, and
+   close those that no mailbox has been checked through for much
+   longer */
+void imap_keepalive(time_t now);
+FILE *openMailbox(Pop3 pc, const char *mbox_filename, int *noatime);
 
 /* backtickExpand returns null on failure */
 /*@null@ */
 char *backtickExpand(Pop3 pc, const char *path);
-int fileHasChanged(const char *mbox_filename, time_t * atime,
-				   time_t * mtime, off_t * size);
+int fileHasChanged(const char *mbox_filename, struct file_stamp *stamp,
+				   /*@null@ */ struct prefetched_stamp *prefetched);
 int grabCommandOutput(Pop3 pc, const char *command,
 					  /*@out@ */ char **output,
 					  /*@out@ *//*@null@ */ char **details);
 int exists(const char *filename);	/* test -f */
 
+/* how many threads may scan one big mbox, or the folders of a
+   maildir++, at once ("scanthreads") */
+extern int scan_threads;
+/* null unless scan_threads > 1 */
+/*@null@ */ struct thread_pool *scan_thread_pool(void);
+
 /* _NONE is for silent operation.  _ERROR is for things that should
    be printed assuming that the user might possibly see them. _INFO is
    for reasonably useless but possibly interesting messages. _ALL is
@@ -17,6 +17,8 @@
 #include "passwordMgr.h"
 #include "regulo.h"
 #include "MessageList.h"
+#include "headerCache.h"
+#include "imapResponse.h"
 
 #include <sys/types.h>
 #include <stdio.h>
@@ -45,15 +47,86 @@ extern int Relax;
 #define ENFROB(x)
 #endif
 
-/* this array maps server:port pairs to file descriptors, so
-   that when more than one mailbox is queried from a server,
-   we only use one socket.  It's limited in size by the
-   number of different mailboxes displayed. */
-#define FDMAP_SIZE 5
+/* the connection pool: a connection for each user, server and
+   port, so that when more than one mailbox is queried from a
+   server, we only use one socket.  They're found by a hash of
+   those three, worked out once for each mailbox, in a table of
+   POOL_BUCKETS chains; there can be any number of them. */
+#define POOL_BUCKETS 32
+/* no more than this many connections to one server:port, for
+   different users; the one used least recently is closed to
+   make room for another */
+#define POOL_PER_SERVER 8
+/* a connection that hasn't been checked through for this long
+   is closed; one that hasn't been for POOL_KEEPALIVE is sent a
+   NOOP, so that the server (rfc 3501 lets it log us out after
+   30 minutes) and any NAT in between don't forget it */
+#define POOL_EVICT (60 * 60)
+#define POOL_KEEPALIVE (10 * 60)
 static struct fdmap_struct {
-	char *user_server_port;		/* tuple, in string form */
+	/*@null@ */ struct fdmap_struct *next;	/* in the same bucket */
+	unsigned long hash;			/* of user, server and port */
+	char *user;
+	char *server;
+	int port;
 	/*@owned@ */ struct connection_state *cs;
-} fdmap[FDMAP_SIZE];
+	time_t last_used;			/* by a check */
+	time_t last_noop;
+	/* IDLE (rfc 2177): between checks, the connection waits
+	   in the folder of one of its mailboxes, the idler, for
+	   the server to tell us it changed; that mailbox is then
+	   checked at once, and otherwise only to renew the IDLE. */
+	/*@dependent@ *//*@null@ */ Pop3 idler;
+	char idle_tag[8];			/* of the IDLE command in progress */
+	time_t idle_since;
+	/* NOTIFY (rfc 5465): the server also sends STATUS for the
+	   other folders checked on this connection when they change,
+	   so none of them needs polling either. */
+	/*@owned@ *//*@null@ */ Pop3 *folders;
+	int nfolders;
+	/* the folders due for a STATUS, which are all asked about at
+	   once, when the first of them is checked */
+	/*@owned@ *//*@null@ */ Pop3 *due;
+	int ndue;
+	int alloc_due;
+	const char *notify_events;	/* what NOTIFY SET asks for */
+	unsigned int can_idle:1;	/* the server said IDLE */
+	unsigned int can_notify:1;	/* ... and NOTIFY */
+	unsigned int can_condstore:1;	/* the server said CONDSTORE */
+	unsigned int notify_set:1;	/* all the folders are registered */
+	unsigned int selected:1;	/* the idler's folder is EXAMINEd */
+	unsigned int idling:1;		/* IDLE sent, DONE not yet */
+} *fdmap[POOL_BUCKETS];
+
+/* a mailbox's connection is found by this */
+static unsigned long
+connection_hash(const char *user, const char *server, int port)
+{
+	unsigned long hash = 2166136261UL;
+	const unsigned char *p;
+	for (p = (const unsigned char *) user; *p != '\0'; p++)
+		hash = ((hash ^ *p) * 16777619UL) & 0xffffffffUL;
+	hash = ((hash ^ '|') * 16777619UL) & 0xffffffffUL;
+	for (p = (const unsigned char *) server; *p != '\0'; p++)
+		hash = ((hash ^ *p) * 16777619UL) & 0xffffffffUL;
+	return (hash ^ (unsigned long) port) & 0xffffffffUL;
+}
+
+/* servers may drop an IDLE after 30 minutes (rfc 2177 says
+   29); it's renewed well before that. */
+#define IDLE_RENEW (25 * 60)
+
+/* numbers the tags of commands that may be outstanding; they're
+   not "aNNN", so that the tagged replies to the fixed-tag commands
+   that nobody waits for can't be taken for theirs */
+static int command_id;
+#define TAG_FORMAT "w%03d"
+
+static void next_tag( /*@out@ */ char *tag)
+{
+	command_id++;
+	sprintf(tag, TAG_FORMAT, command_id % 1000);
+}
 
 static void ask_user_for_password( /*@notnull@ */ Pop3 pc,
 								  int bFlushCache);
@@ -86,49 +159,60 @@ static struct imap_authentication_method {
 };
 
 
+/* pc's connection in the pool */
+/*@null@*/
+/*@dependent@*/
+static struct fdmap_struct *fdmap_for_pcu(Pop3 pc)
+{
+	struct fdmap_struct *f;
+	for (f = fdmap[PCU.conn_hash % POOL_BUCKETS]; f != NULL; f = f->next)
+		if (f->hash == PCU.conn_hash && f->port == PCU.serverPort
+			&& strcmp(f->user, PCU.userName) == 0
+			&& strcmp(f->server, PCU.serverName) == 0)
+			return f;
+	return NULL;
+}
+
 /* recover a socket from the connection cache */
 /*@null@*/
 /*@dependent@*/
 static struct connection_state *state_for_pcu(Pop3 pc)
 {
-	char *connection_id;
-	struct connection_state *retval = NULL;
-	int i;
-	connection_id =
-		malloc(strlen(PCU.userName) + strlen(PCU.serverName) + 22);
-	sprintf(connection_id, "%s|%s|%d", PCU.userName, PCU.serverName,
-			PCU.serverPort);
-	for (i = 0; i < FDMAP_SIZE; i++)
-		if (fdmap[i].user_server_port != NULL &&
-			(strcmp(connection_id, fdmap[i].user_server_port) == 0)) {
-			retval = fdmap[i].cs;
-		}
-	free(connection_id);
-	return (retval);
+	struct fdmap_struct *f = fdmap_for_pcu(pc);
+	return (f != NULL) ? f->cs : NULL;
 }
 
-/* bind to the connection cache */
-static void bind_state_to_pcu(Pop3 pc,
-							  /*@owned@ */ struct connection_state *scs)
+/* bind to the connection cache; returns NULL, leaving scs to the
+   caller, if there's no memory for it */
+/*@null@*/
+/*@dependent@*/
+static struct fdmap_struct *bind_state_to_pcu(Pop3 pc,
+											  /*@owned@ */ struct
+											  connection_state *scs)
 {
-	char *connection_id;
-	int i;
+	struct fdmap_struct *f;
+	unsigned long bucket = PCU.conn_hash % POOL_BUCKETS;
 	if (scs == NULL) {
 		abort();
 	}
-	connection_id =
-		malloc(strlen(PCU.userName) + strlen(PCU.serverName) + 22);
-	sprintf(connection_id, "%s|%s|%d", PCU.userName, PCU.serverName,
-			PCU.serverPort);
-	for (i = 0; i < FDMAP_SIZE && fdmap[i].cs != NULL; i++);
-	if (i == FDMAP_SIZE) {
-		/* should never happen */
-		IMAP_DM(pc, DEBUG_ERROR,
-				"Tried to open too many IMAP connections. Sorry!\n");
-		exit(EXIT_FAILURE);
+	f = calloc(1, sizeof(struct fdmap_struct));
+	if (f == NULL)
+		return NULL;
+	f->user = strdup(PCU.userName);
+	f->server = strdup(PCU.serverName);
+	if (f->user == NULL || f->server == NULL) {
+		free(f->user);
+		free(f->server);
+		free(f);
+		return NULL;
 	}
-	fdmap[i].user_server_port = connection_id;
-	fdmap[i].cs = scs;
+	f->hash = PCU.conn_hash;
+	f->port = PCU.serverPort;
+	f->cs = scs;
+	f->last_used = f->last_noop = time(0);
+	f->next = fdmap[bucket];
+	fdmap[bucket] = f;
+	return f;
 }
 
 /* remove from the connection cache */
@@ -139,20 +223,492 @@ struct connection_state *unbind(
 /*@returned@*/ struct connection_state
 								   *scs)
 {
-	int i;
+	struct fdmap_struct **fp, *f = NULL;
 	struct connection_state *retval = NULL;
+	int b;
 	assert(scs != NULL);
 
-	for (i = 0; i < FDMAP_SIZE && fdmap[i].cs != scs; i++);
-	if (i < FDMAP_SIZE) {
-		free(fdmap[i].user_server_port);
-		fdmap[i].user_server_port = NULL;
-		retval = fdmap[i].cs;
-		fdmap[i].cs = NULL;
+	for (b = 0; b < POOL_BUCKETS && f == NULL; b++)
+		for (fp = &fdmap[b]; *fp != NULL; fp = &(*fp)->next)
+			if ((*fp)->cs == scs) {
+				f = *fp;
+				*fp = f->next;
+				break;
+			}
+	if (f != NULL) {
+		retval = f->cs;
+		/* back to polling until it's connected again */
+		if (f->idler != NULL)
+			f->idler->watched = 0;
+		while (f->nfolders > 0)
+			f->folders[--f->nfolders]->watched = 0;
+		free(f->folders);
+		while (f->ndue > 0)
+			f->due[--f->ndue]->u.pop_imap.status_ready = 0;
+		free(f->due);
+		free(f->user);
+		free(f->server);
+		free(f);
 	}
 	return (retval);
 }
 
+/*@null@*/
+/*@dependent@*/
+static struct fdmap_struct *fdmap_entry(const struct connection_state *scs)
+{
+	struct fdmap_struct *f;
+	int b;
+	for (b = 0; b < POOL_BUCKETS; b++)
+		for (f = fdmap[b]; f != NULL; f = f->next)
+			if (f->cs == scs && scs != NULL)
+				return f;
+	return NULL;
+}
+
+/* whether path, as configured (maybe quoted), names folder */
+static int same_folder(const char *path, const char *folder)
+{
+	size_t len = strlen(path);
+	if (len >= 2 && path[0] == '"' && path[len - 1] == '"') {
+		path++;
+		len -= 2;
+	}
+	if (len != strlen(folder))
+		return 0;
+	if (len == 5 && strncasecmp(path, "INBOX", 5) == 0)
+		return (strcasecmp(folder, "INBOX") == 0);
+	return (strncmp(path, folder, len) == 0);
+}
+
+static void note_news(Pop3 pc)
+{
+	if (!PCU.news) {
+		IMAP_DM(pc, DEBUG_INFO, "%s changed\n", pc->path);
+		PCU.news = 1;
+		pc->prevtime = 0;		/* check it now */
+	}
+}
+
+/* whether r, an untagged response, means a folder changed: in
+   the selected one, mail arrived (EXISTS), was removed (EXPUNGE),
+   or its flags changed (FETCH), as when it's read elsewhere; in
+   the others, NOTIFY sends a STATUS.  a handler, for f. */
+static void idle_news(const struct imap_response *r, void *arg)
+{
+	struct fdmap_struct *f = arg;
+	int i;
+
+	if (r->numbered) {
+		if (f->idler != NULL && (imap_is(r, "EXISTS")
+								 || imap_is(r, "EXPUNGE")
+								 || imap_is(r, "FETCH")))
+			note_news(f->idler);
+	} else if (f->notify_set && imap_is(r, "STATUS") && r->args != NULL
+			   && r->args->text != NULL) {
+		for (i = 0; i < f->nfolders; i++)
+			if (same_folder(f->folders[i]->path, r->args->text))
+				note_news(f->folders[i]);
+	}
+}
+
+/* pc is checked on this connection: with NOTIFY, it's to be
+   registered too */
+static void add_folder(struct fdmap_struct *f, Pop3 pc)
+{
+	Pop3 *more;
+	int i;
+	if (!f->can_notify)
+		return;
+	for (i = 0; i < f->nfolders; i++)
+		if (f->folders[i] == pc)
+			return;
+	more = realloc(f->folders, (f->nfolders + 1) * sizeof(Pop3));
+	if (more == NULL)
+		return;					/* it's polled */
+	f->folders = more;
+	f->folders[f->nfolders++] = pc;
+	f->notify_set = 0;
+}
+
+/* whether the server will tell us when pc's folder changes */
+static int pushed(const struct fdmap_struct *f, const Pop3 pc)
+{
+	int i;
+	if (!f->idling)
+		return 0;
+	if (f->idler == pc)
+		return 1;
+	for (i = 0; f->notify_set && i < f->nfolders; i++)
+		if (f->folders[i] == pc)
+			return 1;
+	return 0;
+}
+
+/* read responses up to the one tagged tag, or a continuation
+   ("+ idling") if continuation is set, noting news on the way
+   if count_news is; as imap_await */
+static int
+await_tagged(struct fdmap_struct *f, const char *tag, int continuation,
+			 int count_news)
+{
+	struct imap_handler news[] = {
+		{NULL, idle_news, f},
+		{NULL, NULL, NULL}
+	};
+	return imap_await(f->cs, tag, continuation, count_news ? news : NULL);
+}
+
+/* take what the server said while we were in IDLE; returns -1
+   if it hung up */
+static int idle_drain(struct fdmap_struct *f)
+{
+	struct imap_response *r;
+	int got;
+	while ((got = tlscomm_poll(f->cs)) > 0) {
+		/* the rest of it, if it has literals, will be along */
+		if ((r = imap_read_response(f->cs)) == NULL)
+			return -1;
+		idle_news(r, f);
+		imap_free_response(r);
+	}
+	return got;
+}
+
+/* leave IDLE, so that other commands can be sent; returns 0 if
+   the connection failed */
+static int idle_end(struct fdmap_struct *f)
+{
+	if (!f->idling)
+		return 1;
+	f->idling = 0;
+	tlscomm_printf(f->cs, "DONE\r\n");
+	return (await_tagged(f, f->idle_tag, 0, 1) >= 0);
+}
+
+/* ask for STATUS when any of the folders changes; returns 0 if
+   the connection failed */
+static int notify_set(struct fdmap_struct *f)
+{
+	char tag[8];
+	int i, ok;
+
+	while (f->can_notify && !f->notify_set) {
+		next_tag(tag);
+		/* may well be too long for one tlscomm_printf */
+		tlscomm_printf(f->cs, "%s NOTIFY SET (selected %s) (mailboxes (",
+					   tag, f->notify_events);
+		for (i = 0; i < f->nfolders; i++)
+			tlscomm_printf(f->cs, "%s%s", (i > 0) ? " " : "",
+						   f->folders[i]->path);
+		tlscomm_printf(f->cs, ") %s)\r\n", f->notify_events);
+		ok = await_tagged(f, tag, 0, 0);
+		if (ok < 0)
+			return 0;
+		if (ok > 0) {
+			f->notify_set = 1;
+		} else if (strstr(f->notify_events, "FlagChange") != NULL) {
+			/* not for folders that aren't selected, maybe; then
+			   mail read elsewhere shows up at the next poll */
+			f->notify_events = "(MessageNew MessageExpunge)";
+		} else {
+			IMAP_DM(f->idler, DEBUG_ERROR,
+					"NOTIFY refused; polling the other folders\n");
+			f->can_notify = 0;
+		}
+	}
+	return 1;
+}
+
+/* if the server can, wait in IDLE for the folder of the first
+   mailbox to be checked on this connection, and with NOTIFY, for
+   the rest; returns 0 if the connection failed */
+static int idle_begin(Pop3 pc, struct fdmap_struct *f)
+{
+	/* NOTIFY is already on: a STATUS pushed for another folder
+	   during the EXAMINE is news, but its EXISTS isn't */
+	struct imap_handler status[] = {
+		{"STATUS", idle_news, f},
+		{NULL, NULL, NULL}
+	};
+	char tag[8];
+	int i, ok;
+
+	if (!f->can_idle || f->idling)
+		return 1;
+	if (f->idler == NULL)
+		f->idler = pc;
+	if (notify_set(f) == 0)
+		return 0;
+	if (!f->selected) {
+		next_tag(tag);
+		tlscomm_printf(f->cs, "%s EXAMINE %s\r\n", tag, f->idler->path);
+		ok = imap_await(f->cs, tag, 0, status);
+		if (ok < 0)
+			return 0;
+		if (ok == 0) {
+			IMAP_DM(f->idler, DEBUG_ERROR,
+					"can't EXAMINE %s to IDLE in it; polling\n",
+					f->idler->path);
+			f->can_idle = 0;
+			f->can_notify = 0;
+			f->idler = NULL;
+			return 1;
+		}
+		f->selected = 1;
+	}
+	next_tag(f->idle_tag);
+	tlscomm_printf(f->cs, "%s IDLE\r\n", f->idle_tag);
+	ok = await_tagged(f, f->idle_tag, 1, 1);
+	if (ok < 0)
+		return 0;
+	if (ok == 0) {
+		IMAP_DM(f->idler, DEBUG_ERROR, "IDLE refused; polling\n");
+		f->can_idle = 0;
+		f->can_notify = 0;
+		f->idler->watched = 0;
+		f->idler = NULL;
+		return 1;
+	}
+	f->idling = 1;
+	f->idle_since = time(0);
+	f->idler->watched = 1;
+	for (i = 0; f->notify_set && i < f->nfolders; i++)
+		f->folders[i]->watched = 1;
+	/* news that came along with the continuation won't make the
+	   socket readable */
+	return (idle_drain(f) >= 0);
+}
+
+int imap_idle_fds(int *fds, int max)
+{
+	struct fdmap_struct *f;
+	int b, n = 0;
+	for (b = 0; b < POOL_BUCKETS; b++)
+		for (f = fdmap[b]; f != NULL && n < max; f = f->next)
+			if (f->idling)
+				fds[n++] = tlscomm_fd(f->cs);
+	return n;
+}
+
+void imap_idle_dispatch(int fd)
+{
+	struct fdmap_struct *f;
+	int b, i;
+
+	for (b = 0; b < POOL_BUCKETS; b++)
+		for (f = fdmap[b]; f != NULL; f = f->next) {
+			if (!f->idling || tlscomm_fd(f->cs) != fd)
+				continue;
+			if (idle_drain(f) < 0) {
+				/* the server hung up; its mailboxes reconnect
+				   when they're checked, which is now */
+				if (f->idler != NULL)
+					f->idler->prevtime = 0;
+				for (i = 0; i < f->nfolders; i++)
+					f->folders[i]->prevtime = 0;
+				tlscomm_close(unbind(f->cs));
+			}
+			return;
+		}
+}
+
+/* log out and close; its mailboxes connect again when they're
+   next checked */
+static void pool_close(struct fdmap_struct *f)
+{
+	struct connection_state *scs = f->cs;
+	if (f->idling)
+		(void) idle_end(f);
+	tlscomm_printf(scs, "a002 LOGOUT\r\n");
+	tlscomm_close(unbind(scs));
+}
+
+/* make room for pc's connection, if its server already has
+   POOL_PER_SERVER */
+static void pool_make_room(Pop3 pc)
+{
+	struct fdmap_struct *f, *lru = NULL;
+	int b, n = 0;
+	for (b = 0; b < POOL_BUCKETS; b++)
+		for (f = fdmap[b]; f != NULL; f = f->next)
+			if (f->port == PCU.serverPort
+				&& strcmp(f->server, PCU.serverName) == 0) {
+				n++;
+				if (lru == NULL || f->last_used < lru->last_used)
+					lru = f;
+			}
+	if (n >= POOL_PER_SERVER) {
+		IMAP_DM(pc, DEBUG_INFO, "closing %s@%s to make room\n",
+				lru->user, lru->server);
+		pool_close(lru);
+	}
+}
+
+void imap_keepalive(time_t now)
+{
+	struct fdmap_struct *f, *next;
+	int b;
+
+	for (b = 0; b < POOL_BUCKETS; b++)
+		for (f = fdmap[b]; f != NULL; f = next) {
+			char tag[8];
+			next = f->next;
+			/* an IDLE is kept up by its mailbox's checks */
+			if (f->idling || tlscomm_is_blacklisted(f->cs) != 0)
+				continue;
+			/* a check keeps it alive as well as a NOOP does */
+			if (now >= f->last_used + POOL_EVICT) {
+				pool_close(f);
+			} else if (now >= max(f->last_used, f->last_noop)
+					   + POOL_KEEPALIVE) {
+				f->last_noop = now;
+				next_tag(tag);
+				tlscomm_printf(f->cs, "%s NOOP\r\n", tag);
+				if (await_tagged(f, tag, 0, 1) < 0)
+					tlscomm_close(unbind(f->cs));
+			}
+		}
+}
+
+/* a number in a STATUS or FETCH list, as imap_item finds it; 0
+   if it isn't there */
+static unsigned long long
+item_number(const struct imap_token *list, const char *key)
+{
+	const struct imap_token *t = imap_item(list, key);
+	return (t != NULL && t->text != NULL) ? strtoull(t->text, NULL, 10) : 0;
+}
+
+/* whether pc's folder has to be asked about, as opposed to the
+   server telling us if it changed */
+static int status_wanted(const struct fdmap_struct *f, Pop3 pc)
+{
+	return (!pushed(f, pc) || PCU.news
+			|| time(0) >= f->idle_since + IDLE_RENEW);
+}
+
+static void add_due(struct fdmap_struct *f, Pop3 pc)
+{
+	int i;
+	for (i = 0; i < f->ndue; i++)
+		if (f->due[i] == pc)
+			return;
+	if (f->ndue == f->alloc_due) {
+		int alloc = (f->alloc_due > 0) ? f->alloc_due * 2 : 8;
+		Pop3 *more = realloc(f->due, alloc * sizeof(Pop3));
+		if (more == NULL)
+			return;
+		f->due = more;
+		f->alloc_due = alloc;
+	}
+	f->due[f->ndue++] = pc;
+}
+
+/* the folders asked about by status_batch */
+struct batch {
+	struct fdmap_struct *f;
+	int n;						/* the first n of f->due */
+};
+
+/* a STATUS response: MESSAGES and UNSEEN, in any order, go
+   straight into the mailbox it's for */
+static void got_status(const struct imap_response *r, void *arg)
+{
+	struct batch *b = arg;
+	const struct imap_token *items = NULL;
+	Pop3 p = NULL;
+	int i;
+
+	if (r->args != NULL && r->args->text != NULL
+		&& r->args->next != NULL && r->args->next->kind == IMAP_LIST) {
+		items = r->args->next->list;
+		for (i = 0; i < b->n && p == NULL; i++)
+			if (!b->f->due[i]->u.pop_imap.status_ready
+				&& same_folder(b->f->due[i]->path, r->args->text))
+				p = b->f->due[i];
+	}
+	/* with NOTIFY, the server's own STATUS may turn up, without
+	   UNSEEN */
+	if (p == NULL || imap_item(items, "MESSAGES") == NULL
+		|| imap_item(items, "UNSEEN") == NULL) {
+		idle_news(r, b->f);
+		return;
+	}
+	p->TotalMsgs = (int) item_number(items, "MESSAGES");
+	p->UnreadMsgs = (int) item_number(items, "UNSEEN");
+	/* with CONDSTORE, whether anything at all changed */
+	p->u.pop_imap.modseq = item_number(items, "HIGHESTMODSEQ");
+	p->u.pop_imap.status_ready = 1;
+}
+
+/* send STATUS for every folder due on the connection, back to
+   back, and then sort out the replies by mailbox name, so that
+   the lot costs one round trip.  the counts go straight into
+   each mailbox, for its checkMail to find.  returns 0 if the
+   connection failed. */
+static int status_batch(struct fdmap_struct *f)
+{
+	struct batch b;
+	struct imap_handler handlers[] = {
+		{"STATUS", got_status, &b},
+		{NULL, idle_news, f},
+		{NULL, NULL, NULL}
+	};
+	char (*tags)[8];
+	const char **tagp;
+	int *ok;
+	int i, worked, n = f->ndue;
+
+	if (n == 0)
+		return 1;
+	f->ndue = 0;
+	if (idle_end(f) == 0)
+		return 0;
+	tags = malloc(n * sizeof(*tags));
+	tagp = malloc(n * sizeof(char *));
+	ok = malloc(n * sizeof(int));
+	if (tags == NULL || tagp == NULL || ok == NULL) {
+		/* they're not ready, so it's as if the server said NO */
+		free(tags);
+		free(tagp);
+		free(ok);
+		return 1;
+	}
+	for (i = 0; i < n; i++) {
+		next_tag(tags[i]);
+		tagp[i] = tags[i];
+		f->due[i]->u.pop_imap.news = 0;
+		tlscomm_printf(f->cs, "%s STATUS %s (MESSAGES UNSEEN%s)\r\n",
+					   tags[i], f->due[i]->path,
+					   f->can_condstore ? " HIGHESTMODSEQ" : "");
+	}
+	b.f = f;
+	b.n = n;
+	worked = imap_await_all(f->cs, tagp, n, ok, handlers);
+	for (i = 0; worked && i < n; i++)
+		if (!ok[i])
+			IMAP_DM(f->due[i], DEBUG_ERROR, "STATUS %s failed\n",
+					f->due[i]->path);
+	free(tags);
+	free(tagp);
+	free(ok);
+	return worked;
+}
+
+/* the STATUS for pc's folder is to go out with the others due on
+   its connection; connections that aren't open yet are opened by
+   checkMail */
+static void imap_prefetch(Pop3 pc,
+						  struct stat_batch *b __attribute__ ((unused)))
+{
+	struct fdmap_struct *f = fdmap_for_pcu(pc);
+	if (f == NULL || tlscomm_is_blacklisted(f->cs) != 0)
+		return;
+	if (status_wanted(f, pc))
+		add_due(f, pc);
+}
+
 /* creates a connection to the server, if a matching one doesn't exist. */
 /* *always* returns null, just declared this wasy to match other protocols. */
 /*@null@*/
@@ -161,6 +717,7 @@ FILE *imap_open(Pop3 pc)
 	static int complained_already;	/* we have to succeed once before
 									   complaining again about failure */
 	struct connection_state *scs;
+	struct fdmap_struct *f;
 	struct imap_authentication_method *a;
 	char *connection_name;
 	int sd;
@@ -172,6 +729,7 @@ FILE *imap_open(Pop3 pc)
 		/* don't need to open. */
 		return NULL;
 	}
+	pool_make_room(pc);
 
 	/* got this far; we're going to create a connection_state
 	   structure, although it might be a blacklist entry */
@@ -194,11 +752,11 @@ FILE *imap_open(Pop3 pc)
 			   fast forward time so that the mailbox isn't
 			   checked for a while. */
 			pc->prevtime = time(0) + 60 * 5;	/* now + 60 seconds per min * 5 minutes */
-			/* TCP's retry (how much time has elapsed while
-			   the connect times out) is around 3 minutes;
-			   here we just try to allow checking local
-			   mailboxes more often while remote things are
-			   unavailable or disconnected.  */
+			/* each try costs connecttimeout seconds of
+			   the main loop; here we just try to allow
+			   checking local mailboxes more often while
+			   remote things are unavailable or
+			   disconnected.  */
 		}
 		return NULL;
 	}
@@ -269,8 +827,26 @@ FILE *imap_open(Pop3 pc)
 			|| strstr(PCU.authList, a->name) != NULL)
 			/* try the authentication method */
 			if ((a->auth_callback(pc, scs, capabilities)) != 0) {
+				/* some servers only own up to IDLE, NOTIFY and
+				   CONDSTORE once we've logged in */
+				if (strstr(capabilities, "IDLE") == NULL
+					|| strstr(capabilities, "NOTIFY") == NULL
+					|| strstr(capabilities, "CONDSTORE") == NULL) {
+					tlscomm_printf(scs, "a003 CAPABILITY\r\n");
+					if (tlscomm_expect(scs, "* CAPABILITY", capabilities,
+									   BUF_SIZE) == 0)
+						goto communication_failure;
+				}
 				/* store this well setup connection in the cache */
-				bind_state_to_pcu(pc, scs);
+				f = bind_state_to_pcu(pc, scs);
+				if (f == NULL)
+					goto communication_failure;
+				f->can_idle = (strstr(capabilities, " IDLE") != NULL);
+				f->can_notify = f->can_idle
+					&& (strstr(capabilities, " NOTIFY") != NULL);
+				f->can_condstore =
+					(strstr(capabilities, " CONDSTORE") != NULL);
+				f->notify_events = "(MessageNew MessageExpunge FlagChange)";
 				complained_already = 0;
 				return NULL;
 			}
@@ -293,8 +869,7 @@ int imap_checkmail( /*@notnull@ */ Pop3 pc)
 {
 	/* recover connection state from the cache */
 	struct connection_state *scs = state_for_pcu(pc);
-	char buf[BUF_SIZE];
-	static int command_id;
+	struct fdmap_struct *f;
 
 	/* if it's not in the cache, try to open */
 	if (scs == NULL) {
@@ -312,34 +887,60 @@ int imap_checkmail( /*@notnull@ */ Pop3 pc)
 		return -1;
 	}
 
-	/* if we've got it by now, try the status query */
-	command_id++;
-	tlscomm_printf(scs, "a%03d STATUS %s (MESSAGES UNSEEN)\r\n",
-				   command_id % 1000, pc->path);
-	if (tlscomm_expect(scs, "* STATUS", buf, 127) != 0) {
-		/* a valid response? */
-		// doesn't support spaces: (void) sscanf(buf, "* STATUS %*s (MESSAGES %d UNSEEN %d)",
-		const char *msg;
-		msg = strstr(buf, "(MESSAGES");
-		if (msg != NULL)
-			(void) sscanf(msg, "(MESSAGES %d UNSEEN %d)",
-						  &(pc->TotalMsgs), &(pc->UnreadMsgs));
-		/* update the cached headers if evidence that change
-		   has occurred; not necessarily complete. */
-		if (pc->UnreadMsgs != pc->OldUnreadMsgs ||
-			pc->TotalMsgs != pc->OldMsgs) {
-			if (PCU.wantCacheHeaders) {
-				imap_cacheHeaders(pc);
-			}
+	f = fdmap_for_pcu(pc);
+	f->last_used = time(0);
+	add_folder(f, pc);
+	if (!PCU.status_ready) {
+		if (!status_wanted(f, pc)) {
+			/* the server would have told us */
+			IMAP_DM(pc, DEBUG_INFO, "idling, nothing new\n");
+			return 0;
 		}
-	} else {
-		/* something went wrong. bail. */
+		/* with the others due, if imap_prefetch found any */
+		add_due(f, pc);
+		if (status_batch(f) == 0) {
+			tlscomm_close(unbind(scs));
+			return -1;
+		}
+	}
+	if (!PCU.status_ready) {
+		/* the server said NO */
+		if (idle_begin(pc, f) == 0)
+			tlscomm_close(unbind(scs));
+		return -1;
+	}
+	PCU.status_ready = 0;
+
+	/* update the cached headers if evidence that change
+	   has occurred; not necessarily complete, unless the server
+	   has CONDSTORE: then HIGHESTMODSEQ says, and also catches
+	   a message read as another arrives. */
+	if (PCU.header_modseq != 0 ? PCU.modseq != PCU.header_modseq
+		: (pc->UnreadMsgs != pc->OldUnreadMsgs ||
+		   pc->TotalMsgs != pc->OldMsgs)) {
+		if (PCU.wantCacheHeaders) {
+			imap_cacheHeaders(pc);
+		}
+	}
+	/* imap_cacheHeaders may have closed it */
+	scs = state_for_pcu(pc);
+	if (scs != NULL && (f = fdmap_entry(scs)) != NULL
+		&& idle_begin(pc, f) == 0) {
 		tlscomm_close(unbind(scs));
 		return -1;
 	}
 	return 0;
 }
 
+static void free_headers( /*@null@ */ struct msglst *h)
+{
+	while (h != NULL) {
+		struct msglst *n = h->next;
+		free(h);
+		h = n;
+	}
+}
+
 void
 imap_releaseHeaders(Pop3 pc __attribute__ ((unused)), struct msglst *h)
 {
@@ -347,21 +948,432 @@ imap_releaseHeaders(Pop3 pc __attribute__ ((unused)), struct msglst *h)
 	/* allow the list to be released next time around */
 	if (h->in_use <= 0) {
 		/* free the old one */
-		while (h != NULL) {
-			struct msglst *n = h->next;
-			free(h);
-			h = n;
-		}
+		free_headers(h);
 	} else {
 		h->in_use--;
 	}
 }
 
+static int add_uid(unsigned int **uids, int *nuids, int *alloc,
+				   unsigned int uid)
+{
+	if (*nuids == *alloc) {
+		unsigned int *more;
+		int bigger = (*alloc > 0) ? *alloc * 2 : 64;
+		more = realloc(*uids, bigger * sizeof(unsigned int));
+		if (more == NULL)
+			return 0;
+		*uids = more;
+		*alloc = bigger;
+	}
+	(*uids)[(*nuids)++] = uid;
+	return 1;
+}
+
+/* uids as they come in, from SEARCH or FETCH responses */
+struct uid_list {
+	unsigned int *uids;
+	int n, alloc;
+	int failed;					/* out of memory */
+};
+
+/* a SEARCH response, however long */
+static void got_search(const struct imap_response *r, void *arg)
+{
+	struct uid_list *l = arg;
+	const struct imap_token *t;
+	for (t = r->args; t != NULL; t = t->next)
+		/* not the (MODSEQ n) that CONDSTORE may add */
+		if (t->kind == IMAP_ATOM && isdigit((unsigned char) t->text[0])
+			&& add_uid(&l->uids, &l->n, &l->alloc,
+					   (unsigned int) strtoul(t->text, NULL, 10)) == 0)
+			l->failed = 1;
+}
+
+/* the UIDs in the SEARCH response to tag; returns 0 if the
+   connection failed */
+static int
+search_uids(struct fdmap_struct *f, const char *tag,
+			/*@out@ */ unsigned int **uids, /*@out@ */ int *nuids)
+{
+	struct uid_list l = { NULL, 0, 0, 0 };
+	struct imap_handler handlers[] = {
+		{"SEARCH", got_search, &l},
+		{NULL, idle_news, f},
+		{NULL, NULL, NULL}
+	};
+	int ok = imap_await(f->cs, tag, 0, handlers);
+	*uids = l.uids;
+	*nuids = l.n;
+	return (ok >= 0 && !l.failed);
+}
+
+/* uids, ascending, as ranges: 1:3,7,9:12 */
+static void
+send_uid_set(struct connection_state *scs, const unsigned int *uids, int n)
+{
+	int i, j;
+	for (i = 0; i < n; i = j + 1) {
+		for (j = i; j + 1 < n && uids[j + 1] == uids[j] + 1; j++);
+		if (j > i)
+			tlscomm_printf(scs, "%s%u:%u", (i > 0) ? "," : "",
+						   uids[i], uids[j]);
+		else
+			tlscomm_printf(scs, "%s%u", (i > 0) ? "," : "", uids[i]);
+	}
+}
+
+/* copy a header's value, or a folded continuation of it, into
+   field; the line ends are dropped */
+static void header_value(char *field, size_t size, const char *value)
+{
+	size_t len = strlen(field);
+	while (*value == ' ' || *value == '\t')
+		value++;
+	if (len > 0 && len < size - 1)
+		field[len++] = ' ';
+	for (; *value != '\0' && *value != '\r' && *value != '\n'
+		 && len < size - 1; value++)
+		field[len++] = *value;
+	field[len] = '\0';
+}
+
+/* the From and Subject in a header section, unfolded */
+static void header_fields(struct msglst *m, const char *text)
+{
+	char *field = NULL;			/* the header being read */
+	size_t size = 0;
+	const char *line = text;
+
+	while (*line != '\0') {
+		if (strncasecmp(line, "Subject:", 8) == 0) {
+			field = m->subj;
+			size = SUBJ_LEN;
+			header_value(field, size, line + 8);
+		} else if (strncasecmp(line, "From:", 5) == 0) {
+			field = m->from;
+			size = FROM_LEN;
+			header_value(field, size, line + 5);
+		} else if ((line[0] == ' ' || line[0] == '\t') && field != NULL) {
+			header_value(field, size, line);
+		} else {
+			field = NULL;
+		}
+		line = strchr(line, '\n');
+		if (line == NULL)
+			break;
+		line++;
+	}
+}
+
+/* the headers fetched by fetch_headers, so far */
+struct fetching {
+	Pop3 pc;
+	struct fdmap_struct *f;
+	struct msglst *fetched;
+	int failed;					/* out of memory */
+};
+
+/* a FETCH response with a header section, in whichever order it
+   has the UID and the section */
+static void got_headers(const struct imap_response *r, void *arg)
+{
+	struct fetching *s = arg;
+	const struct imap_token *t, *section = NULL;
+	struct msglst *m;
+
+	if (r->args != NULL && r->args->kind == IMAP_LIST)
+		for (t = r->args->list; t != NULL && t->next != NULL;
+			 t = t->next->next)
+			if (t->kind == IMAP_ATOM && strncasecmp(t->text, "BODY[", 5) == 0)
+				section = t->next;
+	if (section == NULL) {
+		/* a flag change, which has no headers */
+		idle_news(r, s->f);
+		return;
+	}
+	m = malloc(sizeof(struct msglst));
+	if (m == NULL) {
+		s->failed = 1;
+		return;
+	}
+	m->uid = (unsigned int) item_number(r->args->list, "UID");
+	if (m->uid == 0) {
+		free(m);
+		return;
+	}
+	m->subj[0] = '\0';
+	m->from[0] = '\0';
+	/* or NIL */
+	if (section->kind == IMAP_STRING)
+		header_fields(m, section->text);
+	if (m->from[0] == '\0')
+		strcpy(m->from, " ");
+	if (m->subj[0] == '\0')
+		strcpy(m->subj, "(no subject)");
+	IMAP_DM(s->pc, DEBUG_INFO, "UID %u From: '%s' Subj: '%s'\n",
+			m->uid, m->from, m->subj);
+	m->next = s->fetched;
+	m->in_use = 0;
+	s->fetched = m;
+}
+
+/* the FETCH responses to tag, each header section a {literal},
+   onto *fetched; returns 0 if the connection failed */
+static int fetch_headers(Pop3 pc, struct fdmap_struct *f, const char *tag,
+						 struct msglst **fetched)
+{
+	struct fetching s;
+	struct imap_handler handlers[] = {
+		{"FETCH", got_headers, &s},
+		{NULL, idle_news, f},
+		{NULL, NULL, NULL}
+	};
+	int ok;
+
+	s.pc = pc;
+	s.f = f;
+	s.fetched = *fetched;
+	s.failed = 0;
+	ok = imap_await(f->cs, tag, 0, handlers);
+	*fetched = s.fetched;
+	if (ok == 0)
+		IMAP_DM(pc, DEBUG_ERROR, "error fetching headers\n");
+	return (ok >= 0 && !s.failed);
+}
+
+/* what an EXAMINE says of the folder */
+struct examined {
+	unsigned long uidvalidity;
+	unsigned long long modseq;
+};
+
+/* an untagged OK with a response code, during EXAMINE */
+static void got_examined(const struct imap_response *r, void *arg)
+{
+	struct examined *e = arg;
+	if (r->code == NULL)
+		return;
+	if (strncasecmp(r->code, "UIDVALIDITY ", 12) == 0)
+		e->uidvalidity = strtoul(r->code + 12, NULL, 10);
+	else if (strncasecmp(r->code, "HIGHESTMODSEQ ", 14) == 0)
+		e->modseq = strtoull(r->code + 14, NULL, 10);
+}
+
+/* await the reply to an EXAMINE, noting the folder's UIDVALIDITY
+   and HIGHESTMODSEQ, and any STATUS NOTIFY pushes for the others;
+   as await_tagged */
+static int
+await_examine(struct fdmap_struct *f, const char *tag,
+			  unsigned long *uidvalidity, unsigned long long *modseq)
+{
+	struct examined e = { 0, 0 };
+	struct imap_handler handlers[] = {
+		{"OK", got_examined, &e},
+		{"STATUS", idle_news, f},
+		{NULL, NULL, NULL}
+	};
+	int ok = imap_await(f->cs, tag, 0, handlers);
+	*uidvalidity = e.uidvalidity;
+	*modseq = e.modseq;
+	return ok;
+}
+
+static int uid_order(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *) a;
+	unsigned int y = *(const unsigned int *) b;
+	return (x > y) - (x < y);
+}
+
+static int newest_first(const void *a, const void *b)
+{
+	unsigned int x = (*(struct msglst * const *) a)->uid;
+	unsigned int y = (*(struct msglst * const *) b)->uid;
+	return (x < y) - (x > y);
+}
+
+/* uids, ascending, without duplicates or any of drop, which is
+   ascending too; returns how many are left */
+static int
+sort_uids(unsigned int *uids, int nuids, const unsigned int *drop,
+		  int ndrop)
+{
+	int i, j = 0, n = 0;
+	qsort(uids, nuids, sizeof(unsigned int), uid_order);
+	for (i = 0; i < nuids; i++) {
+		if (n > 0 && uids[i] == uids[n - 1])
+			continue;
+		while (j < ndrop && drop[j] < uids[i])
+			j++;
+		if (j < ndrop && drop[j] == uids[i])
+			continue;
+		uids[n++] = uids[i];
+	}
+	return n;
+}
+
+/* what changed_uids learns from the FETCH responses */
+struct changes {
+	struct fdmap_struct *f;
+	struct uid_list unseen, seen;
+};
+
+/* a FETCH response with the flags of a message that changed */
+static void got_flags(const struct imap_response *r, void *arg)
+{
+	struct changes *c = arg;
+	const struct imap_token *flags = NULL, *t;
+	struct uid_list *l = &c->unseen;
+	unsigned int uid = 0;
+
+	if (r->args != NULL && r->args->kind == IMAP_LIST) {
+		uid = (unsigned int) item_number(r->args->list, "UID");
+		flags = imap_item(r->args->list, "FLAGS");
+	}
+	if (uid == 0 || flags == NULL || flags->kind != IMAP_LIST) {
+		idle_news(r, c->f);
+		return;
+	}
+	for (t = flags->list; t != NULL; t = t->next)
+		if (t->text != NULL && strcasecmp(t->text, "\\Seen") == 0)
+			l = &c->seen;
+	if (add_uid(&l->uids, &l->n, &l->alloc, uid) == 0)
+		l->failed = 1;
+}
+
+/* with CONDSTORE: the uids unseen now, worked out from those in
+   pc->headerCache and the flags of just the messages that changed
+   since modseq, new ones among them, instead of searching the
+   whole folder.  messages expunged meanwhile aren't reported, so
+   the caller checks the count.  returns 1 if it worked, -1 if the
+   server wouldn't, or 0 if the connection failed */
+static int
+changed_uids(Pop3 pc, struct fdmap_struct *f, unsigned long long since,
+			 /*@out@ */ unsigned int **uids, /*@out@ */ int *nuids)
+{
+	struct changes c;
+	struct imap_handler handlers[] = {
+		{"FETCH", got_flags, &c},
+		{NULL, idle_news, f},
+		{NULL, NULL, NULL}
+	};
+	char tag[8];
+	const struct msglst *m;
+	int ok, worked;
+
+	memset(&c, 0, sizeof(c));
+	c.f = f;
+	for (m = pc->headerCache; m != NULL; m = m->next)
+		if (add_uid(&c.unseen.uids, &c.unseen.n, &c.unseen.alloc,
+					m->uid) == 0)
+			c.unseen.failed = 1;
+
+	next_tag(tag);
+	tlscomm_printf(f->cs, "%s UID FETCH 1:* (FLAGS) (CHANGEDSINCE %llu)\r\n",
+				   tag, since);
+	ok = imap_await(f->cs, tag, 0, handlers);
+	worked = (ok > 0 && !c.unseen.failed && !c.seen.failed);
+	if (worked) {
+		qsort(c.seen.uids, c.seen.n, sizeof(unsigned int), uid_order);
+		*nuids = sort_uids(c.unseen.uids, c.unseen.n, c.seen.uids,
+						   c.seen.n);
+		*uids = c.unseen.uids;
+	} else {
+		free(c.unseen.uids);
+		*uids = NULL;
+		*nuids = 0;
+	}
+	free(c.seen.uids);
+	return (ok < 0) ? 0 : worked ? 1 : -1;
+}
+
+/* the headers of the unseen uids, ascending: those in old are
+   copied, and the uids of the rest are left in missing, ascending.
+   returns how many were copied onto *kept, or -1 if out of memory */
+static int
+keep_headers( /*@null@ */ const struct msglst *old,
+			 const unsigned int *uids, int nuids,
+			 struct msglst **kept, unsigned int *missing, int *nmissing)
+{
+	int i, count = 0;
+
+	*nmissing = 0;
+	/* old is newest first, so both are walked down */
+	for (i = nuids - 1; i >= 0; i--) {
+		while (old != NULL && old->uid > uids[i])
+			old = old->next;
+		if (old != NULL && old->uid == uids[i]) {
+			struct msglst *m = malloc(sizeof(struct msglst));
+			if (m == NULL)
+				return -1;
+			*m = *old;
+			m->in_use = 0;
+			m->next = *kept;
+			*kept = m;
+			count++;
+		} else {
+			missing[nuids - 1 - (*nmissing)++] = uids[i];
+		}
+	}
+	memmove(missing, missing + nuids - *nmissing,
+			*nmissing * sizeof(unsigned int));
+	return count;
+}
+
+/* link a and b into one list, newest first */
+static struct msglst *merge_headers( /*@null@ */ struct msglst *a,
+									/*@null@ */ struct msglst *b)
+{
+	struct msglst **all, *m, *h = NULL;
+	int n = 0, i;
+
+	for (m = a; m != NULL; m = m->next)
+		n++;
+	for (m = b; m != NULL; m = m->next)
+		n++;
+	if (n == 0)
+		return NULL;
+	all = malloc(n * sizeof(struct msglst *));
+	if (all == NULL) {
+		/* unsorted, then */
+		for (m = a; m != NULL && m->next != NULL; m = m->next);
+		if (m == NULL)
+			return b;
+		m->next = b;
+		return a;
+	}
+	for (i = 0, m = a; m != NULL; m = m->next)
+		all[i++] = m;
+	for (m = b; m != NULL; m = m->next)
+		all[i++] = m;
+	qsort(all, n, sizeof(struct msglst *), newest_first);
+	for (i = n - 1; i >= 0; i--) {
+		all[i]->next = h;
+		h = all[i];
+	}
+	free(all);
+	return h;
+}
+
+/* what the headers are saved under in the cache directory */
+static void header_key(Pop3 pc, char *key, size_t size)
+{
+	snprintf(key, size, "%s@%s/%s", PCU.userName, PCU.serverName,
+			 pc->path);
+}
+
 void imap_cacheHeaders( /*@notnull@ */ Pop3 pc)
 {
 	struct connection_state *scs = state_for_pcu(pc);
-	char *msgid;
-	char buf[BUF_SIZE];
+	struct fdmap_struct *f;
+	char tag[8];
+	char key[3 * BUF_BIG];
+	unsigned int *uids = NULL, *missing;
+	int nuids = 0, nmissing, nkept, nold = 0, same;
+	unsigned long uidvalidity = 0;
+	unsigned long long modseq = 0;
+	struct msglst *kept = NULL, *fetched = NULL, *m;
 
 	if (scs == NULL) {
 		(void) imap_open(pc);
@@ -373,91 +1385,126 @@ void imap_cacheHeaders( /*@notnull@ */ Pop3 pc)
 	if (tlscomm_is_blacklisted(scs) != 0) {
 		return;
 	}
-
-	if (pc->headerCache != NULL) {
-		/* decrement the reference count, and free our version */
-		imap_releaseHeaders(pc, pc->headerCache);
-		pc->headerCache = NULL;
+	f = fdmap_for_pcu(pc);
+	f->last_used = time(0);
+	if (idle_end(f) == 0) {
+		tlscomm_close(unbind(scs));
+		return;
+	}
+	/* EXAMINE and CLOSE below leave no folder selected */
+	f->selected = 0;
+
+	/* what was fetched before wmbiff was last started */
+	header_key(pc, key, sizeof(key));
+	if (!PCU.headers_loaded) {
+		PCU.headers_loaded = 1;
+		if (pc->headerCache == NULL)
+			pc->headerCache = header_cache_load(key, &PCU.uidvalidity,
+												&PCU.header_modseq);
 	}
 
 	IMAP_DM(pc, DEBUG_INFO, "working headers\n");
 
-	tlscomm_printf(scs, "a004 EXAMINE %s\r\n", pc->path);
-	if (tlscomm_expect(scs, "a004 OK", buf, 127) == 0) {
+	next_tag(tag);
+	tlscomm_printf(scs, "%s EXAMINE %s%s\r\n", tag, pc->path,
+				   f->can_condstore ? " (CONDSTORE)" : "");
+	if (await_examine(f, tag, &uidvalidity, &modseq) <= 0) {
 		tlscomm_close(unbind(scs));
 		return;
 	}
-	IMAP_DM(pc, DEBUG_INFO, "examine ok\n");
+	IMAP_DM(pc, DEBUG_INFO, "examine ok, uidvalidity %lu modseq %llu\n",
+			uidvalidity, modseq);
+	same = (uidvalidity != 0 && uidvalidity == PCU.uidvalidity);
+
+	if (same && modseq != 0 && modseq == PCU.header_modseq) {
+		/* nothing has changed since the headers were fetched */
+		IMAP_DM(pc, DEBUG_INFO, "headers up to date\n");
+		PCU.modseq = modseq;
+		goto worked;
+	}
+	if (same && modseq != 0 && PCU.header_modseq != 0) {
+		int ok = changed_uids(pc, f, PCU.header_modseq, &uids, &nuids);
+		if (ok == 0) {
+			tlscomm_close(unbind(scs));
+			return;
+		}
+		if (ok < 0 || nuids != pc->UnreadMsgs) {
+			/* some were expunged, or the count is stale */
+			IMAP_DM(pc, DEBUG_INFO, "changes: %d unseen, expected %d\n",
+					nuids, pc->UnreadMsgs);
+			free(uids);
+			uids = NULL;
+		}
+	}
+	if (uids == NULL) {
+		next_tag(tag);
+		tlscomm_printf(scs, "%s UID SEARCH UNSEEN\r\n", tag);
+		if (search_uids(f, tag, &uids, &nuids) == 0) {
+			free(uids);
+			tlscomm_close(unbind(scs));
+			return;
+		}
+		qsort(uids, nuids, sizeof(unsigned int), uid_order);
+	}
 
-	/* if we've got it by now, try the status query */
-	tlscomm_printf(scs, "a005 SEARCH UNSEEN\r\n");
-	if (tlscomm_expect(scs, "* SEARCH", buf, 127) == 0) {
-		tlscomm_close(unbind(scs));
+	/* the headers of uids still unseen are kept, unless the
+	   uids now name other messages */
+	for (m = pc->headerCache; m != NULL; m = m->next)
+		nold++;
+	missing = malloc((nuids > 0 ? nuids : 1) * sizeof(unsigned int));
+	if (missing == NULL) {
+		free(uids);
 		return;
 	}
-	IMAP_DM(pc, DEBUG_INFO, "search: %s", buf);
-	if (strlen(buf) < 9)
-		return;					/* search turned up nothing */
-	msgid = strtok(buf + 9, " \r\n");
-	pc->headerCache = NULL;
-	/* the isdigit cruft is to deal with EOL */
-	if (msgid != NULL && isdigit(msgid[0]))
-		do {
-			struct msglst *m = malloc(sizeof(struct msglst));
-			char hdrbuf[128];
-			int fetch_command_done = FALSE;
-			tlscomm_printf(scs, "a04 FETCH %s (FLAGS "
-						   "BODY[HEADER.FIELDS (FROM SUBJECT)])\r\n",
-						   msgid);
-			if (tlscomm_expect(scs, "* ", hdrbuf, 127)) {
-				m->subj[0] = '\0';
-				m->from[0] = '\0';
-				while (m->subj[0] == '\0' || m->from[0] == '\0') {
-					if (tlscomm_expect(scs, "", hdrbuf, 127)) {
-						if (strncasecmp(hdrbuf, "Subject:", 8) == 0) {
-							strncpy(m->subj, hdrbuf + 9, SUBJ_LEN - 1);
-							m->subj[SUBJ_LEN - 1] = '\0';
-						} else if (strncasecmp(hdrbuf, "From: ", 5) == 0) {
-							strncpy(m->from, hdrbuf + 6, FROM_LEN - 1);
-							m->from[FROM_LEN - 1] = '\0';
-						} else if (strncasecmp
-								   (hdrbuf, "a04 OK FETCH", 5) == 0) {
-							/* server says we're done getting this header, which
-							   may occur if the message has no subject */
-							if (m->from[0] == '\0') {
-								strcpy(m->from, " ");
-							}
-							if (m->subj[0] == '\0') {
-								strcpy(m->subj, "(no subject)");
-							}
-							fetch_command_done = TRUE;
-						}
-					} else {
-						IMAP_DM(pc, DEBUG_ERROR,
-								"timedout looking for headers.: %s",
-								hdrbuf);
-						strcpy(m->from, "wmbiff");
-						strcpy(m->subj, "failure");
-					}
-				}
-				IMAP_DM(pc, DEBUG_INFO, "From: '%s' Subj: '%s'\n",
-						m->from, m->subj);
-				m->next = pc->headerCache;
-				pc->headerCache = m;
-				pc->headerCache->in_use = 0;	/* initialize that it isn't locked */
-			} else {
-				IMAP_DM(pc, DEBUG_ERROR, "error fetching: %s", hdrbuf);
-			}
-			if (!fetch_command_done) {
-				tlscomm_expect(scs, "a04 OK", hdrbuf, 127);
-			}
+	nkept = keep_headers(same ? pc->headerCache : NULL, uids, nuids,
+						 &kept, missing, &nmissing);
+	free(uids);
+	if (nkept < 0) {
+		free_headers(kept);
+		free(missing);
+		return;
+	}
+	IMAP_DM(pc, DEBUG_INFO, "search: %d unseen, %d to fetch\n",
+			nkept + nmissing, nmissing);
+
+	if (nmissing > 0) {
+		/* all at once; PEEK, so they aren't marked \Seen */
+		next_tag(tag);
+		tlscomm_printf(scs, "%s UID FETCH ", tag);
+		send_uid_set(scs, missing, nmissing);
+		tlscomm_printf(scs, " (BODY.PEEK[HEADER.FIELDS (FROM SUBJECT)])\r\n");
+		if (fetch_headers(pc, f, tag, &fetched) == 0) {
+			free_headers(kept);
+			free_headers(fetched);
+			free(missing);
+			tlscomm_close(unbind(scs));
+			return;
 		}
-		while ((msgid = strtok(NULL, " \r\n")) != NULL
-			   && isdigit(msgid[0]));
+	}
+	free(missing);
+
+	if (pc->headerCache != NULL) {
+		/* decrement the reference count, and free our version */
+		imap_releaseHeaders(pc, pc->headerCache);
+	}
+	pc->headerCache = merge_headers(kept, fetched);
+	if (nmissing > 0 || nkept != nold || !same
+		|| modseq != PCU.header_modseq) {
+		PCU.uidvalidity = uidvalidity;
+		PCU.header_modseq = modseq;
+		PCU.modseq = modseq;
+		if (header_cache_save(pc->headerCache, key, uidvalidity, modseq)
+			!= 0)
+			IMAP_DM(pc, DEBUG_INFO, "can't save headers: %s\n",
+					strerror(errno));
+	}
 
+  worked:
 	tlscomm_printf(scs, "a06 CLOSE\r\n");	/* return to polling state */
 	/*  may be unneeded tlscomm_expect(scs, "a06 OK CLOSE\r\n" );  see if it worked? */
 	IMAP_DM(pc, DEBUG_INFO, "worked headers\n");
+	if (idle_begin(pc, f) == 0)
+		tlscomm_close(unbind(scs));
 }
 
 /* a client is asking for the headers, hand em a reference, increase the
@@ -552,6 +1599,8 @@ int imap4Create( /*@notnull@ */ Pop3 pc, const char *const str)
 	// grab_authList(unaliased_str + matchedchars, PCU.authList);
 
 	free(unaliased_str);
+	PCU.conn_hash =
+		connection_hash(PCU.userName, PCU.serverName, PCU.serverPort);
 
 	IMAP_DM(pc, DEBUG_INFO, "userName= '%s'\n", PCU.userName);
 	IMAP_DM(pc, DEBUG_INFO, "password is %d characters long\n",
@@ -569,6 +1618,7 @@ int imap4Create( /*@notnull@ */ Pop3 pc, const char *const str)
 		PCU.wantCacheHeaders = 0;
 	}
 	pc->checkMail = imap_checkmail;
+	pc->prefetch = imap_prefetch;
 	pc->getHeaders = imap_getHeaders;
 	pc->releaseHeaders = imap_releaseHeaders;
 	pc->TotalMsgs = 0;
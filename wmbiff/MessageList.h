@@ -5,6 +5,7 @@ struct msglst {
 	struct msglst *next;
 	char subj[SUBJ_LEN];
 	char from[FROM_LEN];
+	unsigned int uid;			/* imap: the message's UID */
 	unsigned int in_use:1;
 };
 
@@ -19,6 +19,7 @@
 #include "regulo.h"
 #include "MessageList.h"
 #include <strings.h>
+#include <errno.h>
 #include "tlsComm.h"
 #include "passwordMgr.h"
 
@@ -82,6 +83,12 @@ struct connection_state *pop3Login(Pop3 pc)
 	if ((fd = sock_connect(PCU.serverName, PCU.serverPort)) == -1) {
 		POP_DM(pc, DEBUG_ERROR, "Not Connected To Server '%s:%d'\n",
 			   PCU.serverName, PCU.serverPort);
+		if (errno == ETIMEDOUT) {
+			/* as for imap: each try costs connecttimeout
+			   seconds of the main loop, so leave the server
+			   alone for five minutes */
+			pc->prevtime = time(0) + 60 * 5;
+		}
 		return NULL;
 	}
 
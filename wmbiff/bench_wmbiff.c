@@ -0,0 +1,636 @@
+/* bench_wmbiff.c - throughput of wmbiff's mailbox scanners on
+   synthetic mailboxes, and of tlsComm's line reader on a big
+   IMAP response.  Not part of the test suite, since the
+   numbers depend on the machine; run "make bench", or
+   "./bench_wmbiff [name] [megabytes]" for a single benchmark
+   ("./bench_wmbiff maildir [thousands of messages]",
+   "./bench_wmbiff stat [mailboxes]"). */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#include "mboxScan.h"
+#include "maildirScan.h"
+#include "threadPool.h"
+#include "statBatch.h"
+#include "tlsComm.h"
+
+/* tlsComm.c wants these from wmbiff.c */
+int debug_default = 0;
+int SkipCertificateCheck = 0;
+const char *certificate_filename = NULL;
+const char *tls = "NORMAL";
+int x_socket(void)
+{
+	return 0;
+}
+void ProcessPendingEvents(void)
+{
+}
+int exists(const char *filename __attribute__((unused)))
+{
+	return 0;
+}
+int print_info(void *state __attribute__((unused)))
+{
+	return 0;
+}
+
+static int megabytes = 256;
+static int size_given;
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static const char *tmpdir(void)
+{
+	const char *t = getenv("TMPDIR");
+	return (t != NULL) ? t : "/tmp";
+}
+
+/* an mbox with a mix of short messages and big attachments,
+   some read, some not; with_length writes mboxcl2 instead */
+static char *make_mbox(off_t bytes, int with_length)
+{
+	static const char body_line[] =
+		"VGhpcyBpcyBqdXN0IGZpbGxlciB0ZXh0IGluIGEgYmFzZTY0IGF0dGFjaG1lbnQu"
+		"IEl0IGlzIHRoZSB1c3VhbCBib3VsZA==\n";
+	char *path = malloc(strlen(tmpdir()) + 32);
+	FILE *f;
+	off_t written = 0;
+	int i;
+
+	sprintf(path, "%s/bench-mbox.XXXXXX", tmpdir());
+	i = mkstemp(path);
+	if (i < 0 || (f = fdopen(i, "w")) == NULL) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; written < bytes; i++) {
+		int lines = (i % 10 == 0) ? 4000 : 30, j;
+		written +=
+			fprintf(f, "From sender%d@example.org Thu Jan  1 00:00:00 2004\n"
+					"From: Sender <sender%d@example.org>\n"
+					"Subject: message number %d\n"
+					"Content-Type: text/plain\n", i, i, i);
+		if (with_length)
+			written += fprintf(f, "Content-Length: %lu\n",
+							   (unsigned long) lines * (sizeof(body_line) -
+														1));
+		if (i % 3 == 0)
+			written += fprintf(f, "Status: RO\n");
+		written += fprintf(f, "\n");
+		for (j = 0; j < lines; j++)
+			written += fprintf(f, "%s", body_line);
+		written += fprintf(f, "\n");
+	}
+	fclose(f);
+	return path;
+}
+
+/* the loop wmbiff used before mboxScan.c, for comparison */
+static int legacy_count(const char *path, int *unread)
+{
+	FILE *F = fopen(path, "r");
+	char buf[1024];
+	int is_header = 0;
+	int next_from_is_start_of_header = 1;
+	int count_from = 0, count_status = 0;
+	int pseudo_mail = 0;
+
+	while (fgets(buf, 1024, F)) {
+		if (is_header && !strncmp(buf, "X-IMAP: ", 8))
+			pseudo_mail = 1;
+		if (buf[0] == '\n') {
+			if (is_header)
+				is_header = 0;
+			else
+				next_from_is_start_of_header = 1;
+		} else if (!strncmp(buf, "From ", 5)) {
+			if (next_from_is_start_of_header)
+				is_header = 1;
+			if (is_header)
+				count_from++;
+		} else {
+			next_from_is_start_of_header = 0;
+			if (is_header && !strncmp(buf, "Status: ", 8)
+				&& strrchr(buf, 'R'))
+				count_status++;
+		}
+	}
+	fclose(F);
+	if (count_from && pseudo_mail) {
+		count_from--;
+		if (count_status)
+			count_status--;
+	}
+	*unread = count_from - count_status;
+	return count_from;
+}
+
+static int scan_count(const char *path, int use_content_length,
+					  int *unread)
+{
+	struct mbox_scan st, counts;
+	off_t offset = 0;
+	int fd = open(path, O_RDONLY);
+
+	mbox_scan_init(&st);
+	st.use_content_length = use_content_length;
+	mbox_scan_fd(fd, &offset, &st, &counts);
+	close(fd);
+	*unread = mbox_scan_unread(&counts);
+	return mbox_scan_total(&counts);
+}
+
+static void report(const char *what, double seconds, off_t bytes,
+				   int total, int unread)
+{
+	printf("  %-24s %8.3f s %8.2f GB/s  (%d messages, %d unread)\n",
+		   what, seconds, bytes / seconds / 1e9, total, unread);
+}
+
+static int bench_mbox(void)
+{
+	off_t bytes = (off_t) megabytes << 20;
+	char *path = make_mbox(bytes, 0);
+	int total, unread, legacy_total, legacy_unread;
+	double t;
+
+	printf("mbox: %d MB synthetic mailbox (from page cache)\n", megabytes);
+	scan_count(path, 0, &unread);	/* warm the page cache */
+
+	t = now();
+	legacy_total = legacy_count(path, &legacy_unread);
+	report("fgets loop", now() - t, bytes, legacy_total, legacy_unread);
+
+	t = now();
+	total = scan_count(path, 0, &unread);
+	report("mbox_scan_fd", now() - t, bytes, total, unread);
+
+	unlink(path);
+	free(path);
+	if (total != legacy_total || unread != legacy_unread) {
+		printf("  counts differ!\n");
+		return 1;
+	}
+	return 0;
+}
+
+/* the same, written as mboxcl2 and checked with mbox::C: */
+static int bench_mboxcl(void)
+{
+	off_t bytes = (off_t) megabytes << 20;
+	char *path = make_mbox(bytes, 1);
+	int total, unread, cl_total, cl_unread;
+	double t;
+
+	printf("mboxcl: %d MB synthetic mboxcl2 mailbox (from page cache)\n",
+		   megabytes);
+	scan_count(path, 0, &unread);	/* warm the page cache */
+
+	t = now();
+	total = scan_count(path, 0, &unread);
+	report("line scan", now() - t, bytes, total, unread);
+
+	t = now();
+	cl_total = scan_count(path, 1, &cl_unread);
+	report("Content-Length skips", now() - t, bytes, cl_total, cl_unread);
+
+	unlink(path);
+	free(path);
+	if (total != cl_total || unread != cl_unread) {
+		printf("  counts differ!\n");
+		return 1;
+	}
+	return 0;
+}
+
+/* the parallel scan on 1 to (number of processors) threads, or
+   to 4 on smaller machines, to see what the threads cost */
+static int bench_parallel(void)
+{
+	off_t bytes = (off_t) megabytes << 20;
+	char *path = make_mbox(bytes, 0);
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int total, unread, threads, ret = 0;
+
+	printf("parallel: %d MB synthetic mailbox (from page cache)\n",
+		   megabytes);
+	total = scan_count(path, 0, &unread);	/* warm the page cache */
+	for (threads = 1; threads <= max(cpus, 4L); threads++) {
+		struct thread_pool *pool = thread_pool_create(threads);
+		struct mbox_scan st, counts;
+		off_t offset = 0;
+		int fd = open(path, O_RDONLY);
+		char what[32];
+		double t;
+
+		mbox_scan_init(&st);
+		t = now();
+		mbox_scan_fd_parallel(fd, &offset, &st, &counts, pool, NULL, NULL);
+		sprintf(what, "%d thread%s", threads, (threads > 1) ? "s" : "");
+		report(what, now() - t, bytes, mbox_scan_total(&counts),
+			   mbox_scan_unread(&counts));
+		if (mbox_scan_total(&counts) != total
+			|| mbox_scan_unread(&counts) != unread) {
+			printf("  counts differ!\n");
+			ret = 1;
+		}
+		close(fd);
+		thread_pool_destroy(pool);
+	}
+	unlink(path);
+	free(path);
+	return ret;
+}
+
+/* a maildir of entries messages, a tenth of them new, and of the
+   rest some unseen and some flagged; returns its new/ and cur/ */
+static char *make_maildir(int entries, char *path_new, char *path_cur)
+{
+	static const char *info[] = { ":2,S", ":2,RS", ":2,", ":2,FS" };
+	char *dir = malloc(strlen(tmpdir()) + 32);
+	char name[512];
+	int i;
+
+	sprintf(dir, "%s/bench-maildir.XXXXXX", tmpdir());
+	if (mkdtemp(dir) == NULL) {
+		perror(dir);
+		exit(EXIT_FAILURE);
+	}
+	sprintf(path_new, "%s/new", dir);
+	sprintf(path_cur, "%s/cur", dir);
+	mkdir(path_new, 0700);
+	mkdir(path_cur, 0700);
+	for (i = 0; i < entries; i++) {
+		int fd;
+		if (i % 10 == 0)
+			sprintf(name, "%s/%d.M%dP%d.host.example.org", path_new,
+					1100000000 + i, i * 7, 4000 + i % 900);
+		else
+			sprintf(name, "%s/%d.M%dP%d.host.example.org,S=%d%s",
+					path_cur, 1100000000 + i, i * 7, 4000 + i % 900,
+					2000 + i % 5000, info[i % 4]);
+		fd = open(name, O_WRONLY | O_CREAT, 0600);
+		if (fd < 0) {
+			perror(name);
+			exit(EXIT_FAILURE);
+		}
+		close(fd);
+	}
+	return dir;
+}
+
+static void remove_maildir(char *dir, const char *path_new,
+						   const char *path_cur)
+{
+	const char *sub[] = { path_new, path_cur };
+	char name[512];
+	int i;
+	for (i = 0; i < 2; i++) {
+		DIR *D = opendir(sub[i]);
+		struct dirent *de;
+		while ((de = readdir(D)) != NULL) {
+			if (de->d_name[0] != '.') {
+				sprintf(name, "%s/%s", sub[i], de->d_name);
+				unlink(name);
+			}
+		}
+		closedir(D);
+		rmdir(sub[i]);
+	}
+	rmdir(dir);
+	free(dir);
+}
+
+/* count_msgs() as it was, which took every message in cur/ as
+   seen, for comparison */
+static int legacy_count_dir(const char *path)
+{
+	DIR *D = opendir(path);
+	struct dirent *de;
+	int count = 0;
+	while ((de = readdir(D)) != NULL) {
+		if ((strcmp(de->d_name, ".") & strcmp(de->d_name, "..")) != 0)
+			count++;
+	}
+	closedir(D);
+	return count;
+}
+
+/* reading a big maildir, from the dentry cache */
+static int bench_maildir(void)
+{
+	int entries = size_given ? megabytes * 1000 : 100000;
+	char path_new[256], path_cur[256];
+	char *dir = make_maildir(entries, path_new, path_cur);
+	struct maildir_counts c;
+	int rounds = 20, i, total = 0, unread = 0;
+	double t;
+
+	printf("maildir: %d messages, read %d times\n", entries, rounds);
+	legacy_count_dir(path_new);	/* warm the caches */
+	legacy_count_dir(path_cur);
+
+	t = now();
+	for (i = 0; i < rounds; i++) {
+		unread = legacy_count_dir(path_new);
+		total = unread + legacy_count_dir(path_cur);
+	}
+	t = now() - t;
+	printf("  %-24s %8.3f s %8.2f M/s  (%d messages, %d unread)\n",
+		   "readdir, names ignored", t, entries * rounds / t / 1e6, total,
+		   unread);
+
+	t = now();
+	for (i = 0; i < rounds; i++) {
+		memset(&c, 0, sizeof(c));
+		maildir_scan_dir(path_new, 1, &c);
+		maildir_scan_dir(path_cur, 0, &c);
+	}
+	t = now() - t;
+	printf("  %-24s %8.3f s %8.2f M/s  (%d messages, %d unread, "
+		   "%d flagged)\n", "maildir_scan_dir", t,
+		   entries * rounds / t / 1e6, c.total, c.new + c.unseen,
+		   c.flagged);
+
+	remove_maildir(dir, path_new, path_cur);
+	if (c.total != entries || c.total != total) {
+		printf("  counts differ!\n");
+		return 1;
+	}
+	return 0;
+}
+
+/* forget cached inodes, as after a while of not looking at them;
+   only root can */
+static int drop_caches(void)
+{
+	int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+	int ok = (fd >= 0 && write(fd, "2\n", 2) == 2);
+	if (fd >= 0)
+		close(fd);
+	return ok;
+}
+
+static void stat_rounds(char **paths, struct prefetched_stamp *ps,
+						int boxes, int rounds, int cold, int remote)
+{
+	struct file_stamp fs;
+	double t, spent;
+	int i, r;
+
+	for (spent = 0, r = 0; r < rounds; r++) {
+		if (cold)
+			(void) drop_caches();
+		t = now();
+		for (i = 0; i < boxes; i++)
+			(void) file_stamp(paths[i], &fs);
+		spent += now() - t;
+	}
+	printf("  %-24s %8.3f s %8.2f us/check\n",
+		   cold ? "one at a time, cold" : "one at a time", spent,
+		   spent / rounds * 1e6);
+
+	for (spent = 0, r = 0; r < rounds; r++) {
+		struct stat_batch b;
+		if (cold)
+			(void) drop_caches();
+		t = now();
+		stat_batch_init(&b);
+		for (i = 0; i < boxes; i++)
+			stat_batch_add(&b, paths[i], remote, &ps[i]);
+		stat_batch_run(&b, NULL);
+		stat_batch_free(&b);
+		spent += now() - t;
+	}
+	printf("  %-24s %8.3f s %8.2f us/check\n",
+		   cold ? "stat_batch, cold" : "stat_batch", spent,
+		   spent / rounds * 1e6);
+}
+
+/* stamping many small mailboxes, one by one and as a batch, as a
+   check of all of them does; with the inodes cached, and, if we
+   may drop the caches, without.  then again as if they were on
+   NFS, which hands them to threads: that costs more here, and
+   pays only where each stat waits for a server. */
+static int bench_stat(void)
+{
+	int boxes = size_given ? megabytes : 40;
+	int rounds = 5000, i;
+	char **paths = malloc(boxes * sizeof(char *));
+	struct prefetched_stamp *ps = malloc(boxes * sizeof(*ps));
+
+	for (i = 0; i < boxes; i++) {
+		paths[i] = malloc(strlen(tmpdir()) + 32);
+		sprintf(paths[i], "%s/wmbiff-bench-stat.%d", tmpdir(), i);
+		close(open(paths[i], O_WRONLY | O_CREAT, 0600));
+	}
+	printf("stat: %d mailboxes, stamped %d times\n", boxes, rounds);
+	stat_rounds(paths, ps, boxes, rounds, 0, 0);
+	sync();
+	if (drop_caches())
+		stat_rounds(paths, ps, boxes, 20, 1, 0);
+	printf(" as if remote:\n");
+	stat_rounds(paths, ps, boxes, rounds, 0, 1);
+
+	for (i = 0; i < boxes; i++) {
+		if (!ps[i].ready || ps[i].error != 0) {
+			printf("  %s wasn't stamped!\n", paths[i]);
+			return 1;
+		}
+		unlink(paths[i]);
+		free(paths[i]);
+	}
+	free(paths);
+	free(ps);
+	return 0;
+}
+
+/* the response to a header FETCH of a big folder: mostly short
+   header lines, with the odd huge one (a References: chain, or
+   a mailer that doesn't fold) */
+static char *make_fetch(off_t bytes)
+{
+	char *path = malloc(strlen(tmpdir()) + 32);
+	FILE *f;
+	int i;
+
+	sprintf(path, "%s/bench-fetch.XXXXXX", tmpdir());
+	i = mkstemp(path);
+	if (i < 0) {
+		perror(path);
+		exit(1);
+	}
+	f = fdopen(i, "w");
+	for (i = 1; ftello(f) < bytes; i++) {
+		static char refs[64 * 1024], header[66 * 1024];
+		int len = 0;
+		if (i % 500 == 0) {
+			len = 1000 * (i % 60);
+			memset(refs, 'r', len);
+		}
+		refs[len] = '\0';
+		len = sprintf(header,
+					  "From: Someone Somewhere <someone%d@example.org>\r\n"
+					  "Subject: Re: the status of message number %d\r\n"
+					  "References: <%s>\r\n\r\n", i, i, refs);
+		fprintf(f, "* %d FETCH (UID %d BODY[HEADER.FIELDS (FROM SUBJECT"
+				" REFERENCES)] {%d}\r\n%s)\r\n", i, i, len, header);
+	}
+	fprintf(f, "a004 OK UID FETCH completed\r\n");
+	fclose(f);
+	return path;
+}
+
+/* tlsComm.c's line reader before it kept a growable buffer:
+   every line taken shifts the rest of a 1K buffer down */
+static int
+legacy_getline(char *readbuffer, char *linebuffer, int linebuflen)
+{
+	char *p, *q;
+	int i;
+	for (p = readbuffer, i = 0;
+		 *p != '\n' && *p != '\0' && i < linebuflen - 1; p++, i++);
+	if (*p == '\n') {
+		i++;
+		p++;
+	}
+	if (i != 0) {
+		strncpy(linebuffer, readbuffer, (size_t) i);
+		linebuffer[i] = '\0';
+		q = readbuffer;
+		if (*p != '\0') {
+			while (*p != '\0') {
+				*(q++) = *(p++);
+			}
+		}
+		*(q++) = *(p++);
+	}
+	return i;
+}
+
+static int legacy_gets(int fd, char *unprocessed, char *buf, int buflen)
+{
+	if (unprocessed[0] == '\0') {
+		int got = read(fd, unprocessed, 1024 - 1);
+		if (got <= 0)
+			return 0;
+		unprocessed[got] = '\0';
+	}
+	return legacy_getline(unprocessed, buf, buflen);
+}
+
+static void report_lines(const char *what, double seconds, off_t bytes,
+						 int lines)
+{
+	printf("  %-24s %8.3f s %8.2f GB/s  (%d lines)\n",
+		   what, seconds, bytes / seconds / 1e9, lines);
+}
+
+static int bench_tlscomm(void)
+{
+	off_t bytes = (off_t) (size_given ? megabytes : 64) << 20;
+	char *path = make_fetch(bytes);
+	char unprocessed[1024];
+	char buf[1024];
+	struct connection_state *scs;
+	mbox_t pc;
+	off_t legacy_bytes = 0, gets_bytes = 0, line_bytes = 0;
+	int lines;
+	size_t len;
+	double t;
+	int fd;
+
+	printf("tlscomm: %d MB header FETCH response, read line by line\n",
+		   (int) (bytes >> 20));
+	memset(&pc, 0, sizeof(pc));
+	strcpy(pc.label, "bench");
+
+	fd = open(path, O_RDONLY);
+	unprocessed[0] = '\0';
+	t = now();
+	for (lines = 0; legacy_gets(fd, unprocessed, buf, sizeof(buf)) != 0;
+		 lines++)
+		legacy_bytes += strlen(buf);
+	report_lines("1K buffer, shifted", now() - t, legacy_bytes, lines);
+	close(fd);
+
+	scs = initialize_unencrypted(open(path, O_RDONLY), strdup("bench"),
+								 &pc);
+	t = now();
+	for (lines = 0; tlscomm_gets(buf, sizeof(buf), scs) != 0; lines++)
+		gets_bytes += strlen(buf);
+	report_lines("tlscomm_gets", now() - t, gets_bytes, lines);
+	tlscomm_close(scs);
+
+	scs = initialize_unencrypted(open(path, O_RDONLY), strdup("bench"),
+								 &pc);
+	t = now();
+	for (lines = 0; tlscomm_line(scs, &len) != NULL; lines++)
+		line_bytes += len;
+	report_lines("tlscomm_line", now() - t, line_bytes, lines);
+	tlscomm_close(scs);
+
+	unlink(path);
+	free(path);
+	if (legacy_bytes != gets_bytes || gets_bytes != line_bytes) {
+		printf("  byte counts differ!\n");
+		return 1;
+	}
+	return 0;
+}
+
+static struct benchmark {
+	const char *name;
+	int (*run) (void);
+} benchmarks[] = {
+	{"mbox", bench_mbox},
+	{"mboxcl", bench_mboxcl},
+	{"parallel", bench_parallel},
+	{"maildir", bench_maildir},
+	{"stat", bench_stat},
+	{"tlscomm", bench_tlscomm},
+	{NULL, NULL}
+};
+
+int main(int argc, const char *argv[])
+{
+	struct benchmark *b;
+	int ret = 0;
+
+	if (argc > 2) {
+		megabytes = atoi(argv[2]);
+		size_given = 1;
+	}
+	for (b = benchmarks; b->name != NULL; b++) {
+		if (argc < 2 || strcmp(argv[1], b->name) == 0)
+			ret |= b->run();
+	}
+	return ret;
+}
+
+/* vim:set ts=4: */
+/*
+ * Local Variables:
+ * tab-width: 4
+ * c-indent-level: 4
+ * c-basic-offset: 4
+ * End:
+ */
@@ -0,0 +1,158 @@
+/* fileStamp.c - telling whether a local mailbox changed.
+
+   A whole-second mtime and the size miss a mailbox that was
+   rewritten to the same size within a second, so where statx() is
+   there, the stamp has the mtime and ctime to the nanosecond, and
+   the inode, which changes when a mail reader renames a new copy
+   into place.  On NFS, the stamp is synced as stat() would be: a
+   remote mailbox can't be watched, so a stale attribute cache
+   would hide new mail until something else refreshed it. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_VFS_H
+#include <sys/vfs.h>
+#endif
+
+#include "fileStamp.h"
+
+#ifdef USE_DMALLOC
+#include <dmalloc.h>
+#endif
+
+int remote_filesystem(const char *path)
+{
+#ifdef HAVE_SYS_VFS_H
+	struct statfs sfs;
+
+	if (statfs(path, &sfs) != 0)
+		return 0;
+	switch ((unsigned long) sfs.f_type) {
+	case 0x6969UL:				/* NFS */
+	case 0x517bUL:				/* SMB */
+	case 0xff534d42UL:			/* CIFS */
+	case 0xfe534d42UL:			/* SMB2 */
+	case 0x65735546UL:			/* FUSE, e.g. sshfs */
+	case 0x5346414fUL:			/* AFS */
+	case 0x73757245UL:			/* Coda */
+	case 0x01021997UL:			/* 9p */
+	case 0x00c36400UL:			/* Ceph */
+	case 0x47504653UL:			/* GPFS */
+	case 0x0bd00bd0UL:			/* Lustre */
+		return 1;
+	default:
+		return 0;
+	}
+#else
+	(void) path;
+	return 0;
+#endif
+}
+
+#ifdef HAVE_STATX
+static void from_statx(struct timespec *ts,
+					   const struct statx_timestamp *t)
+{
+	ts->tv_sec = (time_t) t->tv_sec;
+	ts->tv_nsec = (long) t->tv_nsec;
+}
+
+static void
+file_stamp_from_statx(struct file_stamp *fs, const struct statx *stx)
+{
+	from_statx(&fs->mtime, &stx->stx_mtime);
+	from_statx(&fs->ctime, &stx->stx_ctime);
+	from_statx(&fs->atime, &stx->stx_atime);
+	fs->ino = (ino_t) stx->stx_ino;
+	fs->size = (off_t) stx->stx_size;
+}
+#endif
+
+int file_stamp(const char *path, struct file_stamp *fs)
+{
+	struct stat st;
+
+#ifdef HAVE_STATX
+	struct statx stx;
+	if (statx(AT_FDCWD, path, AT_STATX_SYNC_AS_STAT, STATX_BASIC_STATS,
+			  &stx) == 0) {
+		file_stamp_from_statx(fs, &stx);
+		return 0;
+	}
+	/* an old kernel */
+	if (errno != ENOSYS)
+		return -1;
+#endif
+	if (stat(path, &st) != 0)
+		return -1;
+	memset(fs, 0, sizeof(struct file_stamp));
+	fs->mtime.tv_sec = st.st_mtime;
+	fs->mtime.tv_nsec = MTIME_NSEC(&st);
+	fs->ctime.tv_sec = st.st_ctime;
+	fs->ctime.tv_nsec = CTIME_NSEC(&st);
+	fs->atime.tv_sec = st.st_atime;
+	fs->ino = st.st_ino;
+	fs->size = st.st_size;
+	return 0;
+}
+
+static int same_time(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+int file_stamp_changed(const struct file_stamp *was,
+					   const struct file_stamp *now)
+{
+	return !same_time(&was->mtime, &now->mtime)
+		|| !same_time(&was->ctime, &now->ctime)
+		|| was->ino != now->ino || was->size != now->size;
+}
+
+int open_noatime(const char *path, int flags, int *noatime)
+{
+	int fd;
+#ifdef O_NOATIME
+	/* only for files we own */
+	fd = open(path, flags | O_NOATIME);
+	if (fd >= 0 || errno != EPERM) {
+		*noatime = (fd >= 0);
+		return fd;
+	}
+#endif
+	*noatime = 0;
+	fd = open(path, flags);
+	return fd;
+}
+
+void file_stamp_restore_atime(const char *path, struct file_stamp *fs)
+{
+	struct timespec times[2];
+	struct file_stamp now;
+
+	times[0] = fs->atime;
+	times[1].tv_sec = 0;
+	times[1].tv_nsec = UTIME_OMIT;	/* the mtime stays as it is */
+	if (utimensat(AT_FDCWD, path, times, 0) != 0)
+		return;
+	if (file_stamp(path, &now) == 0
+		&& same_time(&now.mtime, &fs->mtime)
+		&& now.ino == fs->ino && now.size == fs->size)
+		*fs = now;
+}
+
+/* vim:set ts=4: */
+/*
+ * Local Variables:
+ * tab-width: 4
+ * c-indent-level: 4
+ * c-basic-offset: 4
+ * End:
+ */
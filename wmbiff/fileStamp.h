@@ -0,0 +1,53 @@
+/* fileStamp.h - telling whether a local mailbox file or directory
+   changed since it was last looked at, to the nanosecond; and
+   reading it without leaving a new access time behind. */
+
+#ifndef FILESTAMP
+#define FILESTAMP
+
+#include <sys/types.h>
+#include <time.h>
+
+/* the nanoseconds of a struct stat's mtime and ctime */
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+#define MTIME_NSEC(sb) ((long) (sb)->st_mtim.tv_nsec)
+#define CTIME_NSEC(sb) ((long) (sb)->st_ctim.tv_nsec)
+#else
+#define MTIME_NSEC(sb) 0L
+#define CTIME_NSEC(sb) 0L
+#endif
+
+struct file_stamp {
+	struct timespec mtime;
+	struct timespec ctime;
+	struct timespec atime;		/* not compared: reading changes it */
+	ino_t ino;
+	off_t size;
+};
+
+/* whether path is on NFS or another filesystem where the kernel
+   only hears of changes made by this machine.  a path that can't
+   be looked at is taken to be local. */
+int remote_filesystem(const char *path);
+
+/* stamp path as it is now.  as with stat(), NFS and the like
+   check with the server unless they just did: a remote mailbox
+   isn't watched, so this is all that sees it change.  returns -1
+   (with errno) if path can't be looked at. */
+int file_stamp(const char *path, struct file_stamp *fs);
+
+/* 1 if they differ in anything but atime */
+int file_stamp_changed(const struct file_stamp *was,
+					   const struct file_stamp *now);
+
+/* open path for reading, without updating its atime if we're
+   allowed to; *noatime says whether we were. */
+int open_noatime(const char *path, int flags, int *noatime);
+
+/* put back the atime path had when fs was taken, for mail readers
+   (mutt) that compare it to the mtime, and stamp it again, since
+   that changes its ctime; unless path was changed meanwhile, in
+   which case fs is left alone, and the next look sees a change. */
+void file_stamp_restore_atime(const char *path, struct file_stamp *fs);
+
+#endif
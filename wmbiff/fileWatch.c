@@ -0,0 +1,285 @@
+/* fileWatch.c - hearing from the kernel that a local mailbox
+   changed.
+
+   One inotify descriptor serves all mailboxes; wmbiff's main loop
+   polls it along with the X connection, and each event makes the
+   mailbox it is for due for a check right away.  A mailbox file
+   that gets replaced (mail readers often write a new copy and
+   rename it into place) is watched again under its name.  On
+   filesystems where the kernel only sees changes made by this
+   machine, such as NFS, nothing is watched. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#define USE_INOTIFY
+#endif
+
+#include "fileWatch.h"
+#include "fileStamp.h"
+
+#ifdef USE_DMALLOC
+#include <dmalloc.h>
+#endif
+
+#ifdef USE_INOTIFY
+
+struct watch {
+	int wd;						/* -1 if the watch was lost */
+	Pop3 pc;					/* null if this slot is free */
+	char *path;
+	int what;
+	filewatch_handler handler;
+};
+
+static int inotify_fd = -1;
+static struct watch *watches;
+static int nwatches;
+
+void filewatch_init(void)
+{
+	if (inotify_fd >= 0)
+		return;
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd < 0)
+		DMA(DEBUG_INFO, "no inotify, polling all mailboxes: %s\n",
+			strerror(errno));
+}
+
+int filewatch_fd(void)
+{
+	return inotify_fd;
+}
+
+static unsigned int mask_for(int what)
+{
+	unsigned int mask = IN_MOVE_SELF | IN_DELETE_SELF;
+	if (what & FILEWATCH_CHANGED)
+		mask |= IN_MODIFY | IN_CLOSE_WRITE;
+	if (what & FILEWATCH_ADDED)
+		mask |= IN_CREATE | IN_MOVED_TO;
+	if (what & FILEWATCH_REMOVED)
+		mask |= IN_DELETE | IN_MOVED_FROM;
+	return mask;
+}
+
+/* pc is watched if none of its watches were lost */
+static void update_watched(Pop3 pc)
+{
+	int i;
+	pc->watched = 1;
+	for (i = 0; i < nwatches; i++) {
+		if (watches[i].pc == pc && watches[i].wd < 0)
+			pc->watched = 0;
+	}
+}
+
+/* (re)start the kernel's side of w; several mailboxes may share
+   one file, and thus one wd, so masks are added up */
+static int start(struct watch *w)
+{
+	w->wd = inotify_add_watch(inotify_fd, w->path,
+							  mask_for(w->what) | IN_MASK_ADD);
+	if (w->wd < 0) {
+		DM(w->pc, DEBUG_INFO, "can't watch '%s', polling: %s\n",
+		   w->path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int filewatch_add(Pop3 pc, const char *path, int what,
+				  filewatch_handler handler)
+{
+	struct watch *w = NULL;
+	int i;
+
+	if (inotify_fd < 0)
+		return -1;
+	if (remote_filesystem(path)) {
+		DM(pc, DEBUG_INFO, "not watching '%s': remote filesystem\n", path);
+		return -1;
+	}
+
+	for (i = 0; i < nwatches && w == NULL; i++) {
+		if (watches[i].pc == NULL)
+			w = &watches[i];
+	}
+	if (w == NULL) {
+		struct watch *more =
+			realloc(watches, (nwatches + 8) * sizeof(struct watch));
+		if (more == NULL)
+			return -1;
+		watches = more;
+		for (i = nwatches; i < nwatches + 8; i++)
+			watches[i].pc = NULL;
+		w = &watches[nwatches];
+		nwatches += 8;
+	}
+	w->path = strdup(path);
+	if (w->path == NULL)
+		return -1;
+	w->what = what;
+	w->handler = handler;
+	w->pc = pc;
+	/* kept even if it fails, for filewatch_retry */
+	(void) start(w);
+	update_watched(pc);
+	if (w->wd < 0)
+		return -1;
+	DM(pc, DEBUG_INFO, "watching '%s'\n", path);
+	return 0;
+}
+
+void filewatch_remove(Pop3 pc)
+{
+	int i, j;
+	for (i = 0; i < nwatches; i++) {
+		struct watch *w = &watches[i];
+		if (w->pc != pc)
+			continue;
+		w->pc = NULL;
+		free(w->path);
+		for (j = 0; j < nwatches; j++) {
+			if (watches[j].pc != NULL && watches[j].wd == w->wd)
+				break;
+		}
+		if (w->wd >= 0 && j == nwatches)
+			(void) inotify_rm_watch(inotify_fd, w->wd);
+	}
+	pc->watched = 0;
+}
+
+void filewatch_retry(Pop3 pc)
+{
+	int i;
+	for (i = 0; i < nwatches; i++) {
+		if (watches[i].pc == pc && watches[i].wd < 0
+			&& !remote_filesystem(watches[i].path))
+			(void) start(&watches[i]);
+	}
+	update_watched(pc);
+}
+
+static int notify(struct watch *w, int what, const char *name)
+{
+	if (w->handler != NULL)
+		w->handler(w->pc, what, name);
+	if (w->pc->prevtime == 0)
+		return 0;
+	w->pc->prevtime = 0;		/* due now */
+	return 1;
+}
+
+int filewatch_dispatch(void)
+{
+	/* aligned for struct inotify_event */
+	union {
+		struct inotify_event ev;
+		char buf[4096];
+	} u;
+	ssize_t n;
+	int due = 0, i;
+
+	if (inotify_fd < 0)
+		return 0;
+	while ((n = read(inotify_fd, u.buf, sizeof(u.buf))) > 0) {
+		const char *p;
+		for (p = u.buf; p < u.buf + n;
+			 p += sizeof(struct inotify_event) +
+			 ((const struct inotify_event *) p)->len) {
+			const struct inotify_event *ev =
+				(const struct inotify_event *) p;
+			const char *name = (ev->len > 0) ? ev->name : "";
+			int what = 0, wd = ev->wd;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				for (i = 0; i < nwatches; i++) {
+					if (watches[i].pc != NULL)
+						due += notify(&watches[i], FILEWATCH_LOST, "");
+				}
+				continue;
+			}
+			if (ev->mask & IN_MODIFY)
+				what |= FILEWATCH_CHANGED;
+			if (ev->mask & IN_CLOSE_WRITE)
+				what |= FILEWATCH_CHANGED | FILEWATCH_CLOSED;
+			if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+				what |= FILEWATCH_ADDED;
+			if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+				what |= FILEWATCH_REMOVED;
+			if (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED)) {
+				what = FILEWATCH_LOST;
+				if (ev->mask & IN_MOVE_SELF)
+					(void) inotify_rm_watch(inotify_fd, wd);
+			}
+
+			for (i = 0; i < nwatches; i++) {
+				struct watch *w = &watches[i];
+				if (w->pc == NULL || w->wd != wd)
+					continue;
+				if (what == FILEWATCH_LOST) {
+					/* the file or directory went away or was
+					   renamed: watch whatever has its name now,
+					   or poll until there is something */
+					(void) start(w);
+					update_watched(w->pc);
+				}
+				due += notify(w, what, name);
+			}
+		}
+	}
+	return due;
+}
+
+#else							/* USE_INOTIFY */
+
+void filewatch_init(void)
+{
+}
+
+int filewatch_fd(void)
+{
+	return -1;
+}
+
+int filewatch_add(Pop3 pc, const char *path, int what,
+				  filewatch_handler handler)
+{
+	(void) pc;
+	(void) path;
+	(void) what;
+	(void) handler;
+	return -1;
+}
+
+void filewatch_remove(Pop3 pc)
+{
+	pc->watched = 0;
+}
+
+void filewatch_retry(Pop3 pc)
+{
+	(void) pc;
+}
+
+int filewatch_dispatch(void)
+{
+	return 0;
+}
+
+#endif							/* USE_INOTIFY */
+
+/* vim:set ts=4: */
+/*
+ * Local Variables:
+ * tab-width: 4
+ * c-indent-level: 4
+ * c-basic-offset: 4
+ * End:
+ */
@@ -0,0 +1,49 @@
+/* fileWatch.h - hearing from the kernel (inotify) that a local
+   mailbox changed, instead of stat()ing it every interval.
+   Mailboxes that can't be watched, such as those on NFS, are
+   polled as before. */
+
+#ifndef FILEWATCH
+#define FILEWATCH
+
+#include "Client.h"
+
+/* what a handler is told about */
+#define FILEWATCH_CHANGED 1		/* a watched file was written to */
+#define FILEWATCH_ADDED   2		/* an entry appeared in a watched directory */
+#define FILEWATCH_REMOVED 4		/* an entry disappeared from one */
+#define FILEWATCH_LOST    8		/* events were dropped: count again */
+#define FILEWATCH_CLOSED 16		/* a writer closed a watched file */
+
+/* name is the entry in a watched directory, or "" */
+typedef void (*filewatch_handler) (Pop3 pc, int what, const char *name);
+
+/* start watching; until this is called, filewatch_add fails, so
+   that only wmbiff itself, not the tests, sets up watches */
+void filewatch_init(void);
+
+/* the descriptor to poll for events, or -1 */
+int filewatch_fd(void);
+
+/* watch path, a file (for FILEWATCH_CHANGED) or a directory (for
+   FILEWATCH_ADDED | FILEWATCH_REMOVED), on behalf of pc, and set
+   pc->watched.  Any event makes pc due for a check; handler, if
+   not null, hears about it first.  returns -1 if path can't be
+   watched, and pc has to be polled; if it merely doesn't exist
+   yet, filewatch_retry will try again. */
+int filewatch_add(Pop3 pc, const char *path, int what,
+				  /*@null@ */ filewatch_handler handler);
+
+/* stop watching anything for pc */
+void filewatch_remove(Pop3 pc);
+
+/* try again to watch what pc lost track of, for example a mailbox
+   file that was deleted when it was emptied; called when pc is
+   polled. */
+void filewatch_retry(Pop3 pc);
+
+/* handle the events that are waiting; returns the number of
+   mailboxes made due */
+int filewatch_dispatch(void);
+
+#endif
@@ -0,0 +1,184 @@
+/* headerCache.c - the headers of unseen IMAP messages, by UID.
+
+   A UID names the same message for as long as the folder's
+   UIDVALIDITY stays the same, so the headers fetched for it can be
+   kept: across checks in the Pop3's headerCache, and across
+   restarts in a small text file in $XDG_CACHE_HOME/wmbiff (or
+   ~/.cache/wmbiff), named after a hash of the folder's user,
+   server and path.  A file that doesn't read back cleanly is
+   ignored, and the headers are fetched again. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "Client.h"
+#include "MessageList.h"
+#include "mboxIndex.h"
+#include "headerCache.h"
+
+#ifdef USE_DMALLOC
+#include <dmalloc.h>
+#endif
+
+#define HEADER_CACHE_MAGIC "wmbiff-imap-headers 1\n"
+
+static void free_headers( /*@null@ */ struct msglst *h)
+{
+	while (h != NULL) {
+		struct msglst *n = h->next;
+		free(h);
+		h = n;
+	}
+}
+
+/* copy up to a tab or the line end */
+static char *copy_field(char *field, size_t size, char *p)
+{
+	size_t len = 0;
+	for (; *p != '\0' && *p != '\t' && *p != '\n'; p++) {
+		if (len < size - 1)
+			field[len++] = *p;
+	}
+	field[len] = '\0';
+	return p;
+}
+
+struct msglst *header_cache_load(const char *key,
+								 unsigned long *uidvalidity,
+								 unsigned long long *modseq)
+{
+	struct msglst *h = NULL, **last = &h;
+	char *filename = cache_filename("imap", key, 0);
+	char line[BUF_BIG];
+	FILE *f;
+
+	*uidvalidity = 0;
+	*modseq = 0;
+	if (filename == NULL)
+		return NULL;
+	f = fopen(filename, "r");
+	free(filename);
+	if (f == NULL)
+		return NULL;
+
+	/* magic, the folder it's for, and its UIDVALIDITY and
+	   HIGHESTMODSEQ */
+	if (fgets(line, sizeof(line), f) == NULL
+		|| strcmp(line, HEADER_CACHE_MAGIC) != 0
+		|| fgets(line, sizeof(line), f) == NULL
+		|| strncmp(line, key, strlen(key)) != 0
+		|| strcmp(line + strlen(key), "\n") != 0
+		|| fgets(line, sizeof(line), f) == NULL
+		|| sscanf(line, "%lu %llu", uidvalidity, modseq) < 1) {
+		fclose(f);
+		*uidvalidity = 0;
+		*modseq = 0;
+		return NULL;
+	}
+
+	/* uid <tab> from <tab> subject */
+	while (fgets(line, sizeof(line), f) != NULL) {
+		struct msglst *m;
+		char *p;
+		unsigned long uid = strtoul(line, &p, 10);
+
+		if (uid == 0 || *p != '\t' || strchr(p, '\n') == NULL
+			|| (m = malloc(sizeof(struct msglst))) == NULL) {
+			/* damaged: don't trust any of it */
+			free_headers(h);
+			h = NULL;
+			*uidvalidity = 0;
+			*modseq = 0;
+			break;
+		}
+		m->uid = (unsigned int) uid;
+		m->in_use = 0;
+		m->next = NULL;
+		p = copy_field(m->from, FROM_LEN, p + 1);
+		if (*p == '\t')
+			p++;
+		(void) copy_field(m->subj, SUBJ_LEN, p);
+		*last = m;
+		last = &m->next;
+	}
+	fclose(f);
+	return h;
+}
+
+/* a header with no tabs or line ends in it */
+static void put_field(FILE * f, const char *field)
+{
+	for (; *field != '\0'; field++)
+		putc((*field == '\t' || *field == '\n') ? ' ' : *field, f);
+}
+
+int header_cache_save(const struct msglst *h, const char *key,
+					  unsigned long uidvalidity, unsigned long long modseq)
+{
+	char *filename, *tmpname;
+	FILE *f;
+	int fd;
+
+	if (strchr(key, '\n') != NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	filename = cache_filename("imap", key, 1);
+	if (filename == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	tmpname = malloc(strlen(filename) + 8);
+	if (tmpname == NULL) {
+		free(filename);
+		return -1;
+	}
+	sprintf(tmpname, "%s.XXXXXX", filename);
+	if ((fd = mkstemp(tmpname)) < 0 || (f = fdopen(fd, "w")) == NULL) {
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmpname);
+		}
+		free(tmpname);
+		free(filename);
+		return -1;
+	}
+
+	fprintf(f, HEADER_CACHE_MAGIC "%s\n%lu %llu\n", key, uidvalidity,
+			modseq);
+	for (; h != NULL; h = h->next) {
+		fprintf(f, "%u\t", h->uid);
+		put_field(f, h->from);
+		putc('\t', f);
+		put_field(f, h->subj);
+		putc('\n', f);
+	}
+
+	if (fclose(f) != 0 || rename(tmpname, filename) != 0) {
+		int saved = errno;
+		unlink(tmpname);
+		free(tmpname);
+		free(filename);
+		errno = saved;
+		return -1;
+	}
+	free(tmpname);
+	free(filename);
+	return 0;
+}
+
+/* vim:set ts=4: */
+/*
+ * Local Variables:
+ * tab-width: 4
+ * c-indent-level: 4
+ * c-basic-offset: 4
+ * End:
+ */
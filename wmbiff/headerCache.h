@@ -0,0 +1,24 @@
+/* headerCache.h - the From and Subject of the unseen messages in
+   an IMAP folder, by UID, kept in the cache directory across
+   restarts, so that only mail that arrived since has to be
+   fetched to fill the pop up. */
+
+#ifndef HEADERCACHE
+#define HEADERCACHE
+
+struct msglst;
+
+/* the headers saved under key, in the order they were saved, and
+   the UIDVALIDITY and HIGHESTMODSEQ (0 if unknown) of the folder
+   when they were; NULL, with *uidvalidity 0, if there are none */
+/*@null@ *//*@only@ */ struct msglst *header_cache_load(const char *key,
+														 unsigned long
+														 *uidvalidity,
+														 unsigned long long
+														 *modseq);
+/* returns -1 (with errno) if they couldn't be written */
+int header_cache_save( /*@null@ */ const struct msglst *h,
+					  const char *key, unsigned long uidvalidity,
+					  unsigned long long modseq);
+
+#endif
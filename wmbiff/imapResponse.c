@@ -0,0 +1,368 @@
+/* imapResponse.c - reading IMAP responses as tokens.
+
+   A response is a line, unless it has {n} literals in it: each is
+   followed by its n bytes, newlines and all, and then the rest of
+   the response on another line.  The tokens are read as the lines
+   and literals come in off the connection, so a response needn't
+   fit any buffer, and what it holds comes out whole: atoms, quoted
+   strings, literals and lists, nested as they were sent.  Status
+   responses (OK, NO, BAD, BYE, PREAUTH) are split into their
+   [response code] and text instead, since the text is free-form. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "tlsComm.h"
+#include "imapResponse.h"
+
+#ifdef USE_DMALLOC
+#include <dmalloc.h>
+#endif
+
+/* what's left of the line being read, without its line end */
+struct cursor {
+	struct connection_state *scs;
+	const char *p, *end;
+};
+
+static int next_line(struct cursor *c)
+{
+	size_t len;
+	const char *line = tlscomm_line(c->scs, &len);
+	if (line == NULL)
+		return 0;
+	c->p = line;
+	c->end = line + len;
+	if (c->end > c->p && c->end[-1] == '\n')
+		c->end--;
+	if (c->end > c->p && c->end[-1] == '\r')
+		c->end--;
+	return 1;
+}
+
+static char *copy(const char *s, size_t len)
+{
+	char *d = malloc(len + 1);
+	if (d != NULL) {
+		memcpy(d, s, len);
+		d[len] = '\0';
+	}
+	return d;
+}
+
+static void skip_spaces(struct cursor *c)
+{
+	while (c->p < c->end && *c->p == ' ')
+		c->p++;
+}
+
+/* up to the next space */
+static char *word(struct cursor *c)
+{
+	const char *start;
+	skip_spaces(c);
+	for (start = c->p; c->p < c->end && *c->p != ' '; c->p++);
+	return copy(start, (size_t) (c->p - start));
+}
+
+static void free_tokens( /*@null@ */ struct imap_token *t)
+{
+	while (t != NULL) {
+		struct imap_token *next = t->next;
+		free_tokens(t->list);
+		free(t->text);
+		free(t);
+		t = next;
+	}
+}
+
+static struct imap_token *parse_tokens(struct cursor *c, int in_list,
+									   int *failed);
+
+/* "with \"quotes\" and \\ escaped" */
+static int quoted(struct cursor *c, struct imap_token *t)
+{
+	const char *p;
+	size_t n = 0;
+
+	t->kind = IMAP_STRING;
+	t->text = malloc((size_t) (c->end - c->p));
+	if (t->text == NULL)
+		return 0;
+	for (p = c->p + 1; p < c->end && *p != '"'; p++) {
+		if (*p == '\\' && p + 1 < c->end)
+			p++;
+		t->text[n++] = *p;
+	}
+	if (p == c->end)
+		return 0;				/* unterminated */
+	t->text[n] = '\0';
+	t->len = n;
+	c->p = p + 1;
+	return 1;
+}
+
+/* {n}, at the end of the line, then n bytes; returns -1 if it isn't
+   one after all (it's an atom), and 0 if it doesn't arrive */
+static int literal(struct cursor *c, struct imap_token *t)
+{
+	const char *p = c->p + 1;
+	const char *bytes;
+	size_t n = 0;
+
+	if (p == c->end || !isdigit((unsigned char) *p))
+		return -1;
+	for (; p < c->end && isdigit((unsigned char) *p); p++)
+		n = n * 10 + (size_t) (*p - '0');
+	if (p < c->end && *p == '+')
+		p++;
+	if (p + 1 != c->end || *p != '}')
+		return -1;
+	bytes = tlscomm_bytes(c->scs, n);
+	if (bytes == NULL)
+		return 0;
+	t->kind = IMAP_STRING;
+	t->text = copy(bytes, n);
+	t->len = n;
+	/* the response goes on after it */
+	return (t->text != NULL && next_line(c));
+}
+
+/* anything else, up to a space or a paren; a [section], as in
+   BODY[HEADER.FIELDS (FROM SUBJECT)], may have either inside */
+static int atom(struct cursor *c, struct imap_token *t)
+{
+	const char *start = c->p;
+	int depth = 0;
+
+	for (; c->p < c->end; c->p++) {
+		if (*c->p == '[')
+			depth++;
+		else if (*c->p == ']' && depth > 0)
+			depth--;
+		else if (depth == 0 && (*c->p == ' ' || *c->p == '('
+								|| *c->p == ')'))
+			break;
+	}
+	t->kind = IMAP_ATOM;
+	t->len = (size_t) (c->p - start);
+	t->text = copy(start, t->len);
+	return (t->text != NULL);
+}
+
+static struct imap_token *parse_token(struct cursor *c, int *failed)
+{
+	struct imap_token *t = calloc(1, sizeof(struct imap_token));
+	int ok;
+
+	if (t == NULL) {
+		*failed = 1;
+		return NULL;
+	}
+	if (*c->p == '(') {
+		c->p++;
+		t->kind = IMAP_LIST;
+		t->list = parse_tokens(c, 1, failed);
+		ok = !*failed;
+	} else if (*c->p == '"') {
+		ok = quoted(c, t);
+	} else if (*c->p != '{' || (ok = literal(c, t)) < 0) {
+		ok = atom(c, t);
+	}
+	if (!ok) {
+		free_tokens(t);
+		*failed = 1;
+		return NULL;
+	}
+	return t;
+}
+
+/* the tokens to the end of the response, or of the list that's
+   open if in_list, in which case the ")" is eaten too */
+static struct imap_token *parse_tokens(struct cursor *c, int in_list,
+									   int *failed)
+{
+	struct imap_token *head = NULL, **tail = &head;
+
+	for (;;) {
+		skip_spaces(c);
+		if (c->p == c->end) {
+			/* a list only goes on to another line after a
+			   literal */
+			if (in_list)
+				*failed = 1;
+			return head;
+		}
+		if (*c->p == ')') {
+			c->p++;
+			if (in_list)
+				return head;
+			continue;			/* stray; never mind */
+		}
+		if ((*tail = parse_token(c, failed)) == NULL)
+			return head;
+		tail = &(*tail)->next;
+	}
+}
+
+static int is_status(const char *name)
+{
+	return (strcasecmp(name, "OK") == 0 || strcasecmp(name, "NO") == 0
+			|| strcasecmp(name, "BAD") == 0
+			|| strcasecmp(name, "BYE") == 0
+			|| strcasecmp(name, "PREAUTH") == 0);
+}
+
+struct imap_response *imap_read_response(struct connection_state *scs)
+{
+	struct imap_response *r;
+	struct cursor c;
+	int failed = 0;
+
+	c.scs = scs;
+	if (next_line(&c) == 0)
+		return NULL;
+	r = calloc(1, sizeof(struct imap_response));
+	if (r == NULL)
+		return NULL;
+	r->tag = word(&c);
+	if (r->tag == NULL) {
+		imap_free_response(r);
+		return NULL;
+	}
+	if (strcmp(r->tag, "+") == 0) {
+		r->name = copy("", 0);
+		if (c.p < c.end)
+			c.p++;
+		r->text = copy(c.p, (size_t) (c.end - c.p));
+	} else {
+		skip_spaces(&c);
+		if (strcmp(r->tag, "*") == 0 && c.p < c.end
+			&& isdigit((unsigned char) *c.p)) {
+			for (; c.p < c.end && isdigit((unsigned char) *c.p); c.p++)
+				r->number = r->number * 10 + (unsigned long) (*c.p - '0');
+			r->numbered = 1;
+		}
+		r->name = word(&c);
+		if (r->name == NULL) {
+			failed = 1;
+		} else if (is_status(r->name)) {
+			const char *close;
+			skip_spaces(&c);
+			if (c.p < c.end && *c.p == '['
+				&& (close = memchr(c.p, ']', (size_t) (c.end - c.p)))
+				!= NULL) {
+				r->code = copy(c.p + 1, (size_t) (close - c.p - 1));
+				c.p = close + 1;
+				skip_spaces(&c);
+			}
+			r->text = copy(c.p, (size_t) (c.end - c.p));
+		} else {
+			r->args = parse_tokens(&c, 0, &failed);
+		}
+	}
+	if (failed || r->name == NULL) {
+		imap_free_response(r);
+		return NULL;
+	}
+	return r;
+}
+
+void imap_free_response(struct imap_response *r)
+{
+	free(r->tag);
+	free(r->name);
+	free(r->code);
+	free(r->text);
+	free_tokens(r->args);
+	free(r);
+}
+
+int imap_is(const struct imap_response *r, const char *name)
+{
+	return (strcasecmp(r->name, name) == 0);
+}
+
+const struct imap_token *imap_item(const struct imap_token *list,
+								   const char *key)
+{
+	const struct imap_token *t;
+	for (t = list; t != NULL && t->next != NULL; t = t->next->next)
+		if (t->kind == IMAP_ATOM && strcasecmp(t->text, key) == 0)
+			return t->next;
+	return NULL;
+}
+
+void imap_dispatch(const struct imap_response *r,
+				   const struct imap_handler *handlers)
+{
+	const struct imap_handler *h;
+	for (h = handlers; h != NULL && h->fn != NULL; h++)
+		if (h->name == NULL || imap_is(r, h->name)) {
+			h->fn(r, h->arg);
+			return;
+		}
+}
+
+/* both of the below; ok[i] is -1 until tags[i] completes */
+static int
+await(struct connection_state *scs, const char *const *tags, int n,
+	  int *ok, int continuation, const struct imap_handler *handlers)
+{
+	struct imap_response *r;
+	int i, waiting = n;
+
+	for (i = 0; i < n; i++)
+		ok[i] = -1;
+	while (waiting > 0 && (r = imap_read_response(scs)) != NULL) {
+		if (strcmp(r->tag, "*") == 0) {
+			imap_dispatch(r, handlers);
+		} else if (strcmp(r->tag, "+") == 0) {
+			if (continuation) {
+				ok[0] = 1;
+				waiting = 0;
+			}
+		} else {
+			/* the rest may be left over from commands nobody
+			   waited for */
+			for (i = 0; i < n; i++)
+				if (ok[i] < 0 && strcmp(r->tag, tags[i]) == 0) {
+					ok[i] = imap_is(r, "OK");
+					waiting--;
+					break;
+				}
+		}
+		imap_free_response(r);
+	}
+	return (waiting == 0);
+}
+
+int imap_await(struct connection_state *scs, const char *tag,
+			   int continuation, const struct imap_handler *handlers)
+{
+	int ok;
+	if (await(scs, &tag, 1, &ok, continuation, handlers) == 0)
+		return -1;
+	return ok;
+}
+
+int imap_await_all(struct connection_state *scs, const char *const *tags,
+				   int n, int *ok, const struct imap_handler *handlers)
+{
+	return await(scs, tags, n, ok, 0, handlers);
+}
+
+/* vim:set ts=4: */
+/*
+ * Local Variables:
+ * tab-width: 4
+ * c-indent-level: 4
+ * c-basic-offset: 4
+ * End:
+ */
@@ -0,0 +1,81 @@
+/* imapResponse.h - IMAP responses read off a tlsComm connection
+   as tokens, literals and all, rather than line by line: so that
+   a header section, a folder name or a list can be any length or
+   any shape the protocol allows, and several commands can be
+   outstanding at once. */
+
+#ifndef IMAPRESPONSE
+#define IMAPRESPONSE
+
+#include <stddef.h>
+
+struct connection_state;
+
+enum imap_kind {
+	IMAP_ATOM,					/* including numbers, NIL, and BODY[...] */
+	IMAP_STRING,				/* quoted, or a {literal} */
+	IMAP_LIST					/* (...) */
+};
+
+struct imap_token {
+	enum imap_kind kind;
+	char *text;					/* nul terminated; NULL for a list */
+	size_t len;					/* a literal may hold nuls */
+	struct imap_token *list;	/* what's in a list */
+	struct imap_token *next;
+};
+
+struct imap_response {
+	char *tag;					/* "*", "+", or the command's */
+	int numbered;				/* "* 3 FETCH ...": number is 3 */
+	unsigned long number;
+	char *name;					/* FETCH, STATUS, OK, ...; "" for "+" */
+	/* for OK, NO, BAD, BYE and PREAUTH, and continuations, what
+	   follows isn't tokens: the response code in brackets, if any
+	   (without them), and then the text */
+	char *code;
+	char *text;
+	struct imap_token *args;	/* for the others */
+};
+
+/* the next response, once it has all arrived; NULL if the
+   connection failed or the server made no sense */
+/*@null@ *//*@only@ */ struct imap_response
+	*imap_read_response(struct connection_state *scs);
+void imap_free_response( /*@only@ */ struct imap_response *r);
+
+/* whether r is named name, case aside */
+int imap_is(const struct imap_response *r, const char *name);
+
+/* the value after the atom key in list, as in (MESSAGES 3 UNSEEN 1)
+   or a FETCH's (UID 7 FLAGS (\Seen)); NULL if it isn't there */
+/*@null@ */ const struct imap_token *imap_item(const struct imap_token
+											   *list, const char *key);
+
+/* what to do with untagged responses: the first handler with the
+   response's name, or with a NULL name, gets it.  a table ends
+   with a NULL fn. */
+struct imap_handler {
+	const char *name;
+	void (*fn) (const struct imap_response * r, void *arg);
+	void *arg;
+};
+void imap_dispatch(const struct imap_response *r,
+				   /*@null@ */ const struct imap_handler *handlers);
+
+/* read responses, handing untagged ones to handlers, until the
+   one tagged tag, or a continuation ("+ idling") if continuation
+   is set.  returns 1 if it was OK or a continuation, 0 if NO or
+   BAD, and -1 if the connection failed. */
+int imap_await(struct connection_state *scs, const char *tag,
+			   int continuation,
+			   /*@null@ */ const struct imap_handler *handlers);
+
+/* the same for commands sent back to back, which the server may
+   answer in any order: waits for all n tags, and sets ok[i] to
+   whether tags[i] was OK.  returns 0 if the connection failed. */
+int imap_await_all(struct connection_state *scs,
+				   const char *const *tags, int n, /*@out@ */ int *ok,
+				   /*@null@ */ const struct imap_handler *handlers);
+
+#endif
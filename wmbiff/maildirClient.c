@@ -18,8 +18,10 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <errno.h>
-#include <utime.h>
 #include <unistd.h>
+#include "fileWatch.h"
+#include "MessageList.h"
+#include "threadPool.h"
 #ifdef USE_DMALLOC
 #include <dmalloc.h>
 #endif
@@ -27,40 +29,87 @@
 
 #define PCM	(pc->u).maildir
 
-static int count_msgs(char *path)
-{
-	DIR *D;
-	struct dirent *de;
-	int count = 0;
+/* how often the counts kept from events are checked against the
+   directories anyway, in seconds */
+#define MAILDIR_RESYNC_INTERVAL 3600
 
-	D = opendir(path);
-	if (D == NULL) {
+/* returns 1 if reading path may have changed its atime */
+static int count_msgs(char *path, int in_new, struct maildir_counts *c)
+{
+	int r = maildir_scan_dir(path, in_new, c);
+	if (r < 0) {
 		DMA(DEBUG_ERROR,
 			"Error opening directory '%s': %s\n", path, strerror(errno));
-		return -1;
 	}
+	return r;
+}
 
-	while ((de = readdir(D)) != NULL) {
-		if ((strcmp(de->d_name, ".") & strcmp(de->d_name, "..")) != 0) {
-			count++;
-		}
+/* a message was delivered, moved between new/ and cur/, had its
+   flags changed (a rename within cur/), or was deleted. */
+static void count_event(Pop3 pc, int in_new, int what, const char *name)
+{
+	struct maildir_counts *c = &PCM.counts;
+
+	if ((what & FILEWATCH_LOST) || PCM.counting) {
+		PCM.synced = 0;
+		return;
 	}
-	closedir(D);
+	if (what & FILEWATCH_ADDED)
+		maildir_count_name(c, in_new, name, 1);
+	if (what & FILEWATCH_REMOVED)
+		maildir_count_name(c, in_new, name, -1);
+	/* can't be right */
+	if (c->total < 0 || c->new < 0 || c->unseen < 0 || c->flagged < 0)
+		PCM.synced = 0;
+}
 
-	return count;
+static void new_event(Pop3 pc, int what, const char *name)
+{
+	count_event(pc, 1, what, name);
+}
+
+static void cur_event(Pop3 pc, int what, const char *name)
+{
+	count_event(pc, 0, what, name);
+}
+
+static void show_counts(Pop3 pc)
+{
+	pc->TotalMsgs = PCM.counts.total;
+	/* cur/ holds messages that were only listed, too */
+	pc->UnreadMsgs = PCM.counts.new + PCM.counts.unseen;
 }
 
 int maildirCheckHistory(Pop3 pc)
 {
-	struct stat st_new;
-	struct stat st_cur;
-	struct utimbuf ut;
+	struct file_stamp st_new;
+	struct file_stamp st_cur;
+	int touched_new, touched_cur;
 	char path_new[BUF_BIG * 2], path_cur[BUF_BIG * 2];
-
-	int count_new = 0, count_cur = 0;
+	time_t now = time(NULL);
+	struct maildir_counts counts;
 
 	DM(pc, DEBUG_INFO, ">Maildir: '%s'\n", pc->path);
 
+	if (!pc->watched)
+		filewatch_retry(pc);
+
+	if (pc->watched && PCM.synced) {
+		if (now < PCM.synced_at + MAILDIR_RESYNC_INTERVAL) {
+			show_counts(pc);
+			/* not to be mistaken for new ones next time */
+			PCM.prefetch_new.ready = PCM.prefetch_cur.ready = 0;
+			return 0;
+		}
+		DM(pc, DEBUG_INFO, "  counting again, just in case\n");
+		PCM.synced = 0;
+	}
+	if (pc->watched) {
+		/* events from before the count below are included in it,
+		   so they mustn't be counted again afterwards */
+		(void) filewatch_dispatch();
+	}
+
 	strcpy(path_new, pc->path);
 	strcat(path_new, "/new/");
 	strcpy(path_cur, pc->path);
@@ -83,60 +132,86 @@ int maildirCheckHistory(Pop3 pc)
 	}
 
 	/* maildir */
-	if (stat(path_new, &st_new)) {
+	if (file_stamp_prefetched(&PCM.prefetch_new, path_new, &st_new)) {
 		DM(pc, DEBUG_ERROR, "Can't stat mailbox '%s': %s\n",
 		   path_new, strerror(errno));
 		return -1;				/* Error stating mailbox */
 	}
-	if (stat(path_cur, &st_cur)) {
+	if (file_stamp_prefetched(&PCM.prefetch_cur, path_cur, &st_cur)) {
 		DM(pc, DEBUG_ERROR, "Can't stat mailbox '%s': %s\n",
 		   path_cur, strerror(errno));
 		return -1;				/* Error stating mailbox */
 	}
 
 
-	/* file was changed OR initially read */
-	if (st_new.st_mtime != PCM.mtime_new
-		|| st_new.st_size != PCM.size_new
-		|| st_cur.st_mtime != PCM.mtime_cur
-		|| st_cur.st_size != PCM.size_cur || pc->OldMsgs < 0) {
+	/* file was changed OR initially read OR the counts kept from
+	   events can't be trusted */
+	if (file_stamp_changed(&PCM.stamp_new, &st_new)
+		|| file_stamp_changed(&PCM.stamp_cur, &st_cur)
+		|| pc->OldMsgs < 0 || (pc->watched && !PCM.synced)) {
 		DM(pc, DEBUG_INFO, "  was changed,\n"
 		   " TIME(new): old %lu, new %lu"
 		   " SIZE(new): old %lu, new %lu\n"
 		   " TIME(cur): old %lu, new %lu"
 		   " SIZE(cur): old %lu, new %lu\n",
-		   PCM.mtime_new, (unsigned long) st_new.st_mtime,
-		   (unsigned long) PCM.size_new, (unsigned long) st_new.st_size,
-		   PCM.mtime_cur, (unsigned long) st_cur.st_mtime,
-		   (unsigned long) PCM.size_cur, (unsigned long) st_cur.st_size);
-
-		count_new = count_msgs(path_new);
-		count_cur = count_msgs(path_cur);
-		if ((count_new | count_cur) == -1) {	/* errors occurred */
+		   (unsigned long) PCM.stamp_new.mtime.tv_sec,
+		   (unsigned long) st_new.mtime.tv_sec,
+		   (unsigned long) PCM.stamp_new.size,
+		   (unsigned long) st_new.size,
+		   (unsigned long) PCM.stamp_cur.mtime.tv_sec,
+		   (unsigned long) st_cur.mtime.tv_sec,
+		   (unsigned long) PCM.stamp_cur.size,
+		   (unsigned long) st_cur.size);
+
+		memset(&counts, 0, sizeof(counts));
+		if ((touched_new = count_msgs(path_new, 1, &counts)) < 0
+			|| (touched_cur = count_msgs(path_cur, 0, &counts)) < 0) {
 			return -1;
 		}
 
-		pc->TotalMsgs = count_cur + count_new;
-		pc->UnreadMsgs = count_new;
-
-		/* Reset atime for MUTT and something others work correctly */
-		ut.actime = st_new.st_atime;
-		ut.modtime = st_new.st_mtime;
-		utime(path_new, &ut);
-		ut.actime = st_cur.st_atime;
-		ut.modtime = st_cur.st_mtime;
-		utime(path_cur, &ut);
+		PCM.counts = counts;
+		show_counts(pc);
+		PCM.synced = pc->watched;
+		PCM.synced_at = now;
+		if (pc->watched) {
+			/* a message that came, went or moved while new/ and
+			   cur/ were read may or may not be in the count, so
+			   its event can't be applied to it: count again */
+			PCM.counting = 1;
+			(void) filewatch_dispatch();
+			PCM.counting = 0;
+		}
 
 		/* Store new values */
-		PCM.mtime_new = st_new.st_mtime;	/* Store new mtime_new */
-		PCM.size_new = st_new.st_size;	/* Store new size_new */
-		PCM.mtime_cur = st_cur.st_mtime;	/* Store new mtime_cur */
-		PCM.size_cur = st_cur.st_size;	/* Store new size_cur */
+		PCM.stamp_new = st_new;
+		PCM.stamp_cur = st_cur;
+
+		/* Reset atime for MUTT and something others work correctly,
+		   unless the directories were read with O_NOATIME */
+		if (touched_new)
+			file_stamp_restore_atime(path_new, &PCM.stamp_new);
+		if (touched_cur)
+			file_stamp_restore_atime(path_cur, &PCM.stamp_cur);
 	}
 
 	return 0;
 }
 
+/* new/ and cur/ are stamped along with the other mailboxes, unless
+   the counts kept from events will do */
+static void maildirPrefetch(Pop3 pc, struct stat_batch *b)
+{
+	char path[BUF_BIG * 2];
+
+	if (pc->watched && PCM.synced
+		&& time(NULL) < PCM.synced_at + MAILDIR_RESYNC_INTERVAL)
+		return;
+	sprintf(path, "%s/new/", pc->path);
+	stat_batch_add(b, path, PCM.remote, &PCM.prefetch_new);
+	sprintf(path, "%s/cur/", pc->path);
+	stat_batch_add(b, path, PCM.remote, &PCM.prefetch_cur);
+}
+
 int maildirCreate(Pop3 pc, const char *str)
 {
 	int i;
@@ -149,6 +224,12 @@ int maildirCreate(Pop3 pc, const char *str)
 	pc->OldUnreadMsgs = -1;
 	pc->checkMail = maildirCheckHistory;
 	pc->u.maildir.dircache_flush = 0;
+	PCM.synced = 0;
+	PCM.counting = 0;
+	PCM.remote = 0;
+	memset(&PCM.stamp_new, 0, sizeof(PCM.stamp_new));
+	memset(&PCM.stamp_cur, 0, sizeof(PCM.stamp_cur));
+	PCM.prefetch_new.ready = PCM.prefetch_cur.ready = 0;
 
 	/* special flags */
 	if (*(str + 8) == ':') {	/* path is of the format maildir::flags:path */
@@ -174,6 +255,270 @@ int maildirCreate(Pop3 pc, const char *str)
 	DM(pc, DEBUG_INFO, "maildir: str = '%s'\n", str);
 	DM(pc, DEBUG_INFO, "maildir: path= '%s'\n", pc->path);
 
+	/* the dircache flush would wake us up; and the F flag is for
+	   network mounts, which can't be watched anyway, and where the
+	   server is to be asked every time */
+	if (!pc->u.maildir.dircache_flush && pc->path[0] != '\0') {
+		char path[BUF_BIG * 2];
+		PCM.remote = remote_filesystem(pc->path);
+		/* (the dircache flush has to come before the stat) */
+		pc->prefetch = maildirPrefetch;
+		sprintf(path, "%s/new/", pc->path);
+		(void) filewatch_add(pc, path, FILEWATCH_ADDED | FILEWATCH_REMOVED,
+							 new_event);
+		sprintf(path, "%s/cur/", pc->path);
+		(void) filewatch_add(pc, path, FILEWATCH_ADDED | FILEWATCH_REMOVED,
+							 cur_event);
+	}
+
+	return 0;
+}
+
+/* maildir++: a maildir whose folders are maildirs of their own,
+   named .Folder and .Folder.Subfolder right below it.  All of them
+   are counted together; the folders are found again only when one
+   was added or removed, which changes the top directory's mtime,
+   and each is read again only when its new/ or cur/ changed.  With
+   scanthreads, several folders are read at once. */
+
+struct maildir_folder {
+	char *name;					/* "" for the top, else ".Folder" */
+	struct file_stamp stamp_new;
+	struct file_stamp stamp_cur;
+	struct maildir_counts counts;
+	int error;					/* errno, if it couldn't be read */
+};
+
+struct folder_scan {
+	const char *root;
+	struct maildir_folder *folders;
+};
+
+/* runs on a worker thread: only touches its own folder */
+static void scan_folder(void *data, int i)
+{
+	struct folder_scan *fs = data;
+	struct maildir_folder *f = &fs->folders[i];
+	struct file_stamp st_new, st_cur;
+	char path_new[BUF_BIG * 3], path_cur[BUF_BIG * 3];
+	int touched_new, touched_cur;
+
+	sprintf(path_new, "%s/%s/new", fs->root, f->name);
+	sprintf(path_cur, "%s/%s/cur", fs->root, f->name);
+	if (file_stamp(path_new, &st_new) != 0
+		|| file_stamp(path_cur, &st_cur) != 0) {
+		f->error = errno;
+		return;
+	}
+	if (!file_stamp_changed(&f->stamp_new, &st_new)
+		&& !file_stamp_changed(&f->stamp_cur, &st_cur) && f->error == 0)
+		return;
+
+	memset(&f->counts, 0, sizeof(f->counts));
+	f->error = 0;
+	if ((touched_new = maildir_scan_dir(path_new, 1, &f->counts)) < 0
+		|| (touched_cur = maildir_scan_dir(path_cur, 0, &f->counts)) < 0) {
+		f->error = errno;
+		return;
+	}
+	f->stamp_new = st_new;
+	f->stamp_cur = st_cur;
+
+	/* as for a plain maildir, for MUTT */
+	if (touched_new)
+		file_stamp_restore_atime(path_new, &f->stamp_new);
+	if (touched_cur)
+		file_stamp_restore_atime(path_cur, &f->stamp_cur);
+}
+
+static int folder_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct maildir_folder *) a)->name,
+				  ((const struct maildir_folder *) b)->name);
+}
+
+static void free_folders(Pop3 pc)
+{
+	int i;
+	for (i = 0; i < PCM.nfolders; i++)
+		free(PCM.folders[i].name);
+	free(PCM.folders);
+	PCM.folders = NULL;
+	PCM.nfolders = 0;
+}
+
+/* list the folders below pc->path, keeping what is known about
+   those that were there before */
+static int find_folders(Pop3 pc)
+{
+	struct maildir_folder *found;
+	int nfound = 1, alloc = 16, i;
+	struct dirent *de;
+	DIR *D = opendir(pc->path);
+
+	if (D == NULL) {
+		DM(pc, DEBUG_ERROR, "Error opening directory '%s': %s\n",
+		   pc->path, strerror(errno));
+		return -1;
+	}
+	found = calloc(alloc, sizeof(struct maildir_folder));
+	if (found == NULL) {
+		closedir(D);
+		return -1;
+	}
+	found[0].name = strdup("");
+	while (found[0].name != NULL && (de = readdir(D)) != NULL) {
+		char *name;
+		if (de->d_name[0] != '.' || strcmp(de->d_name, ".") == 0
+			|| strcmp(de->d_name, "..") == 0)
+			continue;
+#ifdef _DIRENT_HAVE_D_TYPE
+		if (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN
+			&& de->d_type != DT_LNK)
+			continue;
+#endif
+		if (nfound == alloc) {
+			struct maildir_folder *more =
+				realloc(found, 2 * alloc * sizeof(struct maildir_folder));
+			if (more == NULL)
+				break;
+			found = more;
+			memset(found + alloc, 0, alloc * sizeof(struct maildir_folder));
+			alloc *= 2;
+		}
+		name = strdup(de->d_name);
+		if (name == NULL)
+			break;
+		found[nfound++].name = name;
+	}
+	closedir(D);
+	if (found[0].name == NULL) {
+		free(found);
+		return -1;
+	}
+	/* for msglst; the top stays first */
+	qsort(found + 1, nfound - 1, sizeof(struct maildir_folder), folder_cmp);
+
+	for (i = 0; i < nfound; i++) {
+		int j;
+		for (j = 0; j < PCM.nfolders; j++) {
+			if (strcmp(PCM.folders[j].name, found[i].name) == 0) {
+				char *name = found[i].name;
+				found[i] = PCM.folders[j];
+				found[i].name = name;
+				break;
+			}
+		}
+	}
+	free_folders(pc);
+	PCM.folders = found;
+	PCM.nfolders = nfound;
+	DM(pc, DEBUG_INFO, "maildir++: %d folders\n", nfound);
+	return 0;
+}
+
+int maildirppCheckHistory(Pop3 pc)
+{
+	struct folder_scan fs;
+	struct file_stamp st;
+	int i, folders = 0;
+
+	DM(pc, DEBUG_INFO, ">Maildir++: '%s'\n", pc->path);
+
+	if (file_stamp(pc->path, &st) != 0) {
+		DM(pc, DEBUG_ERROR, "Can't stat mailbox '%s': %s\n",
+		   pc->path, strerror(errno));
+		return -1;
+	}
+	if (file_stamp_changed(&PCM.stamp_root, &st) || PCM.folders == NULL) {
+		if (find_folders(pc) < 0)
+			return -1;
+		PCM.stamp_root = st;
+	}
+
+	fs.root = pc->path;
+	fs.folders = PCM.folders;
+	thread_pool_run(scan_thread_pool(), PCM.nfolders, scan_folder, &fs);
+
+	pc->TotalMsgs = 0;
+	pc->UnreadMsgs = 0;
+	for (i = 0; i < PCM.nfolders; i++) {
+		const struct maildir_folder *f = &PCM.folders[i];
+		if (f->error != 0) {
+			/* files that start with a dot aren't always folders */
+			if (f->name[0] == '\0' || f->error != ENOENT)
+				DM(pc, DEBUG_ERROR, "Can't read folder '%s/%s': %s\n",
+				   pc->path, f->name, strerror(f->error));
+			continue;
+		}
+		folders++;
+		pc->TotalMsgs += f->counts.total;
+		pc->UnreadMsgs += f->counts.new + f->counts.unseen;
+	}
+	DM(pc, DEBUG_INFO, "maildir++: %d/%d in %d folders\n", pc->UnreadMsgs,
+	   pc->TotalMsgs, folders);
+	return 0;
+}
+
+/* for msglst: the folders with unread mail */
+struct msglst *maildirpp_getHeaders(Pop3 pc)
+{
+	struct msglst *list = NULL;
+	int i;
+	for (i = PCM.nfolders - 1; i >= 0; i--) {
+		const struct maildir_folder *f = &PCM.folders[i];
+		struct msglst *m;
+		int unread = f->counts.new + f->counts.unseen;
+		if (f->error != 0 || unread == 0)
+			continue;
+		m = calloc(1, sizeof(struct msglst));
+		if (m == NULL)
+			break;
+		strncpy(m->from, (f->name[0] != '\0') ? f->name + 1 : "INBOX",
+				FROM_LEN - 1);
+		snprintf(m->subj, SUBJ_LEN, "%d unread of %d", unread,
+				 f->counts.total);
+		m->next = list;
+		list = m;
+	}
+	return list;
+}
+
+void maildirpp_releaseHeaders(Pop3 pc __attribute__ ((unused)),
+							  struct msglst *h)
+{
+	while (h != NULL) {
+		struct msglst *n = h->next;
+		free(h);
+		h = n;
+	}
+}
+
+int maildirppCreate(Pop3 pc, const char *str)
+{
+	/* Maildir++ format: maildir++:fullpathname */
+
+	pc->TotalMsgs = 0;
+	pc->UnreadMsgs = 0;
+	pc->OldMsgs = -1;
+	pc->OldUnreadMsgs = -1;
+	pc->checkMail = maildirppCheckHistory;
+	pc->getHeaders = maildirpp_getHeaders;
+	pc->releaseHeaders = maildirpp_releaseHeaders;
+	PCM.folders = NULL;
+	PCM.nfolders = 0;
+	memset(&PCM.stamp_root, 0, sizeof(PCM.stamp_root));
+
+	if (strlen(str + 10) + 1 > BUF_BIG) {
+		DM(pc, DEBUG_ERROR, "maildir++ '%s' is too long.\n", str + 10);
+		memset(pc->path, 0, BUF_BIG);
+	} else {
+		strncpy(pc->path, str + 10, BUF_BIG - 1);	/* cut off ``maildir++:'' */
+	}
+
+	DM(pc, DEBUG_INFO, "maildir++: str = '%s'\n", str);
+	DM(pc, DEBUG_INFO, "maildir++: path= '%s'\n", pc->path);
+
 	return 0;
 }
 
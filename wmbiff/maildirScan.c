@@ -0,0 +1,129 @@
+/* maildirScan.c - counting the messages in a maildir directory.
+
+   A message's name ends in ":2," and its flags, in ASCII order,
+   once a mail reader has seen it in new/ and moved it to cur/;
+   "S" is seen and "F" is flagged.  On Linux the directory is read
+   with getdents64 in large batches instead of one readdir entry at
+   a time, which matters for directories of a hundred thousand
+   messages. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+#if defined(SYS_getdents64) && defined(O_DIRECTORY)
+#define USE_GETDENTS64
+#include <stdlib.h>
+#else
+#include <dirent.h>
+#endif
+
+#include "maildirScan.h"
+#include "fileStamp.h"
+
+#ifdef USE_DMALLOC
+#include <dmalloc.h>
+#endif
+
+void maildir_count_name(struct maildir_counts *c, int in_new,
+						const char *name, int delta)
+{
+	const char *info;
+	int seen = 0, flagged = 0;
+
+	if (name[0] == '.' || name[0] == '\0')
+		return;
+	info = strrchr(name, ':');
+	if (info != NULL && info[1] == '2' && info[2] == ',') {
+		seen = (strchr(info + 3, 'S') != NULL);
+		flagged = (strchr(info + 3, 'F') != NULL);
+	}
+	c->total += delta;
+	if (in_new)
+		c->new += delta;
+	else if (!seen)
+		c->unseen += delta;
+	if (flagged)
+		c->flagged += delta;
+}
+
+#ifdef USE_GETDENTS64
+
+/* not in glibc's headers until 2.30 */
+struct linux_dirent64 {
+	unsigned long long d_ino;
+	long long d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+#define GETDENTS_SIZE (64 * 1024)
+
+int maildir_scan_dir(const char *path, int in_new,
+					 struct maildir_counts *c)
+{
+	char *buf;
+	long n;
+	int noatime;
+	int fd = open_noatime(path, O_RDONLY | O_DIRECTORY, &noatime);
+	if (fd < 0)
+		return -1;
+	buf = malloc(GETDENTS_SIZE);
+	if (buf == NULL) {
+		close(fd);
+		return -1;
+	}
+	while ((n = syscall(SYS_getdents64, fd, buf, GETDENTS_SIZE)) > 0) {
+		long pos;
+		for (pos = 0; pos < n;) {
+			const struct linux_dirent64 *d =
+				(const struct linux_dirent64 *) (buf + pos);
+			maildir_count_name(c, in_new, d->d_name, 1);
+			pos += d->d_reclen;
+		}
+	}
+	free(buf);
+	if (n < 0) {
+		int e = errno;
+		close(fd);
+		errno = e;
+		return -1;
+	}
+	close(fd);
+	return !noatime;
+}
+
+#else							/* USE_GETDENTS64 */
+
+int maildir_scan_dir(const char *path, int in_new,
+					 struct maildir_counts *c)
+{
+	struct dirent *de;
+	DIR *D = opendir(path);
+	if (D == NULL)
+		return -1;
+	while ((de = readdir(D)) != NULL)
+		maildir_count_name(c, in_new, de->d_name, 1);
+	closedir(D);
+	return 1;
+}
+
+#endif							/* USE_GETDENTS64 */
+
+/* vim:set ts=4: */
+/*
+ * Local Variables:
+ * tab-width: 4
+ * c-indent-level: 4
+ * c-basic-offset: 4
+ * End:
+ */
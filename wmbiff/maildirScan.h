@@ -0,0 +1,26 @@
+/* maildirScan.h - counting the messages in a maildir directory by
+   their names, which carry the flags that say whether they were
+   seen, in one pass over the directory. */
+
+#ifndef MAILDIRSCAN
+#define MAILDIRSCAN
+
+struct maildir_counts {
+	int total;
+	int new;					/* in new/ */
+	int unseen;					/* in cur/, without the S flag */
+	int flagged;				/* with the F flag, in either */
+};
+
+/* add (delta 1) or take away (delta -1) the message called name,
+   in new/ if in_new, else in cur/.  dot files aren't messages. */
+void maildir_count_name(struct maildir_counts *c, int in_new,
+						const char *name, int delta);
+
+/* add the messages in the directory path, new/ if in_new; returns
+   -1 (with errno) if it can't be read, 1 if reading it may have
+   changed its atime, and 0 if it was read with O_NOATIME. */
+int maildir_scan_dir(const char *path, int in_new,
+					 struct maildir_counts *c);
+
+#endif
@@ -17,110 +17,199 @@
 #include "Client.h"
 #include <sys/stat.h>
 #include <errno.h>
-#include <utime.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "threadPool.h"
+#include "fileWatch.h"
 #ifdef USE_DMALLOC
 #include <dmalloc.h>
 #endif
 
 #define PCM	(pc->u).mbox
-#define FROM_STR   "From "
-#define STATUS_STR "Status: "
 
-FILE *openMailbox(Pop3 pc, const char *mbox_filename)
+/* how long a scan is put off while a mailbox is being delivered
+   to; a dot lock older than this is taken to be stale */
+#define MBOX_DELIVERY_WAIT 60
+
+/* shared by all mailboxes, started on first use if scan_threads > 1 */
+static struct thread_pool *scan_pool;
+
+struct thread_pool *scan_thread_pool(void)
+{
+	if (scan_pool == NULL && scan_threads > 1)
+		scan_pool = thread_pool_create(scan_threads);
+	return scan_pool;
+}
+
+/* *noatime is set if reading the mailbox won't change its atime */
+FILE *openMailbox(Pop3 pc, const char *mbox_filename, int *noatime)
 {
-	FILE *mailbox;
+	FILE *mailbox = NULL;
+	int fd = open_noatime(mbox_filename, O_RDONLY, noatime);
 
-	if ((mailbox = fopen(mbox_filename, "r")) == NULL) {
+	if (fd < 0 || (mailbox = fdopen(fd, "r")) == NULL) {
 		DM(pc, DEBUG_ERROR, "Error opening mailbox '%s': %s\n",
 		   mbox_filename, strerror(errno));
+		if (fd >= 0)
+			close(fd);
 		pc->TotalMsgs = -1;
 		pc->UnreadMsgs = -1;
 	}
 	return (mailbox);
 }
 
-/* count the messages in a mailbox */
-static void countMessages(Pop3 pc, const char *mbox_filename)
+/* count the messages in a mailbox, starting from the latest
+   checkpoint in its index that the file still matches; returns 1
+   if its atime may have changed */
+static int countMessages(Pop3 pc, const char *mbox_filename)
 {
 	FILE *F;
-	char buf[BUF_SIZE];
-	int is_header = 0;
-	int next_from_is_start_of_header = 1;
-	int count_from = 0, count_status = 0;
-	int len_from = strlen(FROM_STR), len_status = strlen(STATUS_STR);
-	int pseudo_mail = 0;
-
-	F = openMailbox(pc, mbox_filename);
-	if (F == NULL)
-		return;
-
-	/* count message */
-	while (fgets(buf, BUF_SIZE, F)) {
-		// The first message usually is automatically created by POP3/IMAP
-		// clients for internal record keeping and is ignored
-		// (not displayed) by most email clients.
-		if (is_header && !strncmp(buf, "X-IMAP: ", 8))
-		{
-			pseudo_mail = 1;
-		}
-		if (buf[0] == '\n') {
-			/* a newline by itself terminates the header */
-			if (is_header)
-				is_header = 0;
-			else
-				next_from_is_start_of_header = 1;
-		} else if (!strncmp(buf, FROM_STR, len_from)) {
-			/* A line starting with "From" is the beginning of a new header.
-			   "From" in the text of the mail should get escaped by the MDA.
-			   If your MDA doesn't do that, it is broken.
-			 */
-			if (next_from_is_start_of_header)
-				is_header = 1;
-			if (is_header)
-				count_from++;
-		} else {
-			next_from_is_start_of_header = 0;
-			if (is_header && !strncmp(buf, STATUS_STR, len_status)
-				&& strrchr(buf, 'R')) {
-				count_status++;
-			}
-		}
+	struct mbox_scan counts;
+	struct stat sb;
+	int compression = MBOX_PLAIN;
+	int noatime, ret;
+
+	F = openMailbox(pc, mbox_filename, &noatime);
+	if (F == NULL) {
+		PCM.offset = 0;
+		return 0;
+	}
+
+	if (fstat(fileno(F), &sb) == 0 && S_ISREG(sb.st_mode)) {
+		if (PCM.index == NULL)
+			PCM.index = mbox_index_load(mbox_filename);
+		compression = mbox_compression(fileno(F));
+	} else if (PCM.index != NULL) {
+		mbox_index_free(PCM.index);
+		PCM.index = NULL;
+	}
+	if (!mbox_compression_supported(compression)) {
+		DM(pc, DEBUG_ERROR, "Mailbox '%s' is compressed with %s, "
+		   "which this wmbiff wasn't built to read\n", mbox_filename,
+		   mbox_compression_name(compression));
+		pc->TotalMsgs = -1;
+		pc->UnreadMsgs = -1;
+		fclose(F);
+		return 0;
 	}
 
-	if (count_from && pseudo_mail) {
-		count_from--;
-		if (count_status)
-			count_status--;
+	/* a compressed body can't be skipped without decompressing it */
+	PCM.content_length_used = PCM.content_length
+		&& compression == MBOX_PLAIN;
+	PCM.scan.use_content_length = PCM.content_length_used;
+	if (PCM.index != NULL
+		&& mbox_index_resume(PCM.index, fileno(F), &sb, &PCM.offset,
+							 &PCM.scan) == 0) {
+		DM(pc, DEBUG_INFO, "resuming scan at offset %lu\n",
+		   (unsigned long) PCM.offset);
+	} else {
+		PCM.offset = 0;
+		mbox_scan_init(&PCM.scan);
+		PCM.scan.use_content_length = PCM.content_length_used;
+	}
+
+	/* PCM.scan stops at the last complete line; a partial line
+	   at the end may still be being written, so it is counted
+	   now but scanned again next time. */
+	if (PCM.index != NULL)
+		ret = mbox_index_scan(PCM.index, fileno(F), &sb, compression,
+							  &PCM.offset, &PCM.scan, &counts,
+							  scan_thread_pool());
+	else if (compression != MBOX_PLAIN)
+		ret = mbox_scan_compressed(fileno(F), compression, &PCM.offset,
+								   &PCM.scan, &counts, NULL, NULL);
+	else
+		ret = mbox_scan_fd(fileno(F), &PCM.offset, &PCM.scan, &counts);
+	if (ret < 0) {
+		DM(pc, DEBUG_ERROR, "Error reading mailbox '%s': %s\n",
+		   mbox_filename, strerror(errno));
+		PCM.offset = 0;
+	} else if (PCM.index != NULL
+			   && mbox_index_save(PCM.index, mbox_filename) < 0) {
+		DM(pc, DEBUG_INFO, "can't save index of '%s': %s\n",
+		   mbox_filename, strerror(errno));
 	}
 
-	DM(pc, DEBUG_INFO, "from: %d status: %d\n", count_from, count_status);
-	pc->TotalMsgs = count_from;
-	pc->UnreadMsgs = count_from - count_status;
+	DM(pc, DEBUG_INFO, "from: %d status: %d\n", counts.count_from,
+	   counts.count_status);
+	pc->TotalMsgs = mbox_scan_total(&counts);
+	pc->UnreadMsgs = mbox_scan_unread(&counts);
 	fclose(F);
+	return !noatime;
+}
+
+/* is someone, procmail or postfix say, still writing to the
+   mailbox?  scanning it now would count half a message, and then
+   the rest of it would be scanned again when they're done. */
+static int beingDelivered(Pop3 pc, const char *mbox_filename)
+{
+	char *lock;
+	struct stat st;
+	struct flock fl;
+	int fd, locked = 0;
+
+	if (PCM.writing) {
+		DM(pc, DEBUG_INFO, "'%s' is still open for writing\n",
+		   mbox_filename);
+		return 1;
+	}
+
+	lock = malloc(strlen(mbox_filename) + 6);
+	if (lock != NULL) {
+		sprintf(lock, "%s.lock", mbox_filename);
+		if (stat(lock, &st) == 0
+			&& st.st_mtime + MBOX_DELIVERY_WAIT > time(0)) {
+			DM(pc, DEBUG_INFO, "'%s' is dot locked\n", mbox_filename);
+			locked = 1;
+		}
+		free(lock);
+	}
+	if (locked)
+		return 1;
+
+	/* a read lock would conflict only with a writer's lock */
+	fd = open(mbox_filename, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_RDLCK;
+	fl.l_whence = SEEK_SET;
+	if (fcntl(fd, F_GETLK, &fl) == 0 && fl.l_type == F_WRLCK) {
+		DM(pc, DEBUG_INFO, "'%s' is locked by process %d\n",
+		   mbox_filename, (int) fl.l_pid);
+		locked = 1;
+	}
+	close(fd);
+	return locked;
 }
 
 /* check file status; hold on to file information used
    to restore access time */
 int
-fileHasChanged(const char *mbox_filename, time_t * atime,
-			   time_t * mtime, off_t * size)
+fileHasChanged(const char *mbox_filename, struct file_stamp *stamp,
+			   struct prefetched_stamp *prefetched)
 {
-	struct stat st;
+	struct file_stamp now;
+	int r;
 
 	/* mbox file */
-	if (stat(mbox_filename, &st)) {
+	if (prefetched != NULL)
+		r = file_stamp_prefetched(prefetched, mbox_filename, &now);
+	else
+		r = file_stamp(mbox_filename, &now);
+	if (r != 0) {
 		DMA(DEBUG_ERROR, "Can't stat '%s': %s\n",
 			mbox_filename, strerror(errno));
-	} else if (st.st_mtime != *mtime || st.st_size != *size) {
+	} else if (file_stamp_changed(stamp, &now)) {
 		/* file was changed OR initially read */
 		DMA(DEBUG_INFO, " %s was changed,"
-			" mTIME: %lu -> %lu; SIZE: %lu -> %lu\n",
-			mbox_filename, *mtime, st.st_mtime,
-			(unsigned long) *size, (unsigned long) st.st_size);
+			" mTIME: %lu.%09ld -> %lu.%09ld; SIZE: %lu -> %lu\n",
+			mbox_filename, (unsigned long) stamp->mtime.tv_sec,
+			stamp->mtime.tv_nsec, (unsigned long) now.mtime.tv_sec,
+			now.mtime.tv_nsec, (unsigned long) stamp->size,
+			(unsigned long) now.size);
 
-		*atime = st.st_atime;
-		*mtime = st.st_mtime;
-		*size = st.st_size;
+		*stamp = now;
 		return 1;
 	}
 	return 0;
@@ -129,24 +218,56 @@ fileHasChanged(const char *mbox_filename, time_t * atime,
 int mboxCheckHistory(Pop3 pc)
 {
 	char *mbox_filename = backtickExpand(pc, pc->path);
-	struct utimbuf ut;
-
+	struct file_stamp was = PCM.stamp;
 	DM(pc, DEBUG_INFO, ">Mailbox: '%s'\n", mbox_filename);
 
-	if (fileHasChanged(mbox_filename, &ut.actime, &PCM.mtime, &PCM.size)
-		|| pc->OldMsgs < 0) {
+	/* the file may have been deleted when it was emptied */
+	if (!pc->watched)
+		filewatch_retry(pc);
 
-		countMessages(pc, mbox_filename);
+	if (fileHasChanged(mbox_filename, &PCM.stamp, &PCM.prefetch)
+		|| pc->OldMsgs < 0) {
 
-		/* Reset atime for (at least) MUTT to work */
-		/* ut.actime is set above */
-		ut.modtime = PCM.mtime;
-		utime(mbox_filename, &ut);
+		if (pc->OldMsgs >= 0 && beingDelivered(pc, mbox_filename)) {
+			if (PCM.postponed_at == 0)
+				PCM.postponed_at = time(0);
+			if (time(0) < PCM.postponed_at + MBOX_DELIVERY_WAIT) {
+				/* look again when the writer closes the file, or
+				   in a moment, and see it as changed then */
+				PCM.stamp = was;
+				pc->prevtime = 0;
+				free(mbox_filename);
+				return 0;
+			}
+			DM(pc, DEBUG_INFO, "gave up waiting for '%s'\n",
+			   mbox_filename);
+		}
+		PCM.postponed_at = 0;
+		/* Reset atime for (at least) MUTT to work, unless
+		   it was read with O_NOATIME */
+		if (countMessages(pc, mbox_filename))
+			file_stamp_restore_atime(mbox_filename, &PCM.stamp);
 	}
 	free(mbox_filename);
 	return 0;
 }
 
+/* the mailbox's stamp, taken along with the others' */
+static void mboxPrefetch(Pop3 pc, struct stat_batch *b)
+{
+	stat_batch_add(b, pc->path, PCM.remote, &PCM.prefetch);
+}
+
+/* a delivery is over when its writer closes the file */
+static void mboxEvent(Pop3 pc, int what, const char *name)
+{
+	(void) name;
+	if (what & (FILEWATCH_CLOSED | FILEWATCH_LOST))
+		PCM.writing = 0;
+	else if (what & FILEWATCH_CHANGED)
+		PCM.writing = 1;
+}
+
 int mboxCreate(Pop3 pc, const char *str)
 {
 	/* MBOX format: mbox:fullpathname */
@@ -156,20 +277,49 @@ int mboxCreate(Pop3 pc, const char *str)
 	pc->OldMsgs = -1;
 	pc->OldUnreadMsgs = -1;
 	pc->checkMail = mboxCheckHistory;
+	PCM.offset = 0;
+	PCM.index = NULL;
+	PCM.content_length = 0;
+	PCM.writing = 0;
+	PCM.remote = 0;
+	PCM.prefetch.ready = 0;
+	PCM.postponed_at = 0;
+	memset(&PCM.stamp, 0, sizeof(PCM.stamp));
+	mbox_scan_init(&PCM.scan);
 
 	/* default boxes are mbox... cut mbox: if it exists */
 	if (!strncasecmp(pc->path, "mbox:", 5)) {
-		if (strlen(str + 5) + 1 > BUF_BIG) {
-			DM(pc, DEBUG_ERROR, "mbox '%s' is too long.\n", str + 5);
+		int i = 0;
+		if (str[5] == ':') {	/* path is of the format mbox::flags:path */
+			for (i = 1; str[5 + i] != ':' && str[5 + i] != '\0'; i++) {
+				switch (str[5 + i]) {
+				case 'C':
+					PCM.content_length = 1;
+					PCM.scan.use_content_length = 1;
+					DM(pc, DEBUG_INFO, "mbox: using Content-Length\n");
+				}
+			}
+			if (str[5 + i] == ':')
+				i++;
+		}
+		if (strlen(str + 5 + i) + 1 > BUF_BIG) {
+			DM(pc, DEBUG_ERROR, "mbox '%s' is too long.\n", str + 5 + i);
 			memset(pc->path, 0, BUF_BIG);
 		} else {
-			strncpy(pc->path, str + 5, BUF_BIG - 1);	/* cut off ``mbox:'' */
+			strncpy(pc->path, str + 5 + i, BUF_BIG - 1);	/* cut off ``mbox:'' */
 		}
 	}
 
 	DM(pc, DEBUG_INFO, "mbox: str = '%s'\n", str);
 	DM(pc, DEBUG_INFO, "mbox: path= '%s'\n", pc->path);
 
+	/* a `command` may name a different file each time */
+	if (pc->path[0] != '\0' && strchr(pc->path, '`') == NULL) {
+		PCM.remote = remote_filesystem(pc->path);
+		pc->prefetch = mboxPrefetch;
+		(void) filewatch_add(pc, pc->path, FILEWATCH_CHANGED, mboxEvent);
+	}
+
 	return 0;
 }
 
@@ -0,0 +1,371 @@
+/* mboxCompressed.c - counting the messages in a compressed mbox.
+
+   The file is read a block at a time, and what the decompressor
+   makes of each block goes straight to mbox_scan_lines(), keeping
+   only an unfinished line between blocks; the decompressed mailbox
+   never exists as a whole, in memory or on disk.  Content-Length
+   skips are not used, since a decompressed body has to be made
+   anyway and can't be gone back to if the length turns out to be
+   wrong. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#include <zlib.h>
+#define USE_ZLIB
+#endif
+#if defined(HAVE_LZMA_H) && defined(HAVE_LIBLZMA)
+#include <lzma.h>
+#define USE_LZMA
+#endif
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+#include <zstd.h>
+#define USE_ZSTD
+#endif
+
+#include "mboxCompressed.h"
+
+#ifdef USE_DMALLOC
+#include <dmalloc.h>
+#endif
+
+/* compressed input is read this much at a time */
+#define MBOX_COMPRESSED_READ (64 * 1024)
+/* and there is always at least this much room for its output */
+#define MBOX_INFLATE_SIZE (256 * 1024)
+
+int mbox_compression(int fd)
+{
+	unsigned char m[6];
+	ssize_t n = pread(fd, m, sizeof(m), 0);
+
+	if (n >= 2 && m[0] == 0x1f && m[1] == 0x8b)
+		return MBOX_GZIP;
+	if (n >= 6 && memcmp(m, "\xfd" "7zXZ\0", 6) == 0)
+		return MBOX_XZ;
+	if (n >= 4 && memcmp(m, "\x28\xb5\x2f\xfd", 4) == 0)
+		return MBOX_ZSTD;
+	return MBOX_PLAIN;
+}
+
+const char *mbox_compression_name(int kind)
+{
+	static const char *names[] = { "plain", "gzip", "xz", "zstd" };
+	return (kind >= 0 && kind <= MBOX_ZSTD) ? names[kind] : "unknown";
+}
+
+int mbox_compression_supported(int kind)
+{
+	switch (kind) {
+	case MBOX_PLAIN:
+		return 1;
+#ifdef USE_ZLIB
+	case MBOX_GZIP:
+		return 1;
+#endif
+#ifdef USE_LZMA
+	case MBOX_XZ:
+		return 1;
+#endif
+#ifdef USE_ZSTD
+	case MBOX_ZSTD:
+		return 1;
+#endif
+	default:
+		return 0;
+	}
+}
+
+/* one of the decompressors, behind the same few calls */
+struct decompressor {
+	int kind;
+#ifdef USE_ZLIB
+	z_stream z;
+#endif
+#ifdef USE_LZMA
+	lzma_stream x;
+#endif
+#ifdef USE_ZSTD
+	ZSTD_DStream *zs;
+#endif
+};
+
+static int decompressor_start(struct decompressor *d, int kind)
+{
+	memset(d, 0, sizeof(struct decompressor));
+	d->kind = kind;
+	switch (kind) {
+#ifdef USE_ZLIB
+	case MBOX_GZIP:
+		/* 16: gzip header and trailer, not zlib's */
+		return (inflateInit2(&d->z, 16 + MAX_WBITS) == Z_OK) ? 0 : -1;
+#endif
+#ifdef USE_LZMA
+	case MBOX_XZ:
+		{
+			lzma_stream init = LZMA_STREAM_INIT;
+			d->x = init;
+			return (lzma_stream_decoder(&d->x, UINT64_MAX, 0) ==
+					LZMA_OK) ? 0 : -1;
+		}
+#endif
+#ifdef USE_ZSTD
+	case MBOX_ZSTD:
+		d->zs = ZSTD_createDStream();
+		if (d->zs == NULL)
+			return -1;
+		return ZSTD_isError(ZSTD_initDStream(d->zs)) ? -1 : 0;
+#endif
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+/* ready for the next member, stream or frame */
+static int decompressor_restart(struct decompressor *d)
+{
+	switch (d->kind) {
+#ifdef USE_ZLIB
+	case MBOX_GZIP:
+		return (inflateReset(&d->z) == Z_OK) ? 0 : -1;
+#endif
+#ifdef USE_LZMA
+	case MBOX_XZ:
+		return (lzma_stream_decoder(&d->x, UINT64_MAX, 0) ==
+				LZMA_OK) ? 0 : -1;
+#endif
+	default:
+		/* zstd goes on to the next frame by itself */
+		return 0;
+	}
+}
+
+static void decompressor_end(struct decompressor *d)
+{
+	switch (d->kind) {
+#ifdef USE_ZLIB
+	case MBOX_GZIP:
+		(void) inflateEnd(&d->z);
+		break;
+#endif
+#ifdef USE_LZMA
+	case MBOX_XZ:
+		lzma_end(&d->x);
+		break;
+#endif
+#ifdef USE_ZSTD
+	case MBOX_ZSTD:
+		ZSTD_freeDStream(d->zs);
+		break;
+#endif
+	default:
+		break;
+	}
+}
+
+/* decompress some of in into out; *used and *made say how much of
+   each.  returns 1 at the end of a member, stream or frame (having
+   used none of in past it), 0 if it wants more input or room, and
+   -1 if the data is corrupt. */
+static int
+decompress(struct decompressor *d, const char *in, size_t len,
+		   size_t * used, char *out, size_t room, size_t * made)
+{
+	switch (d->kind) {
+#ifdef USE_ZLIB
+	case MBOX_GZIP:
+		{
+			int r;
+			d->z.next_in = (Bytef *) in;
+			d->z.avail_in = (uInt) len;
+			d->z.next_out = (Bytef *) out;
+			d->z.avail_out = (uInt) room;
+			r = inflate(&d->z, Z_NO_FLUSH);
+			*used = len - d->z.avail_in;
+			*made = room - d->z.avail_out;
+			if (r == Z_STREAM_END)
+				return 1;
+			return (r == Z_OK || r == Z_BUF_ERROR) ? 0 : -1;
+		}
+#endif
+#ifdef USE_LZMA
+	case MBOX_XZ:
+		{
+			lzma_ret r;
+			d->x.next_in = (const uint8_t *) in;
+			d->x.avail_in = len;
+			d->x.next_out = (uint8_t *) out;
+			d->x.avail_out = room;
+			r = lzma_code(&d->x, LZMA_RUN);
+			*used = len - d->x.avail_in;
+			*made = room - d->x.avail_out;
+			if (r == LZMA_STREAM_END)
+				return 1;
+			return (r == LZMA_OK || r == LZMA_BUF_ERROR) ? 0 : -1;
+		}
+#endif
+#ifdef USE_ZSTD
+	case MBOX_ZSTD:
+		{
+			ZSTD_inBuffer zin;
+			ZSTD_outBuffer zout;
+			size_t r;
+			zin.src = in;
+			zin.size = len;
+			zin.pos = 0;
+			zout.dst = out;
+			zout.size = room;
+			zout.pos = 0;
+			r = ZSTD_decompressStream(d->zs, &zout, &zin);
+			*used = zin.pos;
+			*made = zout.pos;
+			if (ZSTD_isError(r))
+				return -1;
+			return (r == 0) ? 1 : 0;
+		}
+#endif
+	default:
+		*used = *made = 0;
+		return -1;
+	}
+}
+
+int mbox_scan_compressed(int fd, int kind, off_t * offset,
+						 struct mbox_scan *st, struct mbox_scan *tail,
+						 mbox_scan_checkpoint checkpoint, void *data)
+{
+	struct decompressor d;
+	struct mbox_scan cur = *st;
+	size_t bufsize = 2 * MBOX_INFLATE_SIZE;
+	char *buf, *in;
+	size_t have = 0;			/* bytes of an unfinished line in buf */
+	size_t in_have = 0, in_used = 0;
+	off_t in_off = *offset;		/* file offset of in[in_used] */
+	int skip_line = st->resume_mid_line;
+	int between_frames = 0;		/* padding may follow a frame */
+	int ret = 0;
+
+	cur.resume_mid_line = 0;
+	if (decompressor_start(&d, kind) < 0)
+		return -1;
+	buf = malloc(bufsize);
+	in = malloc(MBOX_COMPRESSED_READ);
+	if (buf == NULL || in == NULL) {
+		free(buf);
+		free(in);
+		decompressor_end(&d);
+		return -1;
+	}
+
+	for (;;) {
+		size_t used, made;
+		int r;
+
+		if (in_used == in_have) {
+			ssize_t n = pread(fd, in, MBOX_COMPRESSED_READ, in_off);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				ret = -1;
+				break;
+			}
+			/* the end of the file, maybe in the middle of a frame
+			   that is still being written */
+			if (n == 0)
+				break;
+			in_have = (size_t) n;
+			in_used = 0;
+		}
+		if (between_frames) {
+			/* xz streams can be padded with zeros; so, sometimes,
+			   are gzip files */
+			while (in_used < in_have && in[in_used] == '\0') {
+				in_used++;
+				in_off++;
+			}
+			if (in_used == in_have)
+				continue;
+			between_frames = 0;
+			if (decompressor_restart(&d) < 0) {
+				ret = -1;
+				break;
+			}
+		}
+		if (bufsize - have < MBOX_INFLATE_SIZE) {
+			/* a very long line: make room for it */
+			char *bigger = realloc(buf, bufsize * 2);
+			if (bigger == NULL) {
+				ret = -1;
+				break;
+			}
+			buf = bigger;
+			bufsize *= 2;
+		}
+
+		r = decompress(&d, in + in_used, in_have - in_used, &used,
+					   buf + have, bufsize - have, &made);
+		if (r < 0 || (r == 0 && used == 0 && made == 0)) {
+			errno = EINVAL;		/* not what it claimed to be */
+			ret = -1;
+			break;
+		}
+		in_used += used;
+		in_off += (off_t) used;
+		if (made > 0) {
+			size_t done;
+			have += made;
+			if (skip_line) {
+				char *nl = memchr(buf, '\n', have);
+				done = (nl != NULL) ? (size_t) (nl + 1 - buf) : have;
+				skip_line = (nl == NULL);
+				have -= done;
+				memmove(buf, buf + done, have);
+			}
+			done = mbox_scan_lines(&cur, buf, have);
+			have -= done;
+			memmove(buf, buf + done, have);
+		}
+
+		if (r == 1) {
+			/* the rest of a line in a body doesn't change the
+			   state, whatever it turns out to be, unless it is
+			   empty; so a frame can end in one */
+			int in_body = !cur.is_header
+				&& !cur.next_from_is_start_of_header;
+			if ((have == 0 && !skip_line) || in_body) {
+				*st = cur;
+				st->resume_mid_line = (have > 0 || skip_line);
+				*offset = in_off;
+				if (checkpoint != NULL)
+					checkpoint(data, in_off, st);
+			}
+			between_frames = 1;
+		}
+	}
+
+	if (tail != NULL) {
+		*tail = cur;
+		if (have > 0 && !skip_line && ret == 0)
+			mbox_scan_line(tail, buf, have);
+	}
+	free(in);
+	free(buf);
+	decompressor_end(&d);
+	return ret;
+}
+
+/* vim:set ts=4: */
+/*
+ * Local Variables:
+ * tab-width: 4
+ * c-indent-level: 4
+ * c-basic-offset: 4
+ * End:
+ */
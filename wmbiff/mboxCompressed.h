@@ -0,0 +1,35 @@
+/* mboxCompressed.h - counting the messages in a compressed mbox
+   (gzip, xz or zstd) by streaming it through the decompressor into
+   the scanner, a block at a time. */
+
+#ifndef MBOXCOMPRESSED
+#define MBOXCOMPRESSED
+
+#include <sys/types.h>
+#include "mboxScan.h"
+
+#define MBOX_PLAIN 0
+#define MBOX_GZIP 1
+#define MBOX_XZ 2
+#define MBOX_ZSTD 3
+
+/* which of the above fd holds, by its first bytes */
+int mbox_compression(int fd);
+const char *mbox_compression_name(int kind);
+/* whether this wmbiff was built with the library for kind */
+int mbox_compression_supported(int kind);
+
+/* like mbox_scan_fd_checkpoints, but *offset is in the compressed
+   file and must be where a gzip member, xz stream or zstd frame
+   starts.  Those are decompressed independently, so a file that
+   was appended to, or written as many frames, is resumed from the
+   end of the last one that was complete: checkpoints come only at
+   such ends, and then only between lines or inside a line of a
+   message body (with resume_mid_line set).  A last frame that is
+   still being written counts towards tail. */
+int mbox_scan_compressed(int fd, int kind, off_t * offset,
+						 struct mbox_scan *st,
+						 /*@null@ */ struct mbox_scan *tail,
+						 mbox_scan_checkpoint checkpoint, void *data);
+
+#endif
@@ -0,0 +1,347 @@
+/* mboxIndex.c - where an mbox scan can resume.
+
+   A checkpoint is taken about every MBOX_INDEX_STRIDE bytes, and
+   where the last scan stopped.  Each one carries a hash of the
+   block before it: if that block is still in the same place, the
+   mailbox is assumed to be unchanged up to there.  That covers
+   mail being appended, and mail readers rewriting the file from
+   the first message they changed, which is usually near the end.
+
+   The index is saved as a small text file in
+   $XDG_CACHE_HOME/wmbiff (or ~/.cache/wmbiff), named after a hash
+   of the mailbox path. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "mboxIndex.h"
+#include "fileStamp.h"
+
+#ifdef USE_DMALLOC
+#include <dmalloc.h>
+#endif
+
+/* how much of the file before a checkpoint must be unchanged */
+#define MBOX_FINGERPRINT_LEN 512
+/* checkpoints are at least this far apart */
+#define MBOX_INDEX_STRIDE (1024 * 1024)
+#define MBOX_INDEX_MAGIC "wmbiff-mbox-index 1\n"
+
+static unsigned long fnv1a(unsigned long hash, const unsigned char *buf,
+						   size_t len)
+{
+	size_t i;
+	for (i = 0; i < len; i++) {
+		hash = ((hash ^ buf[i]) * 16777619UL) & 0xffffffffUL;
+	}
+	return hash;
+}
+
+unsigned long mbox_fingerprint(int fd, off_t offset)
+{
+	unsigned char buf[MBOX_FINGERPRINT_LEN];
+	off_t start =
+		(offset > MBOX_FINGERPRINT_LEN) ? offset - MBOX_FINGERPRINT_LEN : 0;
+	ssize_t len;
+
+	len = pread(fd, buf, (size_t) (offset - start), start);
+	return fnv1a(2166136261UL, buf, (len > 0) ? (size_t) len : 0);
+}
+
+char *cache_filename(const char *kind, const char *key, int create)
+{
+	const char *cache = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	char *name;
+	size_t len;
+
+	if (cache == NULL || cache[0] != '/') {
+		if (home == NULL)
+			return NULL;
+		cache = NULL;
+	}
+	len = strlen(cache != NULL ? cache : home) + strlen(kind) + 40;
+	name = malloc(len);
+	if (name == NULL)
+		return NULL;
+	if (cache != NULL)
+		strcpy(name, cache);
+	else
+		sprintf(name, "%s/.cache", home);
+	if (create)
+		(void) mkdir(name, 0700);
+	strcat(name, "/wmbiff");
+	if (create)
+		(void) mkdir(name, 0700);
+	sprintf(name + strlen(name), "/%s-%08lx", kind,
+			fnv1a(2166136261UL, (const unsigned char *) key,
+				  strlen(key)));
+	return name;
+}
+
+static int add_checkpoint(struct mbox_index *idx, int fd, off_t offset,
+						  const struct mbox_scan *st)
+{
+	struct mbox_checkpoint *cp;
+
+	if (idx->count == idx->alloc) {
+		int alloc = (idx->alloc > 0) ? idx->alloc * 2 : 16;
+		cp = realloc(idx->cp, alloc * sizeof(struct mbox_checkpoint));
+		if (cp == NULL)
+			return -1;
+		idx->cp = cp;
+		idx->alloc = alloc;
+	}
+	cp = &idx->cp[idx->count++];
+	cp->offset = offset;
+	cp->fingerprint = (fd >= 0) ? mbox_fingerprint(fd, offset) : 0;
+	cp->scan = *st;
+	return 0;
+}
+
+struct mbox_index *mbox_index_load(const char *path)
+{
+	struct mbox_index *idx = calloc(1, sizeof(struct mbox_index));
+	char *filename;
+	char line[1024];
+	FILE *f;
+	unsigned long long dev, ino;
+	long long size, mtime;
+	long mtime_nsec = 0;
+
+	if (idx == NULL)
+		return NULL;
+	idx->size = -1;
+	filename = cache_filename("mbox", path, 0);
+	if (filename == NULL)
+		return idx;
+	f = fopen(filename, "r");
+	free(filename);
+	if (f == NULL)
+		return idx;
+
+	/* magic, the mailbox it's for, and its status */
+	if (fgets(line, sizeof(line), f) == NULL
+		|| strcmp(line, MBOX_INDEX_MAGIC) != 0
+		|| fgets(line, sizeof(line), f) == NULL
+		|| strncmp(line, path, strlen(path)) != 0
+		|| strcmp(line + strlen(path), "\n") != 0
+		|| fgets(line, sizeof(line), f) == NULL
+		|| sscanf(line, "%llu %llu %lld %lld %ld", &dev, &ino, &size,
+				  &mtime, &mtime_nsec) < 4) {
+		fclose(f);
+		return idx;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		long long offset, content_length;
+		unsigned long fingerprint;
+		unsigned int flags;
+		struct mbox_scan st;
+
+		mbox_scan_init(&st);
+		if (sscanf(line, "%lld %lu %d %d %lld %u", &offset, &fingerprint,
+				   &st.count_from, &st.count_status, &content_length,
+				   &flags) != 6
+			|| (idx->count > 0
+				&& offset <= idx->cp[idx->count - 1].offset)) {
+			idx->count = 0;		/* damaged: don't trust any of it */
+			break;
+		}
+		st.content_length = (off_t) content_length;
+		st.is_header = (flags & 1) != 0;
+		st.next_from_is_start_of_header = (flags & 2) != 0;
+		st.pseudo_mail = (flags & 4) != 0;
+		st.use_content_length = (flags & 8) != 0;
+		st.resume_mid_line = (flags & 16) != 0;
+		if (add_checkpoint(idx, -1, (off_t) offset, &st) < 0)
+			break;
+		idx->cp[idx->count - 1].fingerprint = fingerprint;
+	}
+	fclose(f);
+	if (idx->count > 0) {
+		idx->dev = (dev_t) dev;
+		idx->ino = (ino_t) ino;
+		idx->size = (off_t) size;
+		idx->mtime = (time_t) mtime;
+		idx->mtime_nsec = mtime_nsec;
+	}
+	return idx;
+}
+
+int mbox_index_save(const struct mbox_index *idx, const char *path)
+{
+	char *filename, *tmpname;
+	FILE *f;
+	int fd, i;
+
+	if (strchr(path, '\n') != NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	filename = cache_filename("mbox", path, 1);
+	if (filename == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	tmpname = malloc(strlen(filename) + 8);
+	if (tmpname == NULL) {
+		free(filename);
+		return -1;
+	}
+	sprintf(tmpname, "%s.XXXXXX", filename);
+	if ((fd = mkstemp(tmpname)) < 0 || (f = fdopen(fd, "w")) == NULL) {
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmpname);
+		}
+		free(tmpname);
+		free(filename);
+		return -1;
+	}
+
+	fprintf(f, MBOX_INDEX_MAGIC "%s\n%llu %llu %lld %lld %ld\n", path,
+			(unsigned long long) idx->dev, (unsigned long long) idx->ino,
+			(long long) idx->size, (long long) idx->mtime,
+			idx->mtime_nsec);
+	for (i = 0; i < idx->count; i++) {
+		const struct mbox_checkpoint *cp = &idx->cp[i];
+		unsigned int flags = cp->scan.is_header
+			| cp->scan.next_from_is_start_of_header << 1
+			| cp->scan.pseudo_mail << 2
+			| cp->scan.use_content_length << 3
+			| cp->scan.resume_mid_line << 4;
+		fprintf(f, "%lld %lu %d %d %lld %u\n", (long long) cp->offset,
+				cp->fingerprint, cp->scan.count_from, cp->scan.count_status,
+				(long long) cp->scan.content_length, flags);
+	}
+
+	if (fclose(f) != 0 || rename(tmpname, filename) != 0) {
+		int saved = errno;
+		unlink(tmpname);
+		free(tmpname);
+		free(filename);
+		errno = saved;
+		return -1;
+	}
+	free(tmpname);
+	free(filename);
+	return 0;
+}
+
+void mbox_index_free(struct mbox_index *idx)
+{
+	free(idx->cp);
+	free(idx);
+}
+
+int mbox_index_resume(struct mbox_index *idx, int fd,
+					  const struct stat *sb, off_t * offset,
+					  struct mbox_scan *st)
+{
+	int i;
+
+	if (idx->count == 0)
+		return -1;
+	if (idx->cp[0].scan.use_content_length != st->use_content_length) {
+		/* counted differently: e.g. mbox::C: was just turned on */
+		i = -1;
+	} else if (sb->st_dev == idx->dev && sb->st_ino == idx->ino
+		&& sb->st_size == idx->size && sb->st_mtime == idx->mtime
+		&& MTIME_NSEC(sb) == idx->mtime_nsec) {
+		/* untouched since the last scan */
+		i = idx->count - 1;
+	} else if (sb->st_size == idx->size) {
+		/* rewritten without changing its size, perhaps just a
+		   Status: line; nothing to tell where, so start over */
+		i = -1;
+	} else {
+		for (i = idx->count - 1; i >= 0; i--) {
+			if (idx->cp[i].offset <= sb->st_size
+				&& mbox_fingerprint(fd, idx->cp[i].offset) ==
+				idx->cp[i].fingerprint)
+				break;
+		}
+	}
+
+	idx->count = i + 1;
+	if (i < 0)
+		return -1;
+	*offset = idx->cp[i].offset;
+	*st = idx->cp[i].scan;
+	return 0;
+}
+
+struct recorder {
+	struct mbox_index *idx;
+	int fd;
+};
+
+static void record(void *data, off_t offset, const struct mbox_scan *st)
+{
+	struct recorder *r = data;
+	off_t last =
+		(r->idx->count > 0) ? r->idx->cp[r->idx->count - 1].offset : 0;
+
+	if (offset - last >= MBOX_INDEX_STRIDE)
+		(void) add_checkpoint(r->idx, r->fd, offset, st);
+}
+
+int mbox_index_scan(struct mbox_index *idx, int fd, const struct stat *sb,
+					int compression, off_t * offset, struct mbox_scan *st,
+					struct mbox_scan *tail, struct thread_pool *pool)
+{
+	struct recorder r;
+	int ret;
+
+	/* anything past where this scan starts is out of date; so is
+	   where the last scan stopped, if it's about to be replaced
+	   by a new end that's not much further along */
+	while (idx->count > 0 && idx->cp[idx->count - 1].offset > *offset)
+		idx->count--;
+	if (idx->count > 0 && idx->cp[idx->count - 1].offset == *offset) {
+		off_t prev = (idx->count > 1) ? idx->cp[idx->count - 2].offset : 0;
+		if (*offset - prev < MBOX_INDEX_STRIDE)
+			idx->count--;
+	}
+
+	r.idx = idx;
+	r.fd = fd;
+	if (compression != MBOX_PLAIN)
+		ret = mbox_scan_compressed(fd, compression, offset, st, tail,
+								   record, &r);
+	else
+		ret = mbox_scan_fd_parallel(fd, offset, st, tail, pool, record,
+									&r);
+	if (ret < 0) {
+		idx->count = 0;
+		return ret;
+	}
+	if (*offset > 0 && (idx->count == 0
+						|| idx->cp[idx->count - 1].offset < *offset))
+		(void) add_checkpoint(idx, fd, *offset, st);
+	idx->dev = sb->st_dev;
+	idx->ino = sb->st_ino;
+	idx->size = sb->st_size;
+	idx->mtime = sb->st_mtime;
+	idx->mtime_nsec = MTIME_NSEC(sb);
+	return ret;
+}
+
+/* vim:set ts=4: */
+/*
+ * Local Variables:
+ * tab-width: 4
+ * c-indent-level: 4
+ * c-basic-offset: 4
+ * End:
+ */
@@ -0,0 +1,67 @@
+/* mboxIndex.h - checkpoints of an mbox scan: the offsets where a
+   scan could pick up again, and the counts of read and unread
+   messages before them.  Kept in memory between checks and in the
+   cache directory across restarts, so that only the part of a
+   mailbox that changed is scanned again. */
+
+#ifndef MBOXINDEX
+#define MBOXINDEX
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "mboxScan.h"
+#include "mboxCompressed.h"
+
+/* a line boundary, and the scan state there */
+struct mbox_checkpoint {
+	off_t offset;
+	unsigned long fingerprint;	/* of the block before offset */
+	struct mbox_scan scan;
+};
+
+struct mbox_index {
+	/* the file as it was when last scanned */
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	long mtime_nsec;			/* 0 where the system doesn't say */
+	/* in ascending order; the last is where that scan stopped */
+	struct mbox_checkpoint *cp;
+	int count;
+	int alloc;
+};
+
+/* $XDG_CACHE_HOME/wmbiff/<kind>-<hash of key>, or under
+   ~/.cache, creating the directories on the way if create is set */
+/*@null@ */ char *cache_filename(const char *kind, const char *key,
+								  int create);
+
+/* hash the block of the mailbox that ends at offset */
+unsigned long mbox_fingerprint(int fd, off_t offset);
+
+/* the index saved for path, or a new empty one */
+/*@null@ */ struct mbox_index *mbox_index_load(const char *path);
+/* returns -1 (with errno) if it couldn't be written */
+int mbox_index_save(const struct mbox_index *idx, const char *path);
+void mbox_index_free( /*@only@ */ struct mbox_index *idx);
+
+/* find the last checkpoint that is still valid for fd, whose
+   status is sb, and drop those after it.  returns 0 and sets
+   *offset and *st to resume from it, or -1 if the scan has to
+   start from the beginning.  st->use_content_length says how the
+   caller counts. */
+int mbox_index_resume(struct mbox_index *idx, int fd,
+					  const struct stat *sb, off_t * offset,
+					  struct mbox_scan *st);
+
+/* mbox_scan_fd_parallel, or mbox_scan_compressed if compression
+   isn't MBOX_PLAIN, recording checkpoints in idx as it goes; sb is
+   remembered as the status of the file. */
+int mbox_index_scan(struct mbox_index *idx, int fd, const struct stat *sb,
+					int compression, off_t * offset, struct mbox_scan *st,
+					/*@null@ */ struct mbox_scan *tail,
+					/*@null@ */ struct thread_pool *pool);
+
+#endif
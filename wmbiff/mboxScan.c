@@ -0,0 +1,570 @@
+/* mboxScan.c - counts the messages in an mbox.
+
+   This used to be a loop over fgets() in mboxClient.c; it now
+   works on whole buffers so that it can find line boundaries
+   with memchr() instead of copying every line, skip message
+   bodies by searching for the next blank line (32 bytes at a
+   time where SSE2 is available), and see a line longer than a
+   buffer as one line.  Mailboxes written with Content-Length:
+   headers (mboxcl, mboxcl2) can have their bodies skipped
+   without reading them at all. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "mboxScan.h"
+#include "threadPool.h"
+
+#ifdef USE_DMALLOC
+#include <dmalloc.h>
+#endif
+
+#define FROM_STR   "From "
+#define STATUS_STR "Status: "
+#define XIMAP_STR  "X-IMAP: "
+#define CONTENT_LENGTH_STR "Content-Length:"
+
+/* files are read in blocks of this size, at multiples of it */
+#define MBOX_BLOCK_SIZE (256 * 1024)
+/* after skipping a body, the next message is probably short: start
+   reading with this much again, doubling up to MBOX_BLOCK_SIZE. */
+#define MBOX_SKIP_READ_SIZE (8 * 1024)
+
+#ifndef min
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#define max(a,b) ((a) > (b) ? (a) : (b))
+#endif
+
+void mbox_scan_init(struct mbox_scan *st)
+{
+	memset(st, 0, sizeof(struct mbox_scan));
+	st->content_length = -1;
+	st->next_from_is_start_of_header = 1;
+}
+
+static __inline int
+starts_with(const char *line, size_t len, const char *prefix,
+			size_t prefixlen)
+{
+	return (len >= prefixlen && memcmp(line, prefix, prefixlen) == 0);
+}
+
+/* the value of a Content-Length: header line, or -1 if it has
+   none that makes sense */
+static off_t parse_content_length(const char *line, size_t len)
+{
+	size_t i = sizeof(CONTENT_LENGTH_STR) - 1;
+	off_t value = 0;
+
+	if (len < i || strncasecmp(line, CONTENT_LENGTH_STR, i) != 0)
+		return -1;
+	while (i < len && (line[i] == ' ' || line[i] == '\t'))
+		i++;
+	if (i == len || line[i] < '0' || line[i] > '9')
+		return -1;
+	for (; i < len && line[i] >= '0' && line[i] <= '9'; i++) {
+		if (value > ((off_t) 1 << 48))
+			return -1;			/* nonsense; don't overflow */
+		value = value * 10 + (line[i] - '0');
+	}
+	return value;
+}
+
+void mbox_scan_line(struct mbox_scan *st, const char *line, size_t len)
+{
+	if (len == 0)
+		return;
+	// The first message usually is automatically created by POP3/IMAP
+	// clients for internal record keeping and is ignored
+	// (not displayed) by most email clients.
+	if (st->is_header && starts_with(line, len, XIMAP_STR, 8)) {
+		st->pseudo_mail = 1;
+	}
+	if (line[0] == '\n') {
+		/* a newline by itself terminates the header */
+		if (st->is_header) {
+			st->is_header = 0;
+			if (st->use_content_length && st->content_length >= 0)
+				st->skip_body = 1;
+		} else
+			st->next_from_is_start_of_header = 1;
+	} else if (starts_with(line, len, FROM_STR, 5)) {
+		/* A line starting with "From" is the beginning of a new header.
+		   "From" in the text of the mail should get escaped by the MDA.
+		   If your MDA doesn't do that, it is broken.
+		 */
+		if (st->next_from_is_start_of_header) {
+			st->is_header = 1;
+			st->content_length = -1;
+		}
+		if (st->is_header)
+			st->count_from++;
+	} else {
+		st->next_from_is_start_of_header = 0;
+		if (st->is_header && starts_with(line, len, STATUS_STR, 8)
+			&& memchr(line, 'R', len) != NULL) {
+			st->count_status++;
+		} else if (st->is_header && st->use_content_length
+				   && (line[0] == 'C' || line[0] == 'c')) {
+			off_t value = parse_content_length(line, len);
+			if (value >= 0)
+				st->content_length = value;
+		}
+	}
+}
+
+/* like memrchr(buf, '\n', len), which isn't everywhere */
+static const char *last_newline(const char *buf, size_t len)
+{
+	const char *p;
+	for (p = buf + len; p > buf; p--) {
+		if (p[-1] == '\n')
+			return p - 1;
+	}
+	return NULL;
+}
+
+/* find the first "\n\n" in [p, end): the end of a line that is
+   followed by a blank one. */
+static const char *find_blank_line(const char *p, const char *end)
+{
+#ifdef __SSE2__
+	/* compare 32 bytes at a time against '\n', and against '\n'
+	   one byte later; where both match, there's a blank line. */
+	const __m128i nl = _mm_set1_epi8('\n');
+	while (end - p > 32) {
+		__m128i a = _mm_loadu_si128((const __m128i *) p);
+		__m128i b = _mm_loadu_si128((const __m128i *) (p + 1));
+		__m128i c = _mm_loadu_si128((const __m128i *) (p + 16));
+		__m128i d = _mm_loadu_si128((const __m128i *) (p + 17));
+		unsigned int mask =
+			_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, nl),
+											_mm_cmpeq_epi8(b, nl)));
+		mask |= (unsigned int)
+			_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(c, nl),
+											_mm_cmpeq_epi8(d, nl))) << 16;
+		if (mask != 0)
+			return p + __builtin_ctz(mask);
+		p += 32;
+	}
+#endif
+	while ((p = memchr(p, '\n', end - p)) != NULL && p + 1 < end) {
+		if (p[1] == '\n')
+			return p;
+		p++;
+	}
+	return NULL;
+}
+
+size_t mbox_scan_lines(struct mbox_scan *st, const char *buf, size_t len)
+{
+	const char *p = buf;
+	const char *end = buf + len;
+	const char *nl;
+
+	while (p < end) {
+		if (!st->is_header && !st->next_from_is_start_of_header
+			&& *p != '\n') {
+			/* in a message body, nothing but a blank line can
+			   change the state, so skip straight to the next one. */
+			const char *blank = find_blank_line(p, end);
+			if (blank == NULL) {
+				nl = last_newline(p, end - p);
+				return ((nl != NULL) ? nl + 1 : p) - buf;
+			}
+			p = blank + 1;
+		}
+		nl = memchr(p, '\n', end - p);
+		if (nl == NULL)
+			break;
+		mbox_scan_line(st, p, nl + 1 - p);
+		p = nl + 1;
+		if (st->skip_body)
+			break;
+	}
+	return p - buf;
+}
+
+/* the header that ends at pos said its body is st->content_length
+   bytes long.  if that leads to the end of the file or to a "From "
+   line (either possibly after the blank line that separates messages),
+   move pos there, dropping what's buffered before it; otherwise
+   the header lied, and the body is scanned line by line as usual.
+   buf holds *have bytes from pos.  returns whether it skipped. */
+static int
+skip_body(int fd, off_t size, struct mbox_scan *st, char *buf,
+		  off_t * pos, size_t * have)
+{
+	off_t landing = *pos + st->content_length;
+	char peek[6];
+	ssize_t n;
+
+	st->skip_body = 0;
+	if (landing > size)
+		return 0;
+	if (landing + (off_t) sizeof(peek) <= *pos + (off_t) * have) {
+		memcpy(peek, buf + (landing - *pos), sizeof(peek));
+		n = sizeof(peek);
+	} else {
+		n = pread(fd, peek, sizeof(peek), landing);
+		if (n < 0)
+			return 0;
+	}
+	if (!(landing == size
+		  || (landing + 1 == size && n == 1 && peek[0] == '\n')
+		  || (n >= 5 && memcmp(peek, FROM_STR, 5) == 0)
+		  || (n >= 6 && peek[0] == '\n'
+			  && memcmp(peek + 1, FROM_STR, 5) == 0)))
+		return 0;
+
+	/* as if the body had been scanned: whatever follows it may
+	   start a message */
+	st->next_from_is_start_of_header = 1;
+	if (landing < *pos + (off_t) * have) {
+		size_t skipped = (size_t) (landing - *pos);
+		*have -= skipped;
+		memmove(buf, buf + skipped, *have);
+	} else {
+		*have = 0;
+	}
+	*pos = landing;
+	return 1;
+}
+
+/* scan [*offset, end) of fd, or to the end of the file if end is
+   -1; see mbox_scan_fd_checkpoints. */
+static int
+scan_range(int fd, off_t * offset, off_t end, struct mbox_scan *st,
+		   struct mbox_scan *tail, mbox_scan_checkpoint checkpoint,
+		   void *data)
+{
+	size_t bufsize = 2 * MBOX_BLOCK_SIZE;
+	char *buf = malloc(bufsize);
+	size_t have = 0;			/* bytes of an unfinished line in buf */
+	off_t pos = *offset;		/* file offset of buf[0] */
+	off_t size = -1;
+	size_t readsize = MBOX_BLOCK_SIZE;	/* how much to read next */
+	int ret = 0;
+
+	if (buf == NULL)
+		return -1;
+	if (st->use_content_length) {
+		struct stat s;
+		if (fstat(fd, &s) == 0 && S_ISREG(s.st_mode))
+			size = s.st_size;
+		else
+			st->use_content_length = 0;	/* can't seek in a pipe */
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	if (!st->use_content_length)
+		(void) posix_fadvise(fd, pos, (end >= 0) ? end - pos : 0,
+							 POSIX_FADV_SEQUENTIAL);
+#endif
+
+	for (;;) {
+		size_t want;
+		ssize_t n;
+
+		if (st->skip_body) {
+			if (skip_body(fd, size, st, buf, &pos, &have) && have == 0)
+				readsize = MBOX_SKIP_READ_SIZE;
+			/* what's left in buf may hold more messages */
+			if (have > 0) {
+				size_t used = mbox_scan_lines(st, buf, have);
+				pos += used;
+				have -= used;
+				memmove(buf, buf + used, have);
+				continue;
+			}
+		}
+		want = readsize - (size_t) ((pos + have) % readsize);
+		if (readsize < MBOX_BLOCK_SIZE)
+			readsize *= 2;
+		if (end >= 0 && (off_t) want > end - (pos + (off_t) have))
+			want = (size_t) (end - (pos + (off_t) have));
+		if (want == 0)
+			break;
+
+		if (have + want > bufsize) {
+			/* a very long line: make room for it */
+			char *bigger = realloc(buf, bufsize * 2);
+			if (bigger == NULL) {
+				ret = -1;
+				break;
+			}
+			buf = bigger;
+			bufsize *= 2;
+		}
+		n = pread(fd, buf + have, want, pos + have);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -1;
+			break;
+		}
+		if (n == 0)
+			break;
+		if (memchr(buf + have, '\n', (size_t) n) != NULL) {
+			size_t used = mbox_scan_lines(st, buf, have + n);
+			pos += used;
+			have += n - used;
+			memmove(buf, buf + used, have);
+			if (checkpoint != NULL && !st->skip_body)
+				checkpoint(data, pos, st);
+		} else {
+			have += n;
+		}
+	}
+
+	*offset = pos;
+	if (tail != NULL) {
+		*tail = *st;
+		if (have > 0 && ret == 0)
+			mbox_scan_line(tail, buf, have);
+	}
+	free(buf);
+	return ret;
+}
+
+int mbox_scan_fd(int fd, off_t * offset, struct mbox_scan *st,
+				 struct mbox_scan *tail)
+{
+	return scan_range(fd, offset, -1, st, tail, NULL, NULL);
+}
+
+int mbox_scan_fd_checkpoints(int fd, off_t * offset, struct mbox_scan *st,
+							 struct mbox_scan *tail,
+							 mbox_scan_checkpoint checkpoint, void *data)
+{
+	return scan_range(fd, offset, -1, st, tail, checkpoint, data);
+}
+
+/* the parallel scan.  The state of the scanner at the start of a
+   chunk is only known once the chunks before it are done, but
+   apart from the counts it is just two bits, and at the start of
+   a line in a message body, where most chunks start, both are
+   clear.  So each chunk is scanned from that state, and also, a
+   line at a time through its first block, from each of the other
+   three until they agree with it, which is usually by the end of
+   the first message.  Putting the chunks together in order then
+   only needs arithmetic, unless a chunk started in a state that
+   never caught up; that one is scanned again. */
+
+/* which of the four starting states */
+#define STATE_BITS(st) \
+	((st)->is_header << 1 | (st)->next_from_is_start_of_header)
+
+struct chunk {
+	off_t start, end;
+	off_t done;					/* where the scan of it stopped */
+	struct mbox_scan from_body;	/* counts from the in-a-body state */
+	/* from each other state, the counts of it and of from_body at
+	   the first line where the two agreed */
+	struct {
+		int agreed;
+		struct mbox_scan self, body;
+	} alt[4];
+	int error;
+};
+
+struct parallel_scan {
+	int fd;
+	struct chunk *chunks;
+};
+
+off_t mbox_parallel_chunk = 8 * 1024 * 1024;
+
+static void start_state(struct mbox_scan *st, int bits)
+{
+	mbox_scan_init(st);
+	st->is_header = (bits & 2) != 0;
+	st->next_from_is_start_of_header = (bits & 1) != 0;
+}
+
+static void scan_chunk(void *data, int i)
+{
+	struct parallel_scan *ps = data;
+	struct chunk *c = &ps->chunks[i];
+	size_t len = (size_t) min(c->end - c->start, (off_t) MBOX_BLOCK_SIZE);
+	char *buf;
+	const char *nl;
+	ssize_t n;
+	int k;
+
+	start_state(&c->from_body, 0);
+	c->done = c->start;
+	for (k = 1; k < 4; k++)
+		c->alt[k].agreed = 0;
+	if (c->start >= c->end)
+		return;
+
+	/* the other starting states, through the first block */
+	buf = malloc(len);
+	if (buf == NULL) {
+		c->error = 1;
+		return;
+	}
+	n = pread(ps->fd, buf, len, c->start);
+	nl = (n > 0) ? last_newline(buf, (size_t) n) : NULL;
+	for (k = 1; k < 4 && nl != NULL; k++) {
+		struct mbox_scan self, body;
+		const char *p = buf, *eol;
+
+		start_state(&self, k);
+		start_state(&body, 0);
+		do {
+			eol = memchr(p, '\n', nl + 1 - p);
+			mbox_scan_line(&self, p, eol + 1 - p);
+			mbox_scan_line(&body, p, eol + 1 - p);
+			p = eol + 1;
+		} while (STATE_BITS(&self) != STATE_BITS(&body) && eol < nl);
+		if (STATE_BITS(&self) == STATE_BITS(&body)) {
+			c->alt[k].agreed = 1;
+			c->alt[k].self = self;
+			c->alt[k].body = body;
+		}
+	}
+	free(buf);
+
+	if (scan_range(ps->fd, &c->done, c->end, &c->from_body, NULL, NULL,
+				   NULL) < 0)
+		c->error = 1;
+}
+
+/* the first line boundary at or after pos, or limit if there
+   isn't one before it */
+static off_t line_start(int fd, off_t pos, off_t limit)
+{
+	char buf[4096];
+	ssize_t n;
+
+	for (pos--; pos < limit; pos += n) {
+		const char *nl;
+		n = pread(fd, buf, (size_t) min(limit - pos, (off_t) sizeof(buf)),
+				  pos);
+		if (n <= 0)
+			break;
+		if ((nl = memchr(buf, '\n', (size_t) n)) != NULL)
+			return pos + (nl - buf) + 1;
+	}
+	return limit;
+}
+
+int mbox_scan_fd_parallel(int fd, off_t * offset, struct mbox_scan *st,
+						  struct mbox_scan *tail, struct thread_pool *pool,
+						  mbox_scan_checkpoint checkpoint, void *data)
+{
+	struct parallel_scan ps;
+	struct stat sb;
+	off_t span, step;
+	int nchunks, i;
+
+	if (pool == NULL || st->use_content_length || st->skip_body
+		|| fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode)
+		|| sb.st_size - *offset < 2 * mbox_parallel_chunk)
+		return scan_range(fd, offset, -1, st, tail, checkpoint, data);
+
+	/* a couple of chunks per thread, so that one that turns out
+	   to be slow doesn't hold the rest up */
+	span = sb.st_size - *offset;
+	nchunks = 2 * thread_pool_size(pool);
+	if (span / nchunks < mbox_parallel_chunk)
+		nchunks = (int) (span / mbox_parallel_chunk);
+	step = span / nchunks;
+
+	ps.fd = fd;
+	ps.chunks = calloc(nchunks, sizeof(struct chunk));
+	if (ps.chunks == NULL)
+		return scan_range(fd, offset, -1, st, tail, checkpoint, data);
+	ps.chunks[0].start = *offset;
+	for (i = 1; i < nchunks; i++) {
+		off_t start = line_start(fd, *offset + i * step, sb.st_size);
+		ps.chunks[i].start = max(start, ps.chunks[i - 1].start);
+		ps.chunks[i - 1].end = ps.chunks[i].start;
+	}
+	ps.chunks[nchunks - 1].end = sb.st_size;
+
+	thread_pool_run(pool, nchunks, scan_chunk, &ps);
+
+	for (i = 0; i < nchunks; i++) {
+		struct chunk *c = &ps.chunks[i];
+		int k = STATE_BITS(st);
+
+		if (c->error) {
+			free(ps.chunks);
+			return -1;
+		}
+		if (c->start >= c->end)
+			continue;
+		if (i > 0 && checkpoint != NULL)
+			checkpoint(data, c->start, st);
+		if (k == 0 || c->alt[k].agreed) {
+			const struct mbox_scan *r = &c->from_body;
+			if (k != 0) {
+				/* the lines before the two states agreed were
+				   counted from the wrong one */
+				const struct mbox_scan *self = &c->alt[k].self;
+				const struct mbox_scan *body = &c->alt[k].body;
+				st->count_from += self->count_from - body->count_from;
+				st->count_status += self->count_status - body->count_status;
+				st->pseudo_mail |= self->pseudo_mail
+					|| (r->pseudo_mail && !body->pseudo_mail);
+			} else {
+				st->pseudo_mail |= r->pseudo_mail;
+			}
+			st->count_from += r->count_from;
+			st->count_status += r->count_status;
+			st->is_header = r->is_header;
+			st->next_from_is_start_of_header =
+				r->next_from_is_start_of_header;
+			*offset = c->done;
+		} else {
+			*offset = c->start;
+			if (scan_range(fd, offset, c->end, st, NULL, NULL, NULL) < 0) {
+				free(ps.chunks);
+				return -1;
+			}
+		}
+	}
+	free(ps.chunks);
+
+	/* a last line without its newline, and anything that was
+	   appended meanwhile */
+	return scan_range(fd, offset, -1, st, tail, checkpoint, data);
+}
+
+int mbox_scan_total(const struct mbox_scan *st)
+{
+	if (st->count_from && st->pseudo_mail)
+		return st->count_from - 1;
+	return st->count_from;
+}
+
+int mbox_scan_unread(const struct mbox_scan *st)
+{
+	int count_status = st->count_status;
+	if (st->count_from && st->pseudo_mail && count_status)
+		count_status--;
+	return mbox_scan_total(st) - count_status;
+}
+
+/* vim:set ts=4: */
+/*
+ * Local Variables:
+ * tab-width: 4
+ * c-indent-level: 4
+ * c-basic-offset: 4
+ * End:
+ */
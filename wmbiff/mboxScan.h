@@ -0,0 +1,73 @@
+/* mboxScan.h - the state machine that counts messages in an
+   mbox, kept apart from the mailbox handling so that it can be
+   fed from any buffer. */
+
+#ifndef MBOXSCAN
+#define MBOXSCAN
+
+#include <sys/types.h>
+
+/* everything the scanner knows at the start of a line */
+struct mbox_scan {
+	int count_from;				/* "From " lines that started a header */
+	int count_status;			/* "Status: " lines with an R */
+	off_t content_length;		/* of the current message, or -1 */
+	unsigned int is_header:1;
+	unsigned int next_from_is_start_of_header:1;
+	unsigned int pseudo_mail:1;	/* saw an X-IMAP: pseudo message */
+	/* set by the caller for mboxcl/mboxcl2 files: at the end of a
+	   header with a Content-Length:, stop and set skip_body, so
+	   that mbox_scan_fd can seek past the body. */
+	unsigned int use_content_length:1;
+	unsigned int skip_body:1;
+	/* a compressed mbox's checkpoint inside a body line (see
+	   mboxCompressed.h): the rest of that line is to be dropped */
+	unsigned int resume_mid_line:1;
+};
+
+void mbox_scan_init( /*@out@ */ struct mbox_scan *st);
+
+/* feed one line, including its newline if it has one */
+void mbox_scan_line(struct mbox_scan *st, const char *line, size_t len);
+
+/* feed the complete lines at the start of buf; returns the number
+   of bytes consumed, which ends just after the last newline, or
+   after the header if it set skip_body. */
+size_t mbox_scan_lines(struct mbox_scan *st, const char *buf, size_t len);
+
+/* scan fd from *offset to the end of the file, reading in large
+   blocks and, with use_content_length, skipping message bodies
+   whose Content-Length leads to the next "From " line.  st and
+   *offset are advanced past the last complete line; if tail is
+   not null, it receives the counts including a last line that is
+   still missing its newline.  returns -1 on a read error, 0
+   otherwise. */
+int mbox_scan_fd(int fd, off_t * offset, struct mbox_scan *st,
+				 /*@null@ */ struct mbox_scan *tail);
+
+/* the same, calling checkpoint with the offset and state at a line
+   boundary after each block, for the caller to keep where it could
+   resume from (see mboxIndex.h) */
+typedef void (*mbox_scan_checkpoint) (void *data, off_t offset,
+									  const struct mbox_scan * st);
+int mbox_scan_fd_checkpoints(int fd, off_t * offset, struct mbox_scan *st,
+							 /*@null@ */ struct mbox_scan *tail,
+							 mbox_scan_checkpoint checkpoint, void *data);
+
+/* the same again, but a big regular file is split into chunks of
+   at least mbox_parallel_chunk bytes that pool's threads scan at
+   the same time; checkpoints are then at chunk boundaries.  Falls
+   back to scanning in one go for small files, pipes, a null pool,
+   or use_content_length. */
+struct thread_pool;
+extern off_t mbox_parallel_chunk;
+int mbox_scan_fd_parallel(int fd, off_t * offset, struct mbox_scan *st,
+						  /*@null@ */ struct mbox_scan *tail,
+						  /*@null@ */ struct thread_pool *pool,
+						  mbox_scan_checkpoint checkpoint, void *data);
+
+/* the counts as a mail reader would show them */
+int mbox_scan_total(const struct mbox_scan *st);
+int mbox_scan_unread(const struct mbox_scan *st);
+
+#endif
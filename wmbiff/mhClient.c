@@ -0,0 +1,240 @@
+/*
+ * MH folder checker.
+ *
+ * A folder holds one file per message, named by its number, and a
+ * .mh_sequences file with lines like "unseen: 3-7 12".  The folder
+ * is listed only when its directory changed, and the sequences are
+ * read only when that file changed; otherwise a check is two
+ * stamps (fileStamp.h).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "Client.h"
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <unistd.h>
+#include "fileWatch.h"
+#ifdef USE_DMALLOC
+#include <dmalloc.h>
+#endif
+
+#define PCM	(pc->u).mh
+
+static int int_cmp(const void *a, const void *b)
+{
+	int x = *(const int *) a, y = *(const int *) b;
+	return (x > y) - (x < y);
+}
+
+/* the numbers of the messages in the folder, in ascending order */
+static int list_msgs(Pop3 pc, const char *folder)
+{
+	DIR *D = opendir(folder);
+	struct dirent *de;
+	int n = 0;
+
+	if (D == NULL) {
+		DM(pc, DEBUG_ERROR, "Error opening directory '%s': %s\n",
+		   folder, strerror(errno));
+		return -1;
+	}
+	while ((de = readdir(D)) != NULL) {
+		const char *p = de->d_name;
+		if (!isdigit((unsigned char) *p))
+			continue;
+		while (isdigit((unsigned char) *p))
+			p++;
+		if (*p != '\0')			/* e.g., ,12 or 12~ */
+			continue;
+		if (n == PCM.alloc) {
+			int *more = realloc(PCM.msgs, (n + 256) * 2 * sizeof(int));
+			if (more == NULL)
+				break;
+			PCM.msgs = more;
+			PCM.alloc = (n + 256) * 2;
+		}
+		PCM.msgs[n++] = atoi(de->d_name);
+	}
+	closedir(D);
+	qsort(PCM.msgs, n, sizeof(int), int_cmp);
+	PCM.nmsgs = n;
+	return n;
+}
+
+/* how many of the messages there are numbered from lo to hi */
+static int msgs_between(Pop3 pc, int lo, int hi)
+{
+	int a = 0, b = PCM.nmsgs, first;
+	/* the first number >= lo */
+	while (a < b) {
+		int m = (a + b) / 2;
+		if (PCM.msgs[m] < lo)
+			a = m + 1;
+		else
+			b = m;
+	}
+	first = a;
+	b = PCM.nmsgs;
+	/* the first number > hi */
+	while (a < b) {
+		int m = (a + b) / 2;
+		if (PCM.msgs[m] <= hi)
+			a = m + 1;
+		else
+			b = m;
+	}
+	return a - first;
+}
+
+/* count the messages that exist in a sequence, given as the rest
+   of its line: numbers and ranges separated by spaces */
+static int count_sequence(Pop3 pc, const char *s)
+{
+	int count = 0;
+	while (*s != '\0') {
+		char *end;
+		long lo, hi;
+		while (*s != '\0' && !isdigit((unsigned char) *s))
+			s++;
+		if (*s == '\0')
+			break;
+		lo = hi = strtol(s, &end, 10);
+		s = end;
+		if (*s == '-' && isdigit((unsigned char) s[1])) {
+			hi = strtol(s + 1, &end, 10);
+			s = end;
+		}
+		if (hi >= lo)
+			count += msgs_between(pc, (int) lo, (int) hi);
+	}
+	return count;
+}
+
+/* the messages in the "unseen" sequence; a missing sequences file
+   means nothing is unseen */
+static int count_unseen(Pop3 pc, const char *sequences)
+{
+	FILE *F = fopen(sequences, "r");
+	char *line = NULL;
+	size_t size = 0;
+	int unseen = 0, in_unseen = 0;
+
+	if (F == NULL)
+		return (errno == ENOENT) ? 0 : -1;
+	/* a sequence can be any length, so read whole lines */
+	while (getline(&line, &size, F) != -1) {
+		/* long sequences continue on indented lines */
+		if (line[0] == ' ' || line[0] == '\t') {
+			if (in_unseen)
+				unseen += count_sequence(pc, line);
+			continue;
+		}
+		in_unseen = !strncmp(line, "unseen:", 7);
+		if (in_unseen)
+			unseen += count_sequence(pc, line + 7);
+	}
+	free(line);
+	fclose(F);
+	return unseen;
+}
+
+int mhCheckHistory(Pop3 pc)
+{
+	char sequences[BUF_BIG + 16];
+	struct file_stamp st_dir, st_seq;
+	int changed = 0;
+
+	DM(pc, DEBUG_INFO, ">MH: '%s'\n", pc->path);
+
+	if (!pc->watched)
+		filewatch_retry(pc);
+
+	if (file_stamp(pc->path, &st_dir) != 0) {
+		DM(pc, DEBUG_ERROR, "Can't stat mailbox '%s': %s\n",
+		   pc->path, strerror(errno));
+		goto fail;
+	}
+	sprintf(sequences, "%s/.mh_sequences", pc->path);
+	if (file_stamp(sequences, &st_seq) != 0)
+		memset(&st_seq, 0, sizeof(st_seq));
+
+	/* (the stamp starts out zeroed, so the first check lists it,
+	   even if it turns out to be empty) */
+	if (file_stamp_changed(&PCM.stamp, &st_dir)) {
+		if (list_msgs(pc, pc->path) < 0)
+			goto fail;
+		PCM.stamp = st_dir;
+		changed = 1;
+	}
+	if (changed || file_stamp_changed(&PCM.stamp_seq, &st_seq)) {
+		int unseen = count_unseen(pc, sequences);
+		if (unseen < 0) {
+			DM(pc, DEBUG_ERROR, "Can't read '%s': %s\n", sequences,
+			   strerror(errno));
+			goto fail;
+		}
+		PCM.unseen = unseen;
+		PCM.stamp_seq = st_seq;
+		DM(pc, DEBUG_INFO, "  %d messages, %d unseen\n", PCM.nmsgs,
+		   PCM.unseen);
+	}
+
+	pc->TotalMsgs = PCM.nmsgs;
+	pc->UnreadMsgs = PCM.unseen;
+	return 0;
+
+  fail:
+	/* rather than go on showing the last counts */
+	pc->TotalMsgs = -1;
+	pc->UnreadMsgs = -1;
+	return -1;
+}
+
+int mhCreate(Pop3 pc, const char *str)
+{
+	/* MH format: mh:fullpathname */
+
+	pc->TotalMsgs = 0;
+	pc->UnreadMsgs = 0;
+	pc->OldMsgs = -1;
+	pc->OldUnreadMsgs = -1;
+	pc->checkMail = mhCheckHistory;
+	PCM.msgs = NULL;
+	PCM.nmsgs = 0;
+	PCM.alloc = 0;
+	memset(&PCM.stamp, 0, sizeof(PCM.stamp));
+	memset(&PCM.stamp_seq, 0, sizeof(PCM.stamp_seq));
+
+	if (strlen(str + 3) + 1 > BUF_BIG) {
+		DM(pc, DEBUG_ERROR, "mh '%s' is too long.\n", str + 3);
+		memset(pc->path, 0, BUF_BIG);
+	} else {
+		strncpy(pc->path, str + 3, BUF_BIG - 1);	/* cut off ``mh:'' */
+	}
+
+	DM(pc, DEBUG_INFO, "mh: str = '%s'\n", str);
+	DM(pc, DEBUG_INFO, "mh: path= '%s'\n", pc->path);
+
+	/* messages coming and going, and .mh_sequences being written
+	   or replaced, are all events in the folder */
+	if (pc->path[0] != '\0')
+		(void) filewatch_add(pc, pc->path, FILEWATCH_CHANGED |
+							 FILEWATCH_ADDED | FILEWATCH_REMOVED, NULL);
+
+	return 0;
+}
+
+/* vim:set ts=4: */
+/*
+ * Local Variables:
+ * tab-width: 4
+ * c-indent-level: 4
+ * c-basic-offset: 4
+ * End:
+ */
@@ -30,6 +30,12 @@
 #include <string.h>
 #include <netdb.h>
 #include <stdio.h>
+#include <sys/select.h>
+#include <stdlib.h>
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+#include <pthread.h>
+#define USE_THREADS
+#endif
 #include "regulo.h"
 
 #ifdef USE_DMALLOC
@@ -43,11 +49,17 @@ extern int Relax;
 static int sanity_check_hostname(const char *hostname)
 {
 	struct in_addr dummy;
+#ifdef HAVE_GETADDRINFO
+	struct in6_addr dummy6;
+	if (inet_pton(AF_INET6, hostname, &dummy6) == 1)
+		return 1;
+#endif
 	return (Relax
 			|| regulo_match("^[A-Za-z][-_A-Za-z0-9.]+$", hostname, NULL)
 			|| inet_aton(hostname, &dummy));
 }
 
+#ifndef HAVE_GETADDRINFO
 static int ipv4_sock_connect(struct in_addr *address, short port)
 {
 	struct sockaddr_in addr;
@@ -75,6 +87,327 @@ static int ipv4_sock_connect(struct in_addr *address, short port)
 	};
 	return (fd);
 }
+#endif
+
+/* how long a connect may take, in seconds ("connecttimeout"),
+   instead of the kernel's two or three minutes of SYN retries */
+int connect_timeout = 10;
+
+#ifdef HAVE_GETADDRINFO
+/* rfc 8305: if an attempt hasn't finished after this long, the
+   next address is tried alongside it */
+#define CONNECTION_ATTEMPT_DELAY 250	/* ms */
+#define MAX_ATTEMPTS 16
+
+static long now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* the addresses in the order to try them: alternating between
+   families, starting with the one the resolver put first */
+static int interleave(struct addrinfo *res0, struct addrinfo **order)
+{
+	struct addrinfo *same[MAX_ATTEMPTS], *other[MAX_ATTEMPTS], *res;
+	int ns = 0, no = 0, i = 0, j = 0, n = 0;
+
+	for (res = res0; res != NULL; res = res->ai_next) {
+		if (res->ai_family == res0->ai_family) {
+			if (ns < MAX_ATTEMPTS)
+				same[ns++] = res;
+		} else if (no < MAX_ATTEMPTS) {
+			other[no++] = res;
+		}
+	}
+	while ((i < ns || j < no) && n < MAX_ATTEMPTS) {
+		if (i < ns)
+			order[n++] = same[i++];
+		if (j < no && n < MAX_ATTEMPTS)
+			order[n++] = other[j++];
+	}
+	return n;
+}
+
+/* start a non-blocking connect to ai; returns the socket, with
+   *done set if it's connected already, or -1 (with errno) */
+static int start_connect(const struct addrinfo *ai, int *done)
+{
+	int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (fd < 0)
+		return -1;
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+		perror("fcntl(FD_CLOEXEC)");
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+		close(fd);
+		return -1;
+	}
+	*done = (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0);
+	if (!*done && errno != EINPROGRESS) {
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		return -1;
+	}
+	return fd;
+}
+
+/* Happy Eyeballs (rfc 8305): try the addresses in order, starting
+   the next whenever the last has had CONNECTION_ATTEMPT_DELAY
+   without an answer, or failed, and keep the first to connect;
+   all within connect_timeout.  the socket is returned blocking
+   again, or -1 with errno set (ETIMEDOUT at the deadline). */
+static int race_connect(struct addrinfo **order, int n)
+{
+	int fds[MAX_ATTEMPTS];
+	int nfds = 0, next = 0, winner = -1, i;
+	int saved_errno = ETIMEDOUT;
+	long deadline = now_ms() + 1000L * connect_timeout;
+	long next_start = 0;
+
+	while (winner < 0) {
+		long now = now_ms(), wait;
+		struct timeval tv;
+		fd_set wfds;
+		int max_fd = -1;
+
+		if (now >= deadline) {
+			saved_errno = ETIMEDOUT;
+			break;
+		}
+		if (next < n && (nfds == 0 || now >= next_start)) {
+			int done;
+			int fd = start_connect(order[next++], &done);
+			if (fd < 0) {
+				saved_errno = errno;
+				continue;
+			}
+			if (done) {
+				winner = fd;
+				break;
+			}
+			fds[nfds++] = fd;
+			next_start = now + CONNECTION_ATTEMPT_DELAY;
+		}
+		if (nfds == 0)
+			break;				/* every address failed */
+
+		wait = ((next < n && next_start < deadline) ? next_start
+				: deadline) - now;
+		if (wait < 0)
+			wait = 0;
+		tv.tv_sec = wait / 1000;
+		tv.tv_usec = (wait % 1000) * 1000;
+		FD_ZERO(&wfds);
+		for (i = 0; i < nfds; i++) {
+			FD_SET(fds[i], &wfds);
+			if (fds[i] > max_fd)
+				max_fd = fds[i];
+		}
+		if (select(max_fd + 1, NULL, &wfds, NULL, &tv) <= 0)
+			continue;
+		for (i = 0; i < nfds && winner < 0;) {
+			int err = 0;
+			socklen_t len = sizeof(err);
+			if (!FD_ISSET(fds[i], &wfds)) {
+				i++;
+				continue;
+			}
+			if (getsockopt(fds[i], SOL_SOCKET, SO_ERROR, &err, &len) == 0
+				&& err == 0) {
+				winner = fds[i];
+				fds[i] = fds[--nfds];
+				break;
+			}
+			/* refused or unreachable: on to the next at once */
+			saved_errno = (err != 0) ? err : errno;
+			close(fds[i]);
+			fds[i] = fds[--nfds];
+			next_start = now;
+		}
+	}
+
+	for (i = 0; i < nfds; i++)
+		close(fds[i]);
+	if (winner < 0) {
+		errno = saved_errno;
+		return -1;
+	}
+	(void) fcntl(winner, F_SETFL, fcntl(winner, F_GETFL) & ~O_NONBLOCK);
+	return winner;
+}
+#endif
+
+#ifdef HAVE_GETADDRINFO
+/* the resolver cache.  getaddrinfo() doesn't say what the TTL
+   was, so addresses are kept for DNS_TTL, and a failed lookup
+   for DNS_NEGATIVE_TTL.  when they're out of date, a thread
+   looks them up again while the old ones go on being used, so
+   a slow or broken resolver only holds up the first lookup of a
+   name.  entries are only added to, and used by, the main
+   thread; the lock is for what a lookup thread hands back. */
+#define DNS_TTL (5 * 60)
+#define DNS_NEGATIVE_TTL 30
+
+static struct dns_entry {
+	struct dns_entry *next;
+	char *host;
+	char port[NI_MAXSERV];
+	/*@null@ */ struct addrinfo *res;	/* the last good addresses */
+	int error;					/* of the last lookup, or 0 */
+	time_t expires;
+	int looking_up;				/* a thread is at it */
+	int literal;				/* an IP address: nothing to look up */
+	/* from the thread, for the main thread to take */
+	/*@null@ */ struct addrinfo *fresh;
+	int fresh_error;
+	int fresh_ready;
+} *dns_cache;
+
+#ifdef USE_THREADS
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dns_done = PTHREAD_COND_INITIALIZER;
+#endif
+
+static void dns_lookup(struct dns_entry *e)
+{
+	struct addrinfo hints, *res = NULL;
+	int error;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	error = getaddrinfo(e->host, e->port, &hints, &res);
+#ifdef USE_THREADS
+	pthread_mutex_lock(&dns_lock);
+#endif
+	e->fresh = error ? NULL : res;
+	e->fresh_error = error;
+	e->fresh_ready = 1;
+#ifdef USE_THREADS
+	pthread_cond_broadcast(&dns_done);
+	pthread_mutex_unlock(&dns_lock);
+#endif
+}
+
+#ifdef USE_THREADS
+static void *dns_thread(void *arg)
+{
+	dns_lookup(arg);
+	return NULL;
+}
+#endif
+
+/* take what the last lookup found, if it's done */
+static void dns_collect(struct dns_entry *e)
+{
+#ifdef USE_THREADS
+	pthread_mutex_lock(&dns_lock);
+#endif
+	if (e->fresh_ready) {
+		e->fresh_ready = 0;
+		e->looking_up = 0;
+		e->error = e->fresh_error;
+		if (e->fresh != NULL) {
+			if (e->res != NULL)
+				freeaddrinfo(e->res);
+			e->res = e->fresh;
+			e->fresh = NULL;
+		}
+		e->expires = time(0) + (e->error ? DNS_NEGATIVE_TTL : DNS_TTL);
+	}
+#ifdef USE_THREADS
+	pthread_mutex_unlock(&dns_lock);
+#endif
+}
+
+/* look e up again, in a thread if possible */
+static void dns_refresh(struct dns_entry *e)
+{
+#ifdef USE_THREADS
+	pthread_t t;
+	pthread_attr_t attr;
+	int started;
+
+	e->looking_up = 1;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	started = (pthread_create(&t, &attr, dns_thread, e) == 0);
+	pthread_attr_destroy(&attr);
+	if (started)
+		return;
+#else
+	e->looking_up = 1;
+#endif
+	dns_lookup(e);
+	dns_collect(e);
+}
+
+/* we were given an IP address, no need to start a thread to
+   look it up, or ever to look it up again */
+static void dns_literal(struct dns_entry *e)
+{
+	struct addrinfo hints;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST;
+	if (getaddrinfo(e->host, e->port, &hints, &e->res) == 0)
+		e->literal = 1;
+	else
+		e->res = NULL;
+}
+
+int sock_resolve(const char *hostname, int port, struct addrinfo **res)
+{
+	struct dns_entry *e;
+	char pbuf[NI_MAXSERV];
+
+	snprintf(pbuf, sizeof(pbuf), "%d", port);
+	for (e = dns_cache; e != NULL; e = e->next)
+		if (strcmp(e->port, pbuf) == 0 && strcmp(e->host, hostname) == 0)
+			break;
+	if (e == NULL) {
+		e = calloc(1, sizeof(struct dns_entry));
+		if (e == NULL || (e->host = strdup(hostname)) == NULL) {
+			free(e);
+			return EAI_MEMORY;
+		}
+		strcpy(e->port, pbuf);
+		e->next = dns_cache;
+		dns_cache = e;
+		dns_literal(e);
+	}
+	if (e->literal) {
+		*res = e->res;
+		return 0;
+	}
+
+	dns_collect(e);
+	if (!e->looking_up && time(0) >= e->expires)
+		dns_refresh(e);
+#ifdef USE_THREADS
+	if (e->looking_up && e->res == NULL && e->error == 0) {
+		/* never looked up: nothing to go on but the answer */
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += connect_timeout;
+		pthread_mutex_lock(&dns_lock);
+		while (!e->fresh_ready
+			   && pthread_cond_timedwait(&dns_done, &dns_lock,
+										 &until) == 0);
+		pthread_mutex_unlock(&dns_lock);
+		dns_collect(e);
+		if (e->looking_up)
+			return EAI_AGAIN;
+	}
+#endif
+	/* out of date, or the resolver failed since: still good
+	   enough to try */
+	*res = e->res;
+	return (e->res != NULL) ? 0 : e->error;
+}
+#endif
 
 /* nspring/blueHal, 10 Apr 2002; added some extra error
    printing, in line with the debug-messages-to-stdout
@@ -85,10 +418,9 @@ static int ipv4_sock_connect(struct in_addr *address, short port)
 int sock_connect(const char *hostname, int port)
 {
 #ifdef HAVE_GETADDRINFO
-	struct addrinfo hints, *res, *res0;
-	struct sockaddr_in addr;
+	struct addrinfo *res0;
+	struct addrinfo *order[MAX_ATTEMPTS];
 	int fd;
-	char pbuf[NI_MAXSERV];
 	int error;
 
 	if (!sanity_check_hostname(hostname)) {
@@ -99,15 +431,7 @@ int sock_connect(const char *hostname, int port)
 		return -1;
 	}
 
-	/* we were given an IP address, no need to try getaddrinfo on it */
-	if (inet_aton(hostname, &addr.sin_addr)) {
-		return ipv4_sock_connect(&addr.sin_addr, port);
-	}
-
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_socktype = SOCK_STREAM;
-	snprintf(pbuf, sizeof(pbuf), "%d", port);
-	error = getaddrinfo(hostname, pbuf, &hints, &res0);
+	error = sock_resolve(hostname, port, &res0);
 	if (error) {
 		static int last_error;
 		if (last_error != error) {
@@ -119,21 +443,7 @@ int sock_connect(const char *hostname, int port)
 		return -1;
 	}
 
-	fd = -1;
-	for (res = res0; res; res = res->ai_next) {
-		fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-		if (fd < 0)
-			continue;
-               if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
-                       perror("fcntl(FD_CLOEXEC)");
-		if (connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
-			close(fd);
-			fd = -1;
-			continue;
-		}
-		break;
-	}
-	freeaddrinfo(res0);
+	fd = race_connect(order, interleave(res0, order));
 	if (fd < 0) {
 		static int last_connecterr;
 		if (errno != last_connecterr) {
@@ -0,0 +1,123 @@
+/* statBatch.c - stamping many local mailboxes at once.
+
+   With forty mailboxes, a check used to be forty stat()s, one
+   after another, each of which can block the X loop for as long
+   as its filesystem takes.  On a local filesystem that is half a
+   microsecond, from the inode cache, and nothing is gained by
+   handing it to another thread, so those are still stamped one by
+   one.  A mailbox on NFS or the like takes a round trip to the
+   server whenever the kernel's attributes for it are stale, though,
+   and those are stamped together on the scan threads.
+
+   Directory reads for maildirs aren't batched. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "statBatch.h"
+#include "threadPool.h"
+
+#ifdef USE_DMALLOC
+#include <dmalloc.h>
+#endif
+
+void stat_batch_init(struct stat_batch *b)
+{
+	b->req = NULL;
+	b->count = 0;
+	b->alloc = 0;
+}
+
+void stat_batch_free(struct stat_batch *b)
+{
+	int i;
+	for (i = 0; i < b->count; i++)
+		free(b->req[i].path);
+	free(b->req);
+	stat_batch_init(b);
+}
+
+void stat_batch_add(struct stat_batch *b, const char *path, int remote,
+					struct prefetched_stamp *out)
+{
+	out->ready = 0;
+	if (b->count == b->alloc) {
+		int alloc = (b->alloc > 0) ? b->alloc * 2 : 16;
+		struct stat_request *more =
+			realloc(b->req, alloc * sizeof(struct stat_request));
+		if (more == NULL)
+			return;				/* it'll be stamped when checked */
+		b->req = more;
+		b->alloc = alloc;
+	}
+	b->req[b->count].path = strdup(path);
+	if (b->req[b->count].path == NULL)
+		return;
+	b->req[b->count].remote = remote;
+	b->req[b->count].out = out;
+	b->count++;
+}
+
+static void stamp_one(void *data, int i)
+{
+	struct stat_request *r = &((struct stat_request *) data)[i];
+	if (file_stamp(r->path, &r->out->stamp) == 0)
+		r->out->error = 0;
+	else
+		r->out->error = errno;
+	r->out->ready = 1;
+}
+
+/* the remote ones, on the pool's threads, so that their round
+   trips overlap */
+static void stamp_together(struct stat_request *req, int n,
+						   struct thread_pool *pool)
+{
+	thread_pool_run(pool, n, stamp_one, req);
+}
+
+void stat_batch_run(struct stat_batch *b, struct thread_pool *pool)
+{
+	int i, local = 0;
+
+	/* the local ones first, and right away */
+	for (i = 0; i < b->count; i++) {
+		if (!b->req[i].remote) {
+			struct stat_request r = b->req[i];
+			b->req[i] = b->req[local];
+			b->req[local] = r;
+			stamp_one(b->req, local);
+			local++;
+		}
+	}
+	if (local < b->count)
+		stamp_together(b->req + local, b->count - local, pool);
+}
+
+int file_stamp_prefetched(struct prefetched_stamp *ps, const char *path,
+						  struct file_stamp *fs)
+{
+	if (!ps->ready)
+		return file_stamp(path, fs);
+	ps->ready = 0;
+	if (ps->error != 0) {
+		errno = ps->error;
+		return -1;
+	}
+	*fs = ps->stamp;
+	return 0;
+}
+
+/* vim:set ts=4: */
+/*
+ * Local Variables:
+ * tab-width: 4
+ * c-indent-level: 4
+ * c-basic-offset: 4
+ * End:
+ */
@@ -0,0 +1,50 @@
+/* statBatch.h - stamping all the local mailboxes that are due for a
+   check at once, before any of them is checked, instead of one
+   stat() at a time as each is reached, so that those on network
+   filesystems wait for their servers together, on the scan
+   threads. */
+
+#ifndef STATBATCH
+#define STATBATCH
+
+#include "fileStamp.h"
+
+struct thread_pool;
+
+/* where a client keeps a stamp taken for it ahead of its check */
+struct prefetched_stamp {
+	struct file_stamp stamp;
+	int error;					/* errno, or 0 */
+	int ready;
+};
+
+struct stat_request {
+	char *path;
+	int remote;
+	struct prefetched_stamp *out;
+};
+
+struct stat_batch {
+	struct stat_request *req;
+	int count;
+	int alloc;
+};
+
+void stat_batch_init(struct stat_batch *b);
+void stat_batch_free(struct stat_batch *b);
+
+/* stamp path into *out when the batch is run */
+void stat_batch_add(struct stat_batch *b, const char *path, int remote,
+					struct prefetched_stamp *out);
+
+/* take every stamp in the batch: those on local filesystems one
+   by one, the rest together, on the pool's threads */
+void stat_batch_run(struct stat_batch *b,
+					/*@null@ */ struct thread_pool *pool);
+
+/* the stamp prefetched into ps, which is used up, or if there is
+   none, a new one; as file_stamp() */
+int file_stamp_prefetched(struct prefetched_stamp *ps, const char *path,
+						  struct file_stamp *fs);
+
+#endif
@@ -42,7 +42,8 @@ const char *sequence[][4] = {
 	{NULL, NULL, NULL, NULL},
 };
 
-/* trick tlscomm into believing it can read. */
+/* trick tlscomm into believing it can read; once a sequence
+   runs out, the server has hung up. */
 ssize_t read(int s, void *buf, size_t buflen)
 {
 	int val = indices[s]++;
@@ -66,7 +67,8 @@ select(int nfds, fd_set * r,
 	int i;
 	int ready = 0;
 	for (i = 0; i < nfds; i++) {
-		if (FD_ISSET(i, r) && sequence[i][indices[i]] != NULL) {
+		/* a closed connection is readable, too */
+		if (FD_ISSET(i, r)) {
 			ready++;
 		} else {
 			FD_CLR(i, r);
@@ -78,14 +80,13 @@ select(int nfds, fd_set * r,
 	return ready;
 }
 
-#define BUF_SIZE 1024
-
 struct connection_state {
 	int sd;
 	char *name;
 	/*@null@ */ void *tls_state;
 	/*@null@ */ void *xcred;
-	char unprocessed[BUF_SIZE];
+	char *rbuf;
+	size_t rsize, rstart, rend, rscan;
 	void *pc;					/* mailbox handle for debugging messages */
 };
 
@@ -96,14 +97,14 @@ main(int argc __attribute__ ((unused)), char **argv
 	char buf[255];
 	struct connection_state scs;
 	scs.name = strdup("test");
-	scs.unprocessed[0] = '\0';
+	scs.rbuf = NULL;
 	scs.pc = NULL;
 	scs.tls_state = NULL;
 	scs.xcred = NULL;
 	alarm(10);
 
 	for (scs.sd = 1; sequence[scs.sd][0] != NULL; scs.sd++) {
-		memset(scs.unprocessed, 0, BUF_SIZE);
+		scs.rsize = scs.rstart = scs.rend = scs.rscan = 0;
 		printf("%d\n", tlscomm_expect(&scs, "prefix", buf, 255));
 	}
 	return 0;
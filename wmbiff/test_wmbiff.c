@@ -16,12 +16,32 @@
 #define ENFROB(x)
 #endif
 
+#include <stdarg.h>
 #include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <signal.h>
 
 #include "Client.h"
 #include "passwordMgr.h"
 #include "tlsComm.h"
 #include "charutil.h"
+#include "threadPool.h"
+#include "fileWatch.h"
+#include "MessageList.h"
+#include "imapResponse.h"
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#include <zlib.h>
+#endif
+#if defined(HAVE_LZMA_H) && defined(HAVE_LIBLZMA)
+#include <lzma.h>
+#endif
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+#include <zstd.h>
+#endif
 
 void ProcessPendingEvents(void)
 {
@@ -35,6 +55,43 @@ int x_socket(void)
 
 int debug_default = DEBUG_INFO;
 int Relax = 1;
+static char cache_dir[] = "/tmp/wmbiff-test-cache.XXXXXX";
+
+/* snprintf for the tests' scratch paths, which had better fit */
+static void path_printf(char *path, size_t size, const char *format, ...)
+{
+	va_list args;
+	int n;
+
+	va_start(args, format);
+	n = vsnprintf(path, size, format, args);
+	va_end(args);
+	if (n < 0 || (size_t) n >= size) {
+		printf("FAILED: path too long: %s...\n", path);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void remove_cache_dir(void)
+{
+	char path[BUF_BIG];
+	struct dirent *d;
+	DIR *dir;
+
+	path_printf(path, sizeof(path), "%s/wmbiff", cache_dir);
+	if ((dir = opendir(path)) != NULL) {
+		while ((d = readdir(dir)) != NULL) {
+			if (d->d_name[0] != '.') {
+				path_printf(path, sizeof(path), "%s/wmbiff/%s", cache_dir, d->d_name);
+				unlink(path);
+			}
+		}
+		closedir(dir);
+		path_printf(path, sizeof(path), "%s/wmbiff", cache_dir);
+		rmdir(path);
+	}
+	rmdir(cache_dir);
+}
 
 /* return 1 if fail, 0 if success */
 int test_backtickExpand(void)
@@ -303,37 +360,163 @@ int test_imap4creator(void)
 }
 
 
-int test_getline_from_buffer(void)
+/* lines come out whole however long they are, or in pieces
+   that fit the caller's buffer, and a last line without its
+   newline still comes out when the server hangs up */
+int test_tlscomm_lines(void)
 {
-#define LINE_BUF_LEN 256
-	char linebuf[LINE_BUF_LEN];
-	char scratchbuf[LINE_BUF_LEN];
-
+	char path[] = "/tmp/wmbiff-test-lines.XXXXXX";
+	struct connection_state *scs;
+	mbox_t m;
+	char buf[256];
+	const char *line;
+	size_t len;
+	int fd = mkstemp(path);
+	FILE *f;
+
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	f = fdopen(dup(fd), "w");
+	fprintf(f, "\r\n\n%0100000d\nshort\r\ntail", 0);
+	fclose(f);
+	unlink(path);
+	lseek(fd, 0, SEEK_SET);
+
+	memset(&m, 0, sizeof(m));
+	strcpy(m.label, "lines");
+	scs = initialize_unencrypted(fd, strdup("lines"), &m);
 	/* try to ensure that even an endless loop terminates */
 	alarm(100);
-	strcpy(scratchbuf, "\r\n");
-	getline_from_buffer(scratchbuf, linebuf, LINE_BUF_LEN);
-	if (strlen(scratchbuf) != 0) {
-		printf("FAILURE: scratchbuf not snarfed\n");
-		return (1);
+	if (tlscomm_gets(buf, sizeof(buf), scs) == 0 || strcmp(buf, "\r\n")) {
+		printf("FAILURE: \\r\\n line not read\n");
+		return 1;
 	}
-	if (strlen(linebuf) != 2) {
-		printf("FAILURE: linebuf not populated\n");
-		return (1);
+	if (tlscomm_gets(buf, sizeof(buf), scs) == 0 || strcmp(buf, "\n")) {
+		printf("FAILURE: \\n line not read\n");
+		return 1;
 	}
-	strcpy(scratchbuf, "\n");
-	getline_from_buffer(scratchbuf, linebuf, LINE_BUF_LEN);
-	if (strlen(scratchbuf) != 0) {
-		printf("FAILURE: scratchbuf not snarfed\n");
-		return (1);
+	line = tlscomm_line(scs, &len);
+	if (line == NULL || len != 100001 || line[0] != '0'
+		|| line[len - 1] != '\n') {
+		printf("FAILURE: long line came out as %lu bytes\n",
+			   (unsigned long) len);
+		return 1;
 	}
-	if (strlen(linebuf) != 1) {
-		printf("FAILURE: linebuf not populated\n");
-		return (1);
+	if (tlscomm_gets(buf, 4, scs) == 0 || strcmp(buf, "sho")
+		|| tlscomm_gets(buf, sizeof(buf), scs) == 0
+		|| strcmp(buf, "rt\r\n")) {
+		printf("FAILURE: line not split to fit the buffer\n");
+		return 1;
+	}
+	if (tlscomm_gets(buf, sizeof(buf), scs) == 0 || strcmp(buf, "tail")) {
+		printf("FAILURE: unterminated last line lost\n");
+		return 1;
 	}
+	if (tlscomm_gets(buf, sizeof(buf), scs) != 0) {
+		printf("FAILURE: read past the end\n");
+		return 1;
+	}
+	alarm(0);
+	tlscomm_close(scs);
+	return 0;
+}
+
+/* untagged responses seen by test_imap_response's handlers */
+static void note_response(const struct imap_response *r, void *arg)
+{
+	strcat(arg, (imap_is(r, "STATUS") && r->args != NULL)
+		   ? r->args->text : r->name);
+	strcat(arg, ";");
+}
 
+/* responses come out whole, literals and all, and commands sent
+   together complete in whatever order the server answers them */
+int test_imap_response(void)
+{
+	static const char header[] =
+		"From: a@b\r\nSubject: a subject\r\n that is folded\r\n\r\n";
+	char path[] = "/tmp/wmbiff-test-response.XXXXXX";
+	const char *tags[] = { "w001", "w002" };
+	struct connection_state *scs;
+	struct imap_response *r;
+	const struct imap_token *t;
+	char seen[128] = "";
+	struct imap_handler handlers[] = {
+		{"STATUS", note_response, seen},
+		{NULL, note_response, seen},
+		{NULL, NULL, NULL}
+	};
+	mbox_t m;
+	int ok[2];
+	int n, fd = mkstemp(path);
+	FILE *f;
+
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	f = fdopen(dup(fd), "w");
+	fprintf(f, "* 12 FETCH (UID 7 FLAGS (\\Seen $Junk) "
+			"BODY[HEADER.FIELDS (FROM SUBJECT)] {%d}\r\n%s MODSEQ (5))\r\n"
+			"* STATUS \"odd \\\"name\\\"\" (MESSAGES 3 UNSEEN 1)\r\n"
+			"* STATUS {5}\r\nLists (MESSAGES 4 UNSEEN 0)\r\n"
+			"* OK [UIDVALIDITY 42] UIDs valid\r\n+ idling\r\n"
+			"w002 OK done\r\nw001 NO [ALERT] nope\r\n* BYE\r\n",
+			(int) strlen(header), header);
+	fclose(f);
+	unlink(path);
+	lseek(fd, 0, SEEK_SET);
+
+	memset(&m, 0, sizeof(m));
+	strcpy(m.label, "response");
+	scs = initialize_unencrypted(fd, strdup("response"), &m);
+	alarm(100);
+	r = imap_read_response(scs);
+	if (r == NULL || r->args == NULL || r->args->kind != IMAP_LIST) {
+		printf("FAILED: FETCH not read\n");
+		return 1;
+	}
+	CKSTRING(r->tag, "*");
+	CKSTRING(r->name, "FETCH");
+	n = (int) r->number;
+	CKINT(n, 12);
+	CKSTRING(imap_item(r->args->list, "UID")->text, "7");
+	t = imap_item(r->args->list, "FLAGS");
+	n = (t->kind == IMAP_LIST && t->list->next != NULL);
+	CKINT(n, 1);
+	CKSTRING(t->list->text, "\\Seen");
+	t = imap_item(r->args->list, "BODY[HEADER.FIELDS (FROM SUBJECT)]");
+	n = (t != NULL && t->kind == IMAP_STRING
+		 && strcmp(t->text, header) == 0);
+	CKINT(n, 1);
+	t = imap_item(r->args->list, "MODSEQ");
+	n = (t != NULL && t->kind == IMAP_LIST);
+	CKINT(n, 1);
+	CKSTRING(t->list->text, "5");
+	imap_free_response(r);
+
+	n = imap_await_all(scs, tags, 2, ok, handlers);
+	CKINT(n, 1);
+	CKINT(ok[0], 0);
+	CKINT(ok[1], 1);
+	CKSTRING(seen, "odd \"name\";Lists;OK;");
+
+	r = imap_read_response(scs);
+	if (r == NULL) {
+		printf("FAILED: BYE not read\n");
+		return 1;
+	}
+	CKSTRING(r->name, "BYE");
+	imap_free_response(r);
+	r = imap_read_response(scs);
+	n = (r == NULL);
+	CKINT(n, 1);
 	alarm(0);
-	return (0);
+	tlscomm_close(scs);
+	printf("imap response: ok\n");
+	return 0;
 }
 
 int test_charutil(void)
@@ -362,11 +545,15 @@ int test_charutil(void)
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <netdb.h>
 int test_sock_connect(void)
 {
 	struct sockaddr_in addr;
 	int s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 	socklen_t addrlen = sizeof(struct sockaddr_in);
+	time_t start;
+	struct addrinfo *first, *again;
+	int n;
 	if (s < 0) {
 		perror("socket");
 		return 1;
@@ -389,15 +576,1810 @@ int test_sock_connect(void)
 	if (sock_connect("localhost", htons(addr.sin_port)) < 0) {
 		return 1;
 	}
+	/* which was looked up once */
+	n = sock_resolve("localhost", htons(addr.sin_port), &first);
+	CKINT(n, 0);
+	n = sock_resolve("localhost", htons(addr.sin_port), &again);
+	CKINT(n, 0);
+	n = (first == again && first != NULL);
+	CKINT(n, 1);
+	/* and an address, which needn't be */
+	n = sock_resolve("127.0.0.1", htons(addr.sin_port), &first);
+	CKINT(n, 0);
+	n = (first != NULL && first->ai_family == AF_INET
+		 && ((struct sockaddr_in *) first->ai_addr)->sin_addr.s_addr
+		 == htonl(INADDR_LOOPBACK));
+	CKINT(n, 1);
+
+	/* an IPv6 address is as good as an IPv4 one, relaxed or not;
+	   if there's no ::1 here, never mind */
+	{
+		struct sockaddr_in6 addr6;
+		socklen_t len6 = sizeof(addr6);
+		int s6 = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP), fd;
+		memset(&addr6, 0, sizeof(addr6));
+		addr6.sin6_family = AF_INET6;
+		addr6.sin6_addr = in6addr_loopback;
+		if (s6 >= 0
+			&& bind(s6, (const struct sockaddr *) &addr6,
+					sizeof(addr6)) == 0 && listen(s6, 5) == 0) {
+			getsockname(s6, (struct sockaddr *) &addr6, &len6);
+			Relax = 0;
+			fd = sock_connect("::1", ntohs(addr6.sin6_port));
+			Relax = 1;
+			n = (fd >= 0);
+			CKINT(n, 1);
+			close(fd);
+		}
+		if (s6 >= 0)
+			close(s6);
+	}
+
+	/* refused, and unanswered (or unreachable), are given up on
+	   by the deadline, not minutes later */
+	close(s);
+	connect_timeout = 1;
+	start = time(0);
+	if (sock_connect("127.0.0.1", htons(addr.sin_port)) >= 0
+		|| sock_connect("10.255.255.1", 9) >= 0) {
+		printf("FAILED: connected to nothing\n");
+		return 1;
+	}
+	n = (time(0) - start <= 3);
+	CKINT(n, 1);
+	connect_timeout = 10;
+	return 0;
+}
+
+/* which unseen messages the fake server's INBOX has: 3, 4 and 7,
+   then, after the next CLOSE, 4, 7 and 9.  with CONDSTORE, that
+   change has modseqs 101 (3 read) and 102 (9 arrived). */
+static int fake_imap_round;
+
+/* a pretend IMAP server, in a child, for one connection: its
+   CAPABILITY adds extra; INBOX has two messages, one unseen, and
+   another arrives a moment after the client first goes IDLE.
+   With NOTIFY, it's Lists, with five read messages, that gets a
+   new one, once Lists is registered (with EARLY, during the first
+   EXAMINE after a CLOSE rather than the next IDLE).  After the first STATUS, it
+   sits on hold of them before answering, last first.  Unseen are
+   3, 4 and 7 in INBOX, and 1 to 300 in Big. */
+
+static pid_t fake_imap(const char *extra, int hold, int *port)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(struct sockaddr_in);
+	int s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	pid_t pid;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (s < 0 || bind(s, (const struct sockaddr *) &addr, addrlen) < 0
+		|| listen(s, 1) < 0) {
+		perror("fake_imap");
+		return -1;
+	}
+	getsockname(s, (struct sockaddr *) &addr, &addrlen);
+	*port = ntohs(addr.sin_port);
+	pid = fork();
+	if (pid == 0) {
+		int c = accept(s, NULL, NULL);
+		FILE *in = fdopen(c, "r");
+		FILE *out = fdopen(dup(c), "w");
+		char line[256], tag[16], cmd[32], idle_tag[16] = "";
+		int messages = 2, unseen = 1, idles = 0;
+		int lists = 5, lists_unseen = 0, notified = 0;
+		char held[8][16];
+		int nheld = 0, statuses = 0, big = 0;
+		int round = fake_imap_round;
+		const char *fetch_set;
+		int condstore = (strstr(extra, "CONDSTORE") != NULL);
+		int early = (strstr(extra, "EARLY") != NULL), closed = 0;
+		char modseq[32] = "";
+		if (condstore) {
+			messages = 9;
+			unseen = 3;
+		}
+		fprintf(out, "* OK fake\r\n");
+		fflush(out);
+		while (fgets(line, sizeof(line), in) != NULL) {
+			/* the only UID FETCH that will be answered */
+			fetch_set = big ? " 1:300 " : (round == 0) ? " 3:4,7 "
+				: (round == 1) ? " 9 " : NULL;
+			if (condstore)
+				sprintf(modseq, " HIGHESTMODSEQ %d", round ? 102 : 100);
+			if (strncmp(line, "DONE", 4) == 0) {
+				fprintf(out, "%s OK IDLE done\r\n", idle_tag);
+			} else if (sscanf(line, "%15s %31s", tag, cmd) != 2) {
+				continue;
+			} else if (strcmp(cmd, "CAPABILITY") == 0) {
+				fprintf(out, "* CAPABILITY IMAP4rev1 %s\r\n%s OK\r\n",
+						extra, tag);
+			} else if (strcmp(cmd, "LOGIN") == 0) {
+				fprintf(out, "%s OK LOGIN\r\n", tag);
+			} else if (strcmp(cmd, "STATUS") == 0 && statuses++ > 0
+					   && nheld < hold - 1) {
+				sprintf(held[nheld++], "%s%c", tag,
+						(strstr(line, "Lists") != NULL) ? 'L' : 'I');
+				continue;
+			} else if (strcmp(cmd, "STATUS") == 0 && nheld > 0) {
+				sprintf(held[nheld++], "%s%c", tag,
+						(strstr(line, "Lists") != NULL) ? 'L' : 'I');
+				while (nheld-- > 0) {
+					char *which = held[nheld] + strlen(held[nheld]) - 1;
+					if (*which == 'L')
+						fprintf(out, "* STATUS \"Lists\" (UNSEEN %d "
+								"MESSAGES %d)\r\n", lists_unseen, lists);
+					else
+						fprintf(out, "* STATUS INBOX (MESSAGES %d "
+								"UNSEEN %d)\r\n", messages, unseen);
+					*which = '\0';
+					fprintf(out, "%s OK\r\n", held[nheld]);
+				}
+				nheld = 0;
+			} else if (strcmp(cmd, "STATUS") == 0
+					   && strstr(line, "Lists") != NULL) {
+				fprintf(out, "* STATUS Lists (MESSAGES %d UNSEEN %d)\r\n"
+						"%s OK\r\n", lists, lists_unseen, tag);
+			} else if (strcmp(cmd, "STATUS") == 0) {
+				fprintf(out, "* STATUS INBOX (MESSAGES %d UNSEEN %d%s)\r\n"
+						"%s OK\r\n", messages, unseen, modseq, tag);
+			} else if (strcmp(cmd, "NOTIFY") == 0) {
+				if (strstr(line, "Lists") != NULL && notified == 0)
+					notified = 1;
+				fprintf(out, "%s OK NOTIFY\r\n", tag);
+			} else if (strcmp(cmd, "UID") == 0 && condstore
+					   && strstr(line, " (CHANGEDSINCE 100)") != NULL) {
+				if (round > 0)
+					fprintf(out, "* 3 FETCH (UID 3 FLAGS (\\Seen) "
+							"MODSEQ (101))\r\n* 9 FETCH (FLAGS () UID 9 "
+							"MODSEQ (102))\r\n");
+				fprintf(out, "%s OK\r\n", tag);
+			} else if (strcmp(cmd, "UID") == 0 && condstore && round > 0
+					   && strstr(line, "UID SEARCH") != NULL) {
+				/* CHANGEDSINCE ought to have been enough */
+				fprintf(out, "%s BAD\r\n", tag);
+			} else if (strcmp(cmd, "UID") == 0
+					   && strstr(line, "UID SEARCH UNSEEN") != NULL) {
+				int u;
+				fprintf(out, "* SEARCH");
+				for (u = 1; u <= (big ? 300 : 9); u++)
+					if (big || u == 4 || u == 7 || u == (round ? 9 : 3))
+						fprintf(out, " %d", u);
+				fprintf(out, "\r\n%s OK\r\n", tag);
+			} else if (strcmp(cmd, "UID") == 0
+					   && strstr(line, " UID FETCH ") != NULL
+					   && strstr(line, "BODY.PEEK[") != NULL
+					   && fetch_set != NULL && strstr(line, fetch_set) != NULL) {
+				int u;
+				for (u = 1; u <= (big ? 300 : 9); u++) {
+					char hdr[128];
+					if (!big && (round ? u != 9 : (u != 3 && u != 4 && u != 7)))
+						continue;
+					if (u == 4 && !big)
+						strcpy(hdr, "Subject: long\r\n\tfolded\r\n\r\n");
+					else
+						sprintf(hdr, "From: a%d@b\r\nSubject: s%d\r\n\r\n",
+								u, u);
+					if (u == 7)
+						fprintf(out, "* %d FETCH (BODY[HEADER.FIELDS "
+								"(FROM SUBJECT)] {%d}\r\n%s UID %d)\r\n",
+								u, (int) strlen(hdr), hdr, u);
+					else
+						fprintf(out, "* %d FETCH (UID %d BODY[HEADER.FIELDS "
+								"(FROM SUBJECT)] {%d}\r\n%s)\r\n",
+								u, u, (int) strlen(hdr), hdr);
+				}
+				fprintf(out, "%s OK\r\n", tag);
+			} else if (strcmp(cmd, "NOOP") == 0) {
+				fprintf(out, "%s OK NOOP\r\n", tag);
+			} else if (strcmp(cmd, "LOGOUT") == 0) {
+				fprintf(out, "* BYE\r\n%s OK\r\n", tag);
+				fflush(out);
+				break;
+			} else if (strcmp(cmd, "CLOSE") == 0) {
+				if (!big)
+					round++;
+				fprintf(out, "%s OK\r\n", tag);
+				closed = 1;
+				fflush(out);
+				continue;
+			} else if (strcmp(cmd, "EXAMINE") == 0) {
+				big = (strstr(line, "Big") != NULL);
+				fprintf(out, "* %d EXISTS\r\n* OK [UIDVALIDITY 42]\r\n",
+						messages);
+				if (early && notified == 1 && closed) {
+					lists++;
+					lists_unseen++;
+					notified = 2;
+					fprintf(out, "* STATUS Lists (MESSAGES %d UIDNEXT %d)\r\n",
+							lists, lists + 1);
+				}
+				if (strstr(line, "(CONDSTORE)") != NULL)
+					fprintf(out, "* OK [HIGHESTMODSEQ %d]\r\n",
+							round ? 102 : 100);
+				fprintf(out, "%s OK [READ-ONLY]\r\n", tag);
+			} else if (strcmp(cmd, "IDLE") == 0) {
+				strcpy(idle_tag, tag);
+				fprintf(out, "+ idling\r\n");
+				if (notified == 1 && !early) {
+					fflush(out);
+					usleep(200000);
+					lists++;
+					lists_unseen++;
+					notified = 2;
+					fprintf(out, "* STATUS Lists (MESSAGES %d UIDNEXT %d)\r\n",
+							lists, lists + 1);
+				} else if (strstr(extra, "NOTIFY") == NULL && idles++ == 0) {
+					fflush(out);
+					usleep(200000);
+					messages++;
+					unseen++;
+					fprintf(out, "* %d EXISTS\r\n", messages);
+				}
+			} else {
+				fprintf(out, "%s BAD\r\n", tag);
+			}
+			closed = 0;
+			fflush(out);
+		}
+		_exit(0);
+	}
+	close(s);
+	return pid;
+}
+
+int test_imap_pool(void)
+{
+	mbox_t m[7];
+	pid_t server[7];
+	char config[128];
+	int fds[8];
+	int i, port, n;
+
+	/* more servers than there used to be room for */
+	for (i = 0; i < 7; i++) {
+		server[i] = fake_imap("IDLE", 0, &port);
+		if (server[i] < 0)
+			return 1;
+		memset(&m[i], 0, sizeof(mbox_t));
+		sprintf(config, "imap:user:pass@127.0.0.1/INBOX:%d", port);
+		if (imap4Create(&m[i], config) != 0)
+			return 1;
+		n = m[i].checkMail(&m[i]);
+		CKINT(n, 0);
+	}
+	n = imap_idle_fds(fds, 8);
+	CKINT(n, 7);
+	for (i = 0; i < 7; i++) {
+		kill(server[i], SIGTERM);
+		waitpid(server[i], NULL, 0);
+	}
+	for (i = 0; i < 7; i++)
+		imap_idle_dispatch(fds[i]);
+	n = imap_idle_fds(fds, 8);
+	CKINT(n, 0);
+
+	/* a connection that's quiet is kept up with a NOOP, */
+	server[0] = fake_imap("", 0, &port);
+	if (server[0] < 0)
+		return 1;
+	memset(&m[0], 0, sizeof(mbox_t));
+	sprintf(config, "imap:user:pass@127.0.0.1/INBOX:%d", port);
+	if (imap4Create(&m[0], config) != 0)
+		return 1;
+	n = m[0].checkMail(&m[0]);
+	CKINT(n, 0);
+	imap_keepalive(time(0) + 11 * 60);
+	n = m[0].checkMail(&m[0]);
+	CKINT(n, 0);
+	/* and one that's not been used for long is logged out */
+	imap_keepalive(time(0) + 2 * 60 * 60);
+	for (i = 0; i < 50 && waitpid(server[0], NULL, WNOHANG) == 0; i++)
+		usleep(100000);
+	n = (i < 50);
+	CKINT(n, 1);
+	printf("imap pool: ok\n");
+	return 0;
+}
+
+int test_imap_idle(void)
+{
+	mbox_t m;
+	char config[128];
+	struct pollfd p;
+	int port, fd, n;
+	pid_t server;
+
+	/* a server with IDLE tells us of the new message */
+	server = fake_imap("IDLE", 0, &port);
+	if (server < 0)
+		return 1;
+	memset(&m, 0, sizeof(mbox_t));
+	sprintf(config, "imap:user:pass@127.0.0.1/INBOX:%d", port);
+	if (imap4Create(&m, config) != 0)
+		return 1;
+	n = m.checkMail(&m);
+	CKINT(n, 0);
+	CKINT(m.TotalMsgs, 2);
+	CKINT(m.UnreadMsgs, 1);
+	CKINT(m.watched, 1);
+	n = imap_idle_fds(&fd, 1);
+	CKINT(n, 1);
+	m.prevtime = time(0);
+	p.fd = fd;
+	p.events = POLLIN;
+	n = poll(&p, 1, 5000);
+	CKINT(n, 1);
+	imap_idle_dispatch(fd);
+	CKINT((int) m.prevtime, 0);
+	n = m.checkMail(&m);
+	CKINT(n, 0);
+	CKINT(m.TotalMsgs, 3);
+	CKINT(m.UnreadMsgs, 2);
+	CKINT(m.watched, 1);
+
+	/* and nothing more: it isn't asked again */
+	m.TotalMsgs = 0;
+	n = m.checkMail(&m);
+	CKINT(n, 0);
+	CKINT(m.TotalMsgs, 0);
+
+	/* it hangs up: back to polling */
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	m.prevtime = time(0);
+	n = poll(&p, 1, 5000);
+	CKINT(n, 1);
+	imap_idle_dispatch(fd);
+	CKINT((int) m.prevtime, 0);
+	CKINT(m.watched, 0);
+	n = imap_idle_fds(&fd, 1);
+	CKINT(n, 0);
+
+	/* a server without IDLE is polled */
+	server = fake_imap("", 0, &port);
+	if (server < 0)
+		return 1;
+	memset(&m, 0, sizeof(mbox_t));
+	sprintf(config, "imap:user:pass@127.0.0.1/INBOX:%d", port);
+	if (imap4Create(&m, config) != 0)
+		return 1;
+	n = m.checkMail(&m);
+	CKINT(n, 0);
+	CKINT(m.TotalMsgs, 2);
+	CKINT(m.watched, 0);
+	n = imap_idle_fds(&fd, 1);
+	CKINT(n, 0);
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	printf("imap idle: ok\n");
+	return 0;
+}
+
+int test_imap_notify(void)
+{
+	mbox_t inbox, lists;
+	struct msglst *h;
+	char config[128];
+	struct pollfd p;
+	int port, fd, n;
+	pid_t server;
+
+	/* two folders on one connection, both pushed */
+	server = fake_imap("IDLE NOTIFY", 0, &port);
+	if (server < 0)
+		return 1;
+	memset(&inbox, 0, sizeof(mbox_t));
+	memset(&lists, 0, sizeof(mbox_t));
+	sprintf(config, "imap:user:pass@127.0.0.1/INBOX:%d", port);
+	if (imap4Create(&inbox, config) != 0)
+		return 1;
+	sprintf(config, "imap:user:pass@127.0.0.1/Lists:%d", port);
+	if (imap4Create(&lists, config) != 0)
+		return 1;
+	n = inbox.checkMail(&inbox);
+	CKINT(n, 0);
+	CKINT(inbox.TotalMsgs, 2);
+	CKINT(inbox.watched, 1);
+	n = lists.checkMail(&lists);
+	CKINT(n, 0);
+	CKINT(lists.TotalMsgs, 5);
+	CKINT(lists.UnreadMsgs, 0);
+	CKINT(lists.watched, 1);
+	n = imap_idle_fds(&fd, 1);
+	CKINT(n, 1);
+
+	/* news of Lists, not of INBOX */
+	inbox.prevtime = lists.prevtime = time(0);
+	p.fd = fd;
+	p.events = POLLIN;
+	n = poll(&p, 1, 5000);
+	CKINT(n, 1);
+	imap_idle_dispatch(fd);
+	CKINT((int) lists.prevtime, 0);
+	if (inbox.prevtime == 0) {
+		printf("FAILED: INBOX made due by news of Lists\n");
+		return 1;
+	}
+	n = lists.checkMail(&lists);
+	CKINT(n, 0);
+	CKINT(lists.TotalMsgs, 6);
+	CKINT(lists.UnreadMsgs, 1);
+
+	/* INBOX isn't asked about */
+	inbox.TotalMsgs = 0;
+	n = inbox.checkMail(&inbox);
+	CKINT(n, 0);
+	CKINT(inbox.TotalMsgs, 0);
+
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	n = poll(&p, 1, 5000);
+	CKINT(n, 1);
+	imap_idle_dispatch(fd);
+	CKINT(inbox.watched, 0);
+	CKINT(lists.watched, 0);
+
+	/* news of Lists that comes while INBOX is being selected again
+	   to IDLE in, after its headers were fetched, isn't lost */
+	server = fake_imap("IDLE NOTIFY EARLY", 0, &port);
+	if (server < 0)
+		return 1;
+	memset(&inbox, 0, sizeof(mbox_t));
+	memset(&lists, 0, sizeof(mbox_t));
+	sprintf(config, "imap:user:pass@127.0.0.1/INBOX:%d", port);
+	if (imap4Create(&inbox, config) != 0)
+		return 1;
+	sprintf(config, "imap:user:pass@127.0.0.1/Lists:%d", port);
+	if (imap4Create(&lists, config) != 0)
+		return 1;
+	n = inbox.checkMail(&inbox);
+	CKINT(n, 0);
+	n = lists.checkMail(&lists);
+	CKINT(n, 0);
+	CKINT(lists.TotalMsgs, 5);
+	lists.prevtime = time(0);
+	h = inbox.getHeaders(&inbox);
+	n = (h != NULL);
+	CKINT(n, 1);
+	inbox.releaseHeaders(&inbox, h);
+	CKINT((int) lists.prevtime, 0);
+	CKINT(lists.watched, 1);
+	n = lists.checkMail(&lists);
+	CKINT(n, 0);
+	CKINT(lists.TotalMsgs, 6);
+	CKINT(lists.UnreadMsgs, 1);
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	n = imap_idle_fds(&fd, 1);
+	CKINT(n, 1);
+	imap_idle_dispatch(fd);
+	printf("imap notify: ok\n");
+	return 0;
+}
+
+int test_imap_status_batch(void)
+{
+	mbox_t inbox, lists;
+	char config[128];
+	int port, n;
+	pid_t server;
+
+	/* answers nothing until it has both */
+	server = fake_imap("", 2, &port);
+	if (server < 0)
+		return 1;
+	memset(&inbox, 0, sizeof(mbox_t));
+	memset(&lists, 0, sizeof(mbox_t));
+	sprintf(config, "imap:user:pass@127.0.0.1/INBOX:%d", port);
+	if (imap4Create(&inbox, config) != 0)
+		return 1;
+	sprintf(config, "imap:user:pass@127.0.0.1/\"Lists\":%d", port);
+	if (imap4Create(&lists, config) != 0)
+		return 1;
+	n = inbox.checkMail(&inbox);
+	CKINT(n, 0);
+	CKINT(inbox.TotalMsgs, 2);
+
+	inbox.TotalMsgs = inbox.UnreadMsgs = 0;
+	lists.prefetch(&lists, NULL);
+	inbox.prefetch(&inbox, NULL);
+	n = lists.checkMail(&lists);
+	CKINT(n, 0);
+	CKINT(lists.TotalMsgs, 5);
+	CKINT(lists.UnreadMsgs, 0);
+	/* already in */
+	CKINT(inbox.u.pop_imap.status_ready, 1);
+	CKINT(inbox.TotalMsgs, 2);
+	CKINT(inbox.UnreadMsgs, 1);
+	n = inbox.checkMail(&inbox);
+	CKINT(n, 0);
+	CKINT(inbox.u.pop_imap.status_ready, 0);
+	CKINT(inbox.TotalMsgs, 2);
+
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	printf("imap status batch: ok\n");
+	return 0;
+}
+
+int test_imap_headers(void)
+{
+	mbox_t inbox, big;
+	struct msglst *h;
+	char config[128];
+	int port, n;
+	pid_t server;
+
+	server = fake_imap("", 0, &port);
+	if (server < 0)
+		return 1;
+	memset(&inbox, 0, sizeof(mbox_t));
+	memset(&big, 0, sizeof(mbox_t));
+	sprintf(config, "imap:user:pass@127.0.0.1/INBOX:%d", port);
+	if (imap4Create(&inbox, config) != 0)
+		return 1;
+	sprintf(config, "imap:user:pass@127.0.0.1/Big:%d", port);
+	if (imap4Create(&big, config) != 0)
+		return 1;
+
+	/* newest first, in one FETCH */
+	h = inbox.getHeaders(&inbox);
+	if (h == NULL) {
+		printf("FAILED: no headers\n");
+		return 1;
+	}
+	CKSTRING(h->subj, "s7");
+	CKSTRING(h->from, "a7@b");
+	h = h->next;
+	CKSTRING(h->subj, "long folded");
+	CKSTRING(h->from, " ");
+	h = h->next;
+	CKSTRING(h->subj, "s3");
+	n = (h->next == NULL);
+	CKINT(n, 1);
+
+	/* a SEARCH response longer than a buffer */
+	for (n = 0, h = big.getHeaders(&big); h != NULL; h = h->next, n++);
+	CKINT(n, 300);
+	CKSTRING(big.headerCache->subj, "s300");
+
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	printf("imap headers: ok\n");
+	return 0;
+}
+
+void imap_cacheHeaders(Pop3 pc);
+
+int test_imap_header_cache(void)
+{
+	mbox_t m, again;
+	struct msglst *h;
+	char config[128];
+	int port, n;
+	pid_t server;
+
+	fake_imap_round = 0;
+	server = fake_imap("", 0, &port);
+	if (server < 0)
+		return 1;
+	memset(&m, 0, sizeof(mbox_t));
+	sprintf(config, "imap:user:pass@127.0.0.1/INBOX:%d", port);
+	if (imap4Create(&m, config) != 0)
+		return 1;
+	h = m.getHeaders(&m);
+	if (h == NULL) {
+		printf("FAILED: no headers\n");
+		return 1;
+	}
+	m.releaseHeaders(&m, h);
+
+	/* 3 was read, and 9 came: only 9 is fetched */
+	imap_cacheHeaders(&m);
+	h = m.headerCache;
+	if (h == NULL || h->next == NULL || h->next->next == NULL) {
+		printf("FAILED: headers lost\n");
+		return 1;
+	}
+	CKSTRING(h->subj, "s9");
+	CKINT((int) h->uid, 9);
+	CKSTRING(h->next->subj, "s7");
+	CKSTRING(h->next->next->subj, "long folded");
+	n = (h->next->next->next == NULL);
+	CKINT(n, 1);
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+
+	/* after a restart, none are: they were saved */
+	fake_imap_round = 2;
+	server = fake_imap("", 0, &port);
+	if (server < 0)
+		return 1;
+	memset(&again, 0, sizeof(mbox_t));
+	sprintf(config, "imap:user:pass@127.0.0.1/INBOX:%d", port);
+	if (imap4Create(&again, config) != 0)
+		return 1;
+	for (n = 0, h = again.getHeaders(&again); h != NULL; h = h->next, n++);
+	CKINT(n, 3);
+	CKSTRING(again.headerCache->subj, "s9");
+	CKSTRING(again.headerCache->next->next->from, " ");
+
+	m.releaseHeaders(&m, m.headerCache);
+	again.releaseHeaders(&again, again.headerCache);
+	again.releaseHeaders(&again, again.headerCache);
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	fake_imap_round = 0;
+	printf("imap header cache: ok\n");
+	return 0;
+}
+
+int test_imap_condstore(void)
+{
+	mbox_t m;
+	struct msglst *h;
+	char config[128];
+	int port, n;
+	pid_t server;
+
+	fake_imap_round = 0;
+	server = fake_imap("CONDSTORE", 0, &port);
+	if (server < 0)
+		return 1;
+	memset(&m, 0, sizeof(mbox_t));
+	/* not the user whose headers test_imap_header_cache saved */
+	sprintf(config, "imap:modseq:pass@127.0.0.1/INBOX:%d", port);
+	if (imap4Create(&m, config) != 0)
+		return 1;
+	m.u.pop_imap.wantCacheHeaders = 1;
+	n = m.checkMail(&m);
+	CKINT(n, 0);
+	CKINT(m.UnreadMsgs, 3);
+	n = (int) m.u.pop_imap.header_modseq;
+	CKINT(n, 100);
+	if (m.headerCache == NULL) {
+		printf("FAILED: no headers\n");
+		return 1;
+	}
+	CKSTRING(m.headerCache->subj, "s7");
+	m.OldMsgs = m.TotalMsgs;
+	m.OldUnreadMsgs = m.UnreadMsgs;
+
+	/* the counts are the same, but 3 was read and 9 came; that's
+	   found out without a SEARCH */
+	n = m.checkMail(&m);
+	CKINT(n, 0);
+	n = (int) m.u.pop_imap.header_modseq;
+	CKINT(n, 102);
+	for (n = 0, h = m.headerCache; h != NULL; h = h->next, n++);
+	CKINT(n, 3);
+	CKSTRING(m.headerCache->subj, "s9");
+	CKSTRING(m.headerCache->next->next->subj, "long folded");
+
+	/* and then nothing changes: the headers are left alone */
+	h = m.headerCache;
+	n = m.checkMail(&m);
+	CKINT(n, 0);
+	n = (m.headerCache == h);
+	CKINT(n, 1);
+
+	m.releaseHeaders(&m, m.headerCache);
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	printf("imap condstore: ok\n");
+	return 0;
+}
+
+/* write an mbox of count messages, every read_every'th one read */
+static void write_mbox(const char *path, const char *mode, int count,
+					   int read_every)
+{
+	FILE *f = fopen(path, mode);
+	int i;
+	for (i = 0; i < count; i++) {
+		fprintf(f, "From someone@example.org Thu Jan  1 00:00:00 2004\n"
+				"Subject: message %d\n", i);
+		if (read_every && i % read_every == 0)
+			fprintf(f, "Status: RO\n");
+		fprintf(f, "\nFrom the body, escaped or not.\n"
+				"a much longer line of body text %0200d\n\n", i);
+	}
+	fclose(f);
+}
+
+static int check_mbox(mbox_t * m, int total, int unread)
+{
+	if (m->checkMail(m) < 0) {
+		printf("FAILURE: checkMail on %s failed\n", m->path);
+		return 1;
+	}
+	if (m->TotalMsgs != total || m->UnreadMsgs != unread) {
+		printf("FAILURE: %s: expected %d/%d, got %d/%d\n", m->path,
+			   unread, total, m->UnreadMsgs, m->TotalMsgs);
+		return 1;
+	}
+	m->OldMsgs = m->TotalMsgs;
+	m->OldUnreadMsgs = m->UnreadMsgs;
+	printf("SUCCESS: %s has %d/%d\n", m->path, unread, total);
+	return 0;
+}
+
+int test_mbox(void)
+{
+	mbox_t m;
+	char path[] = "/tmp/wmbiff-test-mbox.XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+
+	memset(&m, 0, sizeof(m));
+	strcpy(m.label, "mbox");
+	sprintf(m.path, "mbox:%s", path);
+	mboxCreate(&m, m.path);
+
+	write_mbox(path, "w", 3, 2);
+	if (check_mbox(&m, 3, 1))
+		return 1;
+
+	/* appended: should resume where it left off */
+	write_mbox(path, "a", 4, 4);
+	if (check_mbox(&m, 7, 4))
+		return 1;
+	if (m.u.mbox.offset == 0) {
+		printf("FAILURE: scan did not record an offset\n");
+		return 1;
+	}
+
+	/* rewritten: must notice and start over */
+	write_mbox(path, "w", 5, 1);
+	if (check_mbox(&m, 5, 0))
+		return 1;
+
+	/* a header line longer than any buffer is still one line */
+	{
+		FILE *f = fopen(path, "a");
+		fprintf(f, "From someone@example.org Thu Jan  1 00:00:00 2004\n"
+				"X-Long: %01200dStatus: RO\n\nbody\n", 0);
+		fclose(f);
+	}
+	if (check_mbox(&m, 6, 1))
+		return 1;
+
+	unlink(path);
+	return 0;
+}
+
+/* a restarted wmbiff picks up the index the last one saved, and
+   one that was rewritten near the end resumes from a checkpoint */
+int test_mbox_index(void)
+{
+	mbox_t m;
+	char path[] = "/tmp/wmbiff-test-mboxidx.XXXXXX";
+	struct mbox_index *idx;
+	struct mbox_scan st;
+	struct stat sb;
+	off_t offset;
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+
+	/* 12000 messages of ~330 bytes: several checkpoints */
+	write_mbox(path, "w", 12000, 3);
+	memset(&m, 0, sizeof(m));
+	strcpy(m.label, "mboxidx");
+	sprintf(m.path, "mbox:%s", path);
+	mboxCreate(&m, m.path);
+	if (check_mbox(&m, 12000, 8000))
+		return 1;
+
+	/* as if restarted */
+	memset(&m, 0, sizeof(m));
+	sprintf(m.path, "mbox:%s", path);
+	mboxCreate(&m, m.path);
+	if (check_mbox(&m, 12000, 8000))
+		return 1;
+	if (m.u.mbox.index == NULL || m.u.mbox.index->count < 3) {
+		printf("FAILURE: index has no checkpoints\n");
+		return 1;
+	}
+
+	/* the last message gets marked read, growing the file */
+	write_mbox(path, "w", 11999, 3);
+	write_mbox(path, "a", 1, 1);
+	idx = mbox_index_load(path);
+	fd = open(path, O_RDONLY);
+	mbox_scan_init(&st);
+	if (idx == NULL || fstat(fd, &sb) != 0
+		|| mbox_index_resume(idx, fd, &sb, &offset, &st) != 0
+		|| offset < sb.st_size / 2 || offset >= sb.st_size - 512) {
+		printf("FAILURE: didn't resume from a checkpoint\n");
+		return 1;
+	}
+	close(fd);
+	mbox_index_free(idx);
+	if (check_mbox(&m, 12000, 7999))
+		return 1;
+
+	unlink(path);
+	return 0;
+}
+
+/* split into chunks as small as a line, the parallel scan must
+   still count exactly what a single pass does, wherever the chunk
+   boundaries fall: in headers, on blank lines, in bodies */
+int test_mbox_parallel(void)
+{
+	char path[] = "/tmp/wmbiff-test-mboxpar.XXXXXX";
+	static const off_t chunks[] = { 1, 37, 300, 4096, 100000 };
+	struct mbox_scan st, expect;
+	off_t offset;
+	FILE *f;
+	unsigned int i;
+	int threads;
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+
+	/* an X-IMAP pseudo message, unescaped "From " in bodies, long
+	   headers, runs of blank lines, and a last line with no newline */
+	f = fdopen(fd, "w");
+	fprintf(f, "From MAILER-DAEMON Thu Jan  1 00:00:00 2004\n"
+			"X-IMAP: 1 2\nStatus: RO\n\npseudo\n\n");
+	for (i = 0; i < 400; i++) {
+		int j;
+		fprintf(f, "From someone@example.org Thu Jan  1 00:00:00 2004\n");
+		for (j = 0; j < (int) (i % 7) * 3; j++)
+			fprintf(f, "X-Header-%d: some value\n", j);
+		if (i % 3 == 0)
+			fprintf(f, "Status: R\n");
+		fprintf(f, "\nbody of %d\n%s", i,
+				(i % 5 == 0) ? "\nFrom quoted\nStatus: RO\n\n\n" : "");
+		for (j = 0; j < (int) (i % 11); j++)
+			fprintf(f, "line %d of a longer body\n", j);
+		fprintf(f, "\n");
+	}
+	fprintf(f, "From last Thu Jan  1 00:00:00 2004");
+	fclose(f);
+
+	fd = open(path, O_RDONLY);
+	offset = 0;
+	mbox_scan_init(&st);
+	mbox_scan_fd(fd, &offset, &st, &expect);
+	/* the number of chunks depends on the number of threads */
+	for (threads = 2; threads <= 8; threads += 3) {
+		struct thread_pool *pool = thread_pool_create(threads);
+		for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+			struct mbox_scan counts;
+			mbox_parallel_chunk = chunks[i];
+			offset = 0;
+			mbox_scan_init(&st);
+			if (mbox_scan_fd_parallel(fd, &offset, &st, &counts, pool,
+									  NULL, NULL) < 0
+				|| mbox_scan_total(&counts) != mbox_scan_total(&expect)
+				|| mbox_scan_unread(&counts) != mbox_scan_unread(&expect)
+				|| counts.count_from != expect.count_from) {
+				printf("FAILURE: %d threads, chunks of %ld: %d/%d, "
+					   "not %d/%d\n", threads, (long) chunks[i],
+					   mbox_scan_unread(&counts), mbox_scan_total(&counts),
+					   mbox_scan_unread(&expect), mbox_scan_total(&expect));
+				return 1;
+			}
+		}
+		thread_pool_destroy(pool);
+	}
+	printf("SUCCESS: parallel scans count %d/%d\n",
+		   mbox_scan_unread(&expect), mbox_scan_total(&expect));
+	mbox_parallel_chunk = 8 * 1024 * 1024;
+	close(fd);
+	unlink(path);
+	return 0;
+}
+
+/* an mboxcl2 message: body is not escaped, and claimed is what
+   the Content-Length: header says, or -1 for the real length */
+static void write_mboxcl2(FILE * f, int read, const char *body,
+						  long claimed)
+{
+	fprintf(f, "From someone@example.org Thu Jan  1 00:00:00 2004\n"
+			"Content-Length: %ld\n%s\n%s\n",
+			(claimed < 0) ? (long) strlen(body) : claimed,
+			read ? "Status: RO\n" : "", body);
+}
+int test_mbox_content_length(void)
+{
+	mbox_t m;
+	char path[] = "/tmp/wmbiff-test-mboxcl.XXXXXX";
+	char *big;
+	FILE *f;
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+
+	/* bodies quoting whole messages, which a line scan would count */
+	f = fdopen(fd, "w");
+	write_mboxcl2(f, 1, "hi\n\nFrom me Thu Jan  1 00:00:00 2004\n"
+				  "Status: RO\n\nquoted\n", -1);
+	write_mboxcl2(f, 0, "\nFrom you Thu Jan  1 00:00:00 2004\n\n", -1);
+	/* larger than a read block, so the landing is read separately */
+	big = malloc(600000);
+	memset(big, 'x', 600000 - 2);
+	big[600000 - 2] = '\n';
+	big[600000 - 1] = '\0';
+	memcpy(big + 1000, "\n\nFrom big\n\n", 12);
+	write_mboxcl2(f, 0, big, -1);
+	free(big);
+	/* a length that lands mid-body is ignored */
+	write_mboxcl2(f, 1, "line one\nline two\n", 3);
+	write_mboxcl2(f, 0, "last\n\nFrom x\n", -1);
+	fclose(f);
+
+	memset(&m, 0, sizeof(m));
+	strcpy(m.label, "mboxcl2");
+	sprintf(m.path, "mbox::C:%s", path);
+	mboxCreate(&m, m.path);
+	if (strcmp(m.path, path) != 0) {
+		printf("FAILURE: mbox::C: path parsed as '%s'\n", m.path);
+		return 1;
+	}
+	if (check_mbox(&m, 5, 3))
+		return 1;
+
+	/* without the flag, the quoted messages count too */
+	memset(&m, 0, sizeof(m));
+	sprintf(m.path, "mbox:%s", path);
+	mboxCreate(&m, m.path);
+	if (check_mbox(&m, 9, 6))
+		return 1;
+
+	unlink(path);
+	return 0;
+}
+
+/* a mailbox rewritten to the same size within the same second is
+   seen to have changed; one that was only read isn't, and its
+   atime is as it was. */
+int test_file_stamp(void)
+{
+	mbox_t m;
+	char path[] = "/tmp/wmbiff-test-stamp.XXXXXX";
+	struct timespec old[2];
+	struct stat st;
+	FILE *f;
+	int fd = mkstemp(path);
+
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+	memset(&m, 0, sizeof(m));
+	strcpy(m.label, "stamp");
+	sprintf(m.path, "mbox:%s", path);
+	mboxCreate(&m, m.path);
+
+	f = fopen(path, "w");
+	fprintf(f, "From a@b Mon Jan  1 00:00:00 2001\nX-Seen: RO\n\nhi\n");
+	fclose(f);
+	old[0].tv_sec = 1000000000;
+	old[0].tv_nsec = 0;
+	old[1].tv_sec = 0;
+	old[1].tv_nsec = UTIME_OMIT;
+	(void) utimensat(AT_FDCWD, path, old, 0);
+	if (check_mbox(&m, 1, 1))
+		return 1;
+	if (stat(path, &st) != 0 || st.st_atime != 1000000000) {
+		printf("FAILURE: reading %s changed its atime\n", path);
+		return 1;
+	}
+	if (fileHasChanged(path, &m.u.mbox.stamp, NULL)) {
+		printf("FAILURE: %s changed by being read\n", path);
+		return 1;
+	}
+
+#if defined(HAVE_STATX) || defined(HAVE_STRUCT_STAT_ST_MTIM)
+	f = fopen(path, "w");
+	fprintf(f, "From a@b Mon Jan  1 00:00:00 2001\nStatus: RO\n\nhi\n");
+	fclose(f);
+	if (check_mbox(&m, 1, 0))
+		return 1;
+#endif
+
+	unlink(path);
+	return 0;
+}
+
+/* stamps taken as a batch are the ones file_stamp() would take, and
+   are what mailboxes are then checked against */
+int test_stat_batch(void)
+{
+	mbox_t m, n;
+	char path[] = "/tmp/wmbiff-test-batch.XXXXXX";
+	char other[] = "/tmp/wmbiff-test-batch.XXXXXX";
+	char missing[64];
+	struct prefetched_stamp ps[3];
+	struct file_stamp fs;
+	struct stat_batch b;
+
+	if (mkstemp(path) < 0 || mkstemp(other) < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	sprintf(missing, "%s.missing", path);
+	write_mbox(path, "w", 2, 0);
+
+	stat_batch_init(&b);
+	/* the remote ones are taken together */
+	stat_batch_add(&b, path, 1, &ps[0]);
+	stat_batch_add(&b, other, 1, &ps[1]);
+	stat_batch_add(&b, missing, 0, &ps[2]);
+	stat_batch_run(&b, NULL);
+	stat_batch_free(&b);
+	if (!ps[0].ready || ps[0].error != 0 || file_stamp(path, &fs) != 0
+		|| file_stamp_changed(&ps[0].stamp, &fs) || !ps[1].ready
+		|| ps[1].error != 0 || !ps[2].ready || ps[2].error != ENOENT) {
+		printf("FAILURE: batch of stamps is wrong\n");
+		return 1;
+	}
+	if (file_stamp_prefetched(&ps[2], missing, &fs) == 0
+		|| errno != ENOENT || ps[2].ready) {
+		printf("FAILURE: prefetched error not passed on\n");
+		return 1;
+	}
+
+	memset(&m, 0, sizeof(m));
+	strcpy(m.label, "batch");
+	sprintf(m.path, "mbox:%s", path);
+	mboxCreate(&m, m.path);
+	memset(&n, 0, sizeof(n));
+	strcpy(n.label, "batch2");
+	sprintf(n.path, "mbox:%s", other);
+	mboxCreate(&n, n.path);
+	if (m.prefetch == NULL || check_mbox(&m, 2, 2)
+		|| check_mbox(&n, 0, 0))
+		return 1;
+	write_mbox(path, "a", 1, 0);
+	stat_batch_init(&b);
+	m.prefetch(&m, &b);
+	n.prefetch(&n, &b);
+	stat_batch_run(&b, NULL);
+	stat_batch_free(&b);
+	if (check_mbox(&m, 3, 3) || check_mbox(&n, 0, 0))
+		return 1;
+	if (m.u.mbox.prefetch.ready || n.u.mbox.prefetch.ready) {
+		printf("FAILURE: prefetched stamps not used up\n");
+		return 1;
+	}
+
+	unlink(path);
+	unlink(other);
+	return 0;
+}
+
+/* a mailbox being delivered to isn't scanned until the delivery is
+   over, then only once */
+int test_mbox_delivery(void)
+{
+	mbox_t m;
+	char path[] = "/tmp/wmbiff-test-deliver.XXXXXX";
+	char lock[64];
+	int fd = mkstemp(path), locked[2], done[2];
+	pid_t pid;
+	char c;
+
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+	memset(&m, 0, sizeof(m));
+	strcpy(m.label, "deliver");
+	sprintf(m.path, "mbox:%s", path);
+	mboxCreate(&m, m.path);
+	write_mbox(path, "w", 3, 3);
+	if (check_mbox(&m, 3, 2))
+		return 1;
+
+	/* procmail's way */
+	sprintf(lock, "%s.lock", path);
+	fd = open(lock, O_WRONLY | O_CREAT | O_EXCL, 0444);
+	close(fd);
+	write_mbox(path, "a", 1, 0);
+	m.prevtime = 1;
+	if (check_mbox(&m, 3, 2))
+		return 1;
+	if (m.prevtime != 0) {
+		printf("FAILURE: %s not looked at again soon\n", path);
+		return 1;
+	}
+	unlink(lock);
+	if (check_mbox(&m, 4, 3))
+		return 1;
+
+	/* postfix's: an fcntl lock, which has to be taken by
+	   another process to be seen */
+	if (pipe(locked) != 0 || pipe(done) != 0) {
+		perror("pipe");
+		return 1;
+	}
+	if ((pid = fork()) == 0) {
+		struct flock fl;
+		close(done[1]);
+		memset(&fl, 0, sizeof(fl));
+		fl.l_type = F_WRLCK;
+		fl.l_whence = SEEK_SET;
+		fd = open(path, O_RDWR);
+		if (fcntl(fd, F_SETLKW, &fl) != 0)
+			_exit(1);
+		(void) write(locked[1], "l", 1);
+		(void) read(done[0], &c, 1);
+		_exit(0);
+	}
+	close(done[0]);
+	if (pid < 0 || read(locked[0], &c, 1) != 1) {
+		printf("FAILURE: couldn't lock %s\n", path);
+		return 1;
+	}
+	write_mbox(path, "a", 1, 0);
+	if (check_mbox(&m, 4, 3))
+		return 1;
+	close(done[1]);
+	(void) waitpid(pid, NULL, 0);
+	close(locked[0]);
+	close(locked[1]);
+	if (check_mbox(&m, 5, 4))
+		return 1;
+
+	unlink(path);
+	return 0;
+}
+
+static void touch(const char *dir, const char *sub, const char *name)
+{
+	char path[256];
+	int fd;
+	path_printf(path, sizeof(path), "%s/%s/%s", dir, sub, name);
+	fd = open(path, O_WRONLY | O_CREAT, 0600);
+	if (fd >= 0)
+		close(fd);
+}
+
+static void maildir_rename(const char *dir, const char *from,
+						   const char *to)
+{
+	char a[256], b[256];
+	path_printf(a, sizeof(a), "%s/%s", dir, from);
+	path_printf(b, sizeof(b), "%s/%s", dir, to);
+	if (rename(a, b) != 0)
+		perror(a);
+}
+
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+/* what a plain scan of buf counts, including a last partial line */
+static void count_plain(const char *buf, size_t len, int *total,
+						int *unread)
+{
+	struct mbox_scan st;
+	size_t used;
+	mbox_scan_init(&st);
+	used = mbox_scan_lines(&st, buf, len);
+	if (used < len)
+		mbox_scan_line(&st, buf + used, len - used);
+	*total = mbox_scan_total(&st);
+	*unread = mbox_scan_unread(&st);
+}
+
+static void gz_member(const char *path, const char *mode, const char *buf,
+					  size_t len)
+{
+	gzFile g = gzopen(path, mode);
+	gzwrite(g, buf, (unsigned) len);
+	gzclose(g);
+}
+
+/* a compressed mbox counts the same as the plain one, and one that
+   was appended to, even in the middle of a line, is only
+   decompressed from the end of what was there before */
+int test_mbox_compressed(void)
+{
+	mbox_t m;
+	char plain[] = "/tmp/wmbiff-test-plain.XXXXXX";
+	char path[] = "/tmp/wmbiff-test-mboxgz.XXXXXX";
+	struct mbox_index *idx;
+	struct mbox_scan st;
+	struct stat sb;
+	off_t offset;
+	char *buf;
+	size_t len, cut;
+	int total, unread, fd;
+
+	if ((fd = mkstemp(plain)) < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+	if ((fd = mkstemp(path)) < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+	write_mbox(plain, "w", 3000, 3);
+	fd = open(plain, O_RDONLY);
+	fstat(fd, &sb);
+	len = (size_t) sb.st_size;
+	buf = malloc(len);
+	if (read(fd, buf, len) != (ssize_t) len) {
+		perror(plain);
+		return 1;
+	}
+	close(fd);
+	/* in the middle of a body line */
+	cut = (size_t) (strstr(buf + len / 2, "a much longer") + 10 - buf);
+
+	/* two gzip members, the first ending mid-line */
+	gz_member(path, "wb", buf, cut / 2);
+	gz_member(path, "ab", buf + cut / 2, len - cut / 2);
+	memset(&m, 0, sizeof(m));
+	strcpy(m.label, "mboxgz");
+	sprintf(m.path, "mbox:%s", path);
+	mboxCreate(&m, m.path);
+	if (check_mbox(&m, 3000, 2000))
+		return 1;
+
+	/* a member that ends in the middle of a line is resumed from */
+	gz_member(path, "wb", buf, cut);
+	memset(&m, 0, sizeof(m));
+	sprintf(m.path, "mbox:%s", path);
+	mboxCreate(&m, m.path);
+	count_plain(buf, cut, &total, &unread);
+	if (check_mbox(&m, total, unread))
+		return 1;
+	gz_member(path, "ab", buf + cut, len - cut);
+	idx = mbox_index_load(path);
+	fd = open(path, O_RDONLY);
+	mbox_scan_init(&st);
+	if (idx == NULL || fstat(fd, &sb) != 0
+		|| mbox_index_resume(idx, fd, &sb, &offset, &st) != 0
+		|| offset == 0 || !st.resume_mid_line) {
+		printf("FAILURE: didn't resume %s mid-line\n", path);
+		return 1;
+	}
+	close(fd);
+	mbox_index_free(idx);
+	if (check_mbox(&m, 3000, 2000))
+		return 1;
+
+#if defined(HAVE_LZMA_H) && defined(HAVE_LIBLZMA)
+	{
+		size_t size = len + 4096, out = 0;
+		uint8_t *xz = malloc(size);
+		FILE *f = fopen(path, "w");
+		lzma_easy_buffer_encode(6, LZMA_CHECK_CRC64, NULL,
+								(const uint8_t *) buf, cut, xz, &out, size);
+		lzma_easy_buffer_encode(6, LZMA_CHECK_CRC64, NULL,
+								(const uint8_t *) buf + cut, len - cut, xz,
+								&out, size);
+		fwrite(xz, 1, out, f);
+		fclose(f);
+		free(xz);
+		memset(&m, 0, sizeof(m));
+		sprintf(m.path, "mbox:%s", path);
+		mboxCreate(&m, m.path);
+		if (check_mbox(&m, 3000, 2000))
+			return 1;
+	}
+#endif
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+	{
+		/* many small frames, as seekable zstd writes them */
+		size_t size = ZSTD_compressBound(len), out = 0, at;
+		char *zst = malloc(size);
+		FILE *f = fopen(path, "w");
+		for (at = 0; at < len; at += 7777) {
+			size_t n = (len - at < 7777) ? len - at : 7777;
+			out += ZSTD_compress(zst + out, size - out, buf + at, n, 3);
+		}
+		fwrite(zst, 1, out, f);
+		fclose(f);
+		free(zst);
+		memset(&m, 0, sizeof(m));
+		sprintf(m.path, "mbox:%s", path);
+		mboxCreate(&m, m.path);
+		if (check_mbox(&m, 3000, 2000))
+			return 1;
+	}
+#endif
+
+	free(buf);
+	unlink(plain);
+	unlink(path);
 	return 0;
 }
+#endif
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* wait a moment for events, and handle them */
+static int filewatch_wait(void)
+{
+	struct pollfd p;
+	p.fd = filewatch_fd();
+	p.events = POLLIN;
+	if (poll(&p, 1, 1000) <= 0)
+		return 0;
+	return filewatch_dispatch();
+}
+
+/* changes are heard about without stat()ing: an append, a
+   replacement renamed into place, a message delivered to a
+   directory; and a mailbox that was deleted is polled until it
+   comes back. */
+int test_filewatch(void)
+{
+	mbox_t m, d;
+	char path[] = "/tmp/wmbiff-test-watch.XXXXXX";
+	char dir[] = "/tmp/wmbiff-test-watchdir.XXXXXX";
+	char other[64], msg[64];
+	int fd = mkstemp(path);
+	if (fd < 0 || mkdtemp(dir) == NULL) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+
+	filewatch_init();
+	if (filewatch_fd() < 0) {
+		printf("SKIPPED: no inotify\n");
+		unlink(path);
+		rmdir(dir);
+		return 0;
+	}
+
+	memset(&m, 0, sizeof(m));
+	strcpy(m.label, "watched");
+	sprintf(m.path, "mbox:%s", path);
+	mboxCreate(&m, m.path);
+	if (!m.watched) {
+		/* e.g., /tmp on NFS */
+		printf("SKIPPED: %s can't be watched\n", path);
+		unlink(path);
+		rmdir(dir);
+		return 0;
+	}
+	write_mbox(path, "w", 2, 0);
+	if (check_mbox(&m, 2, 2))
+		return 1;
+	(void) filewatch_wait();	/* our own write */
+
+	m.prevtime = 1;
+	write_mbox(path, "a", 1, 0);
+	if (filewatch_wait() != 1 || m.prevtime != 0) {
+		printf("FAILURE: append to %s not noticed\n", path);
+		return 1;
+	}
+	if (check_mbox(&m, 3, 3))
+		return 1;
 
+	/* replaced the way mail readers do it */
+	sprintf(other, "%s.new", path);
+	write_mbox(other, "w", 1, 1);
+	m.prevtime = 1;
+	if (rename(other, path) != 0) {
+		perror("rename");
+		return 1;
+	}
+	(void) filewatch_wait();
+	if (m.prevtime != 0 || !m.watched) {
+		printf("FAILURE: replaced %s not watched\n", path);
+		return 1;
+	}
+	m.prevtime = 1;
+	write_mbox(path, "a", 1, 0);
+	if (filewatch_wait() != 1 || m.prevtime != 0) {
+		printf("FAILURE: append to replaced %s not noticed\n", path);
+		return 1;
+	}
+	if (check_mbox(&m, 2, 1))
+		return 1;
+
+	/* a writer that hasn't closed the file yet isn't done */
+	fd = open(path, O_WRONLY | O_APPEND);
+	if (write(fd, "From b@c Mon Jan  1 00:00:00 2001\n", 34) != 34) {
+		perror(path);
+		return 1;
+	}
+	(void) filewatch_wait();
+	if (check_mbox(&m, 2, 1))
+		return 1;
+	if (write(fd, "Subject: hi\n\nthere\n", 19) != 19) {
+		perror(path);
+		return 1;
+	}
+	close(fd);
+	(void) filewatch_wait();
+	if (check_mbox(&m, 3, 2))
+		return 1;
+
+	/* deleted, then delivered to again */
+	unlink(path);
+	(void) filewatch_wait();
+	if (m.watched) {
+		printf("FAILURE: deleted %s still watched\n", path);
+		return 1;
+	}
+	write_mbox(path, "w", 1, 0);
+	if (check_mbox(&m, 1, 1))
+		return 1;
+	if (!m.watched) {
+		printf("FAILURE: recreated %s not watched again\n", path);
+		return 1;
+	}
+
+	/* a directory, as for maildir/new */
+	memset(&d, 0, sizeof(d));
+	d.prevtime = 1;
+	if (filewatch_add(&d, dir, FILEWATCH_ADDED | FILEWATCH_REMOVED,
+					  NULL) != 0 || !d.watched) {
+		printf("FAILURE: can't watch %s\n", dir);
+		return 1;
+	}
+	sprintf(msg, "%s/1234.5678.host", dir);
+	fd = open(msg, O_WRONLY | O_CREAT, 0600);
+	close(fd);
+	if (filewatch_wait() != 1 || d.prevtime != 0) {
+		printf("FAILURE: delivery to %s not noticed\n", dir);
+		return 1;
+	}
+	printf("SUCCESS: changes to %s and %s heard about\n", path, dir);
+
+	filewatch_remove(&m);
+	filewatch_remove(&d);
+	unlink(msg);
+	rmdir(dir);
+	unlink(path);
+	return 0;
+}
+
+/* once counted, a watched maildir is kept up to date from events
+   alone: deliveries, moves from new to cur, flag changes and
+   deletions, but not dot files. */
+int test_maildir_events(void)
+{
+	mbox_t m;
+	char dir[] = "/tmp/wmbiff-test-maildir.XXXXXX";
+	char path[256];
+	const char *sub[] = { "new", "cur", "tmp" };
+	time_t synced_at;
+	int i;
+
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	for (i = 0; i < 3; i++) {
+		path_printf(path, sizeof(path), "%s/%s", dir, sub[i]);
+		mkdir(path, 0700);
+	}
+	touch(dir, "new", "1.a.host");
+	touch(dir, "cur", "2.b.host:2,S");
+	touch(dir, "cur", "3.c.host:2,RS");
+
+	memset(&m, 0, sizeof(m));
+	strcpy(m.label, "maildir");
+	sprintf(m.path, "maildir:%s", dir);
+	maildirCreate(&m, m.path);
+	if (check_mbox(&m, 3, 1))
+		return 1;
+	if (!m.watched) {
+		printf("SKIPPED: %s can't be watched\n", dir);
+		goto cleanup;
+	}
+	synced_at = m.u.maildir.synced_at;
+
+	/* delivered the maildir way, through tmp */
+	touch(dir, "tmp", "4.d.host");
+	maildir_rename(dir, "tmp/4.d.host", "new/4.d.host");
+	touch(dir, "new", ".hidden");
+	/* read, then flagged */
+	maildir_rename(dir, "new/1.a.host", "cur/1.a.host:2,S");
+	maildir_rename(dir, "cur/1.a.host:2,S", "cur/1.a.host:2,FS");
+	/* deleted */
+	path_printf(path, sizeof(path), "%s/cur/3.c.host:2,RS", dir);
+	unlink(path);
+	while (filewatch_wait() > 0);
+	if (check_mbox(&m, 3, 1))
+		return 1;
+	if (m.u.maildir.synced_at != synced_at || !m.u.maildir.synced) {
+		printf("FAILURE: %s was counted again\n", dir);
+		return 1;
+	}
+
+	/* listed by a mail reader, but not read */
+	touch(dir, "cur", "5.e.host:2,");
+	while (filewatch_wait() > 0);
+	if (check_mbox(&m, 4, 2))
+		return 1;
+	if (m.u.maildir.counts.flagged != 1) {
+		printf("FAILURE: %s: expected 1 flagged, got %d\n", dir,
+			   m.u.maildir.counts.flagged);
+		return 1;
+	}
+
+	/* an event that comes in while new/ and cur/ are being read
+	   may be in the count already: count again instead */
+	m.u.maildir.counting = 1;
+	touch(dir, "new", "6.f.host");
+	while (filewatch_wait() > 0);
+	m.u.maildir.counting = 0;
+	if (m.u.maildir.synced) {
+		printf("FAILURE: %s: event during a count was applied\n", dir);
+		return 1;
+	}
+	if (check_mbox(&m, 5, 3))
+		return 1;
+
+	/* a missed event means counting again */
+	m.u.maildir.counts.new += 5;
+	m.u.maildir.synced = 0;
+	if (check_mbox(&m, 5, 3))
+		return 1;
+	if (!m.u.maildir.synced) {
+		printf("FAILURE: %s was not counted again\n", dir);
+		return 1;
+	}
+	printf("SUCCESS: %s kept up to date from events\n", dir);
+
+  cleanup:
+	filewatch_remove(&m);
+	{
+		const char *left[] = { "new/1.a.host", "new/.hidden",
+			"new/4.d.host", "cur/1.a.host:2,FS", "cur/2.b.host:2,S",
+			"cur/3.c.host:2,RS", "cur/5.e.host:2,"
+		};
+		for (i = 0; i < 7; i++) {
+			path_printf(path, sizeof(path), "%s/%s", dir, left[i]);
+			unlink(path);
+		}
+	}
+	for (i = 0; i < 3; i++) {
+		path_printf(path, sizeof(path), "%s/%s", dir, sub[i]);
+		rmdir(path);
+	}
+	rmdir(dir);
+	return 0;
+}
+#endif
+
+
+static void make_maildir(const char *dir)
+{
+	const char *sub[] = { "new", "cur", "tmp" };
+	char path[256];
+	int i;
+	mkdir(dir, 0700);
+	for (i = 0; i < 3; i++) {
+		path_printf(path, sizeof(path), "%s/%s", dir, sub[i]);
+		mkdir(path, 0700);
+	}
+}
+
+static void remove_maildir(const char *dir)
+{
+	const char *sub[] = { "new", "cur", "tmp" };
+	char path[512];
+	int i;
+	for (i = 0; i < 3; i++) {
+		DIR *D;
+		struct dirent *de;
+		path_printf(path, sizeof(path), "%s/%s", dir, sub[i]);
+		D = opendir(path);
+		while (D != NULL && (de = readdir(D)) != NULL) {
+			if (de->d_name[0] != '.') {
+				path_printf(path, sizeof(path), "%s/%s/%s", dir, sub[i], de->d_name);
+				unlink(path);
+			}
+		}
+		if (D != NULL)
+			closedir(D);
+		path_printf(path, sizeof(path), "%s/%s", dir, sub[i]);
+		rmdir(path);
+	}
+	rmdir(dir);
+}
+
+/* a maildir++ adds up its folders, including ones created later,
+   and ignores dot files and directories that aren't folders */
+int test_maildirpp(void)
+{
+	mbox_t m;
+	char dir[] = "/tmp/wmbiff-test-maildirpp.XXXXXX";
+	char path[256];
+	const char *folders[] = { "", "/.Work", "/.Lists.wmbiff", "/.New" };
+	struct msglst *h;
+	struct timespec old[2];
+	struct stat st;
+	int i, fd;
+
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	for (i = 0; i < 3; i++) {
+		path_printf(path, sizeof(path), "%s%s", dir, folders[i]);
+		make_maildir(path);
+	}
+	path_printf(path, sizeof(path), "%s/.cache", dir);
+	mkdir(path, 0700);
+	path_printf(path, sizeof(path), "%s/.subscriptions", dir);
+	fd = open(path, O_WRONLY | O_CREAT, 0600);
+	close(fd);
+	touch(dir, "new", "1.a.host");
+	touch(dir, "cur", "2.b.host:2,S");
+	touch(dir, ".Work/cur", "3.c.host:2,");
+	touch(dir, ".Work/cur", "4.d.host:2,FS");
+	touch(dir, ".Lists.wmbiff/cur", "5.e.host:2,RS");
+
+	/* on several threads, if there are any */
+	scan_threads = 3;
+	memset(&m, 0, sizeof(m));
+	strcpy(m.label, "mdpp");
+	sprintf(m.path, "maildir++:%s", dir);
+	maildirppCreate(&m, m.path);
+	if (strcmp(m.path, dir) != 0) {
+		printf("FAILURE: maildir++: path parsed as '%s'\n", m.path);
+		return 1;
+	}
+	if (check_mbox(&m, 5, 2))
+		return 1;
+
+	/* one folder changed, and one was added; reading the one that
+	   changed leaves its atime as it was */
+	touch(dir, ".Work/new", "6.f.host");
+	old[0].tv_sec = 1000000000;
+	old[0].tv_nsec = 0;
+	old[1].tv_sec = 0;
+	old[1].tv_nsec = UTIME_OMIT;
+	path_printf(path, sizeof(path), "%s/.Work/new", dir);
+	(void) utimensat(AT_FDCWD, path, old, 0);
+	path_printf(path, sizeof(path), "%s%s", dir, folders[3]);
+	make_maildir(path);
+	touch(dir, ".New/new", "7.g.host");
+	if (check_mbox(&m, 7, 4))
+		return 1;
+	path_printf(path, sizeof(path), "%s/.Work/new", dir);
+	if (stat(path, &st) != 0 || st.st_atime != 1000000000) {
+		printf("FAILURE: reading %s changed its atime\n", path);
+		return 1;
+	}
+
+	h = m.getHeaders(&m);
+	if (h == NULL || strcmp(h->from, "INBOX") != 0
+		|| h->next == NULL || strcmp(h->next->from, "New") != 0
+		|| h->next->next == NULL
+		|| strcmp(h->next->next->from, "Work") != 0
+		|| strcmp(h->next->next->subj, "2 unread of 3") != 0) {
+		printf("FAILURE: maildir++: unexpected folder list\n");
+		return 1;
+	}
+	m.releaseHeaders(&m, h);
+	printf("SUCCESS: maildir++ %s\n", dir);
+	scan_threads = 1;
+
+	for (i = 3; i > 0; i--) {
+		path_printf(path, sizeof(path), "%s%s", dir, folders[i]);
+		remove_maildir(path);
+	}
+	path_printf(path, sizeof(path), "%s/.cache", dir);
+	rmdir(path);
+	path_printf(path, sizeof(path), "%s/.subscriptions", dir);
+	unlink(path);
+	remove_maildir(dir);
+	return 0;
+}
+
+
+static void write_file(const char *dir, const char *name,
+					   const char *contents)
+{
+	char path[256];
+	FILE *f;
+	path_printf(path, sizeof(path), "%s/%s", dir, name);
+	f = fopen(path, "w");
+	fputs(contents, f);
+	fclose(f);
+}
+
+/* an MH folder's unseen messages come from .mh_sequences, counting
+   only those that exist */
+int test_mh(void)
+{
+	mbox_t m;
+	char dir[] = "/tmp/wmbiff-test-mh.XXXXXX";
+	char path[256];
+	const char *files[] = { "1", "2", "3", "4", "5", ",3", "6",
+		".mh_sequences"
+	};
+	int i;
+
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	for (i = 0; i < 6; i++)
+		write_file(dir, files[i], "Subject: hi\n\nbody\n");
+	write_file(dir, ".mh_sequences", "cur: 5\nunseen: 2-4 9\n");
+
+	memset(&m, 0, sizeof(m));
+	strcpy(m.label, "mh");
+	sprintf(m.path, "mh:%s", dir);
+	mhCreate(&m, m.path);
+	if (check_mbox(&m, 5, 3))
+		return 1;
+
+	/* a long sequence continues on the next line */
+	write_file(dir, "6", "Subject: hi\n\nbody\n");
+	write_file(dir, ".mh_sequences", "unseen: 2-4\n 6\ncur: 1\n");
+	if (check_mbox(&m, 6, 4))
+		return 1;
+
+	/* or, written by something else, all on one line of any length */
+	{
+		char seq[2048] = "unseen:";
+		for (i = 0; i < 300; i++)
+			strcat(seq, " 100");
+		strcat(seq, " 2-4 6\n");
+		write_file(dir, ".mh_sequences", seq);
+		if (check_mbox(&m, 6, 4))
+			return 1;
+	}
+
+	/* all read */
+	write_file(dir, ".mh_sequences", "cur: 6\n");
+	if (check_mbox(&m, 6, 0))
+		return 1;
+
+	filewatch_remove(&m);
+	free(m.u.mh.msgs);
+	for (i = 0; i < 8; i++) {
+		path_printf(path, sizeof(path), "%s/%s", dir, files[i]);
+		unlink(path);
+	}
+
+	/* an empty folder is listed once, like any other */
+	memset(&m, 0, sizeof(m));
+	strcpy(m.label, "mh");
+	sprintf(m.path, "mh:%s", dir);
+	mhCreate(&m, m.path);
+	if (check_mbox(&m, 0, 0))
+		return 1;
+	m.u.mh.nmsgs = 5;			/* not looked at again, so it stays */
+	if (check_mbox(&m, 5, 0))
+		return 1;
+
+	filewatch_remove(&m);
+	free(m.u.mh.msgs);
+	rmdir(dir);
+	return 0;
+}
 
 int print_info(UNUSED(void *state))
 {
 	return (0);
 }
 const char *certificate_filename = NULL;
+int scan_threads = 1;
 const char *tls = "NORMAL";
 int SkipCertificateCheck = 0;
 int exists(UNUSED(const char *filename))
@@ -440,7 +2422,12 @@ int main(UNUSED(int argc), UNUSED(char *argv[]))
 		exit(EXIT_FAILURE);
 	}
 
-	if (test_getline_from_buffer()) {
+	if (test_tlscomm_lines()) {
+		printf("SOME TESTS FAILED!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (test_imap_response()) {
 		printf("SOME TESTS FAILED!\n");
 		exit(EXIT_FAILURE);
 	}
@@ -450,10 +2437,60 @@ int main(UNUSED(int argc), UNUSED(char *argv[]))
 		exit(EXIT_FAILURE);
 	}
 
+	/* keep mbox indexes and imap headers out of the real cache
+	   directory */
+	if (mkdtemp(cache_dir) == NULL
+		|| setenv("XDG_CACHE_HOME", cache_dir, 1) != 0) {
+		perror(cache_dir);
+		exit(EXIT_FAILURE);
+	}
+	if (test_mbox()) {
+		printf("SOME TESTS FAILED!\n");
+		exit(EXIT_FAILURE);
+	}
+	if (test_mbox_index()) {
+		printf("SOME TESTS FAILED!\n");
+		exit(EXIT_FAILURE);
+	}
+	if (test_mbox_parallel()) {
+		printf("SOME TESTS FAILED!\n");
+		exit(EXIT_FAILURE);
+	}
+	if (test_mbox_content_length()) {
+		printf("SOME TESTS FAILED!\n");
+		exit(EXIT_FAILURE);
+	}
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+	if (test_mbox_compressed()) {
+		printf("SOME TESTS FAILED!\n");
+		exit(EXIT_FAILURE);
+	}
+#endif
+	if (test_mbox_delivery() || test_file_stamp() || test_stat_batch()) {
+		printf("SOME TESTS FAILED!\n");
+		exit(EXIT_FAILURE);
+	}
+#ifdef HAVE_SYS_INOTIFY_H
+	if (test_filewatch() || test_maildir_events()) {
+		printf("SOME TESTS FAILED!\n");
+		exit(EXIT_FAILURE);
+	}
+#endif
+	if (test_maildirpp() || test_mh()) {
+		printf("SOME TESTS FAILED!\n");
+		exit(EXIT_FAILURE);
+	}
 	if (test_sock_connect()) {
 		printf("SOME TESTS FAILED!\n");
 		exit(EXIT_FAILURE);
 	}
+	if (test_imap_pool() || test_imap_idle() || test_imap_notify()
+		|| test_imap_status_batch() || test_imap_headers()
+		|| test_imap_header_cache() || test_imap_condstore()) {
+		printf("SOME TESTS FAILED!\n");
+		exit(EXIT_FAILURE);
+	}
+	remove_cache_dir();
 
 	printf("Success! on all tests.\n");
 	exit(EXIT_SUCCESS);
@@ -0,0 +1,193 @@
+/* threadPool.c - a few worker threads for jobs that can be split
+   into independent parts.
+
+   The workers sleep on a condition variable until thread_pool_run
+   hands them a batch; each then takes job numbers from a shared
+   counter until there are none left.  Only one batch runs at a
+   time. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+#include <pthread.h>
+#define USE_THREADS
+#endif
+
+#include "threadPool.h"
+
+#ifdef USE_DMALLOC
+#include <dmalloc.h>
+#endif
+
+#ifdef USE_THREADS
+
+struct thread_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work;		/* a batch was started, or shutdown */
+	pthread_cond_t done;		/* the last job of a batch finished */
+	pthread_t *threads;
+	int nthreads;				/* not counting the caller */
+	int shutdown;
+
+	/* the batch being run */
+	void (*job) (void *data, int i);
+	void *data;
+	int jobs;
+	int next;					/* next job to hand out */
+	int running;				/* handed out, not yet finished */
+	unsigned long batch;		/* to tell batches apart */
+};
+
+/* take jobs from the current batch until it runs out; called with
+   the lock held, returns with it held. */
+static void work_on_batch(struct thread_pool *pool)
+{
+	while (pool->next < pool->jobs) {
+		int i = pool->next++;
+		pool->running++;
+		pthread_mutex_unlock(&pool->lock);
+		pool->job(pool->data, i);
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->running == 0 && pool->next == pool->jobs)
+			pthread_cond_broadcast(&pool->done);
+	}
+}
+
+static void *worker(void *arg)
+{
+	struct thread_pool *pool = arg;
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->shutdown && pool->batch == seen)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		if (pool->shutdown)
+			break;
+		seen = pool->batch;
+		work_on_batch(pool);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+struct thread_pool *thread_pool_create(int threads)
+{
+	struct thread_pool *pool;
+
+	if (threads < 2)
+		return NULL;
+	pool = calloc(1, sizeof(struct thread_pool));
+	if (pool == NULL)
+		return NULL;
+	pool->threads = calloc(threads - 1, sizeof(pthread_t));
+	if (pool->threads == NULL) {
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	for (pool->nthreads = 0; pool->nthreads < threads - 1;
+		 pool->nthreads++) {
+		if (pthread_create(&pool->threads[pool->nthreads], NULL, worker,
+						   pool) != 0)
+			break;
+	}
+	if (pool->nthreads == 0) {
+		thread_pool_destroy(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+void thread_pool_destroy(struct thread_pool *pool)
+{
+	int i;
+
+	if (pool == NULL)
+		return;
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
+
+int thread_pool_size(const struct thread_pool *pool)
+{
+	return (pool != NULL) ? pool->nthreads + 1 : 1;
+}
+
+void thread_pool_run(struct thread_pool *pool, int jobs,
+					 void (*job) (void *data, int i), void *data)
+{
+	int i;
+
+	if (pool == NULL || jobs < 2) {
+		for (i = 0; i < jobs; i++)
+			job(data, i);
+		return;
+	}
+	pthread_mutex_lock(&pool->lock);
+	pool->job = job;
+	pool->data = data;
+	pool->jobs = jobs;
+	pool->next = 0;
+	pool->running = 0;
+	pool->batch++;
+	pthread_cond_broadcast(&pool->work);
+	work_on_batch(pool);
+	while (pool->running > 0)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pool->jobs = 0;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+#else							/* USE_THREADS */
+
+struct thread_pool *thread_pool_create(int threads)
+{
+	(void) threads;
+	return NULL;
+}
+
+void thread_pool_destroy(struct thread_pool *pool)
+{
+	(void) pool;
+}
+
+int thread_pool_size(const struct thread_pool *pool)
+{
+	(void) pool;
+	return 1;
+}
+
+void thread_pool_run(struct thread_pool *pool, int jobs,
+					 void (*job) (void *data, int i), void *data)
+{
+	int i;
+	(void) pool;
+	for (i = 0; i < jobs; i++)
+		job(data, i);
+}
+
+#endif							/* USE_THREADS */
+
+/* vim:set ts=4: */
+/*
+ * Local Variables:
+ * tab-width: 4
+ * c-indent-level: 4
+ * c-basic-offset: 4
+ * End:
+ */
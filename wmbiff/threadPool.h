@@ -0,0 +1,24 @@
+/* threadPool.h - a few worker threads for jobs that can be split
+   into independent parts.  Without pthreads, the jobs simply run
+   one after another in the caller. */
+
+#ifndef THREADPOOL
+#define THREADPOOL
+
+struct thread_pool;
+
+/* a pool of up to threads workers, counting the caller, which
+   always takes part; returns null if none could be started, in
+   which case thread_pool_run(NULL, ...) still works serially. */
+/*@null@ */ struct thread_pool *thread_pool_create(int threads);
+void thread_pool_destroy( /*@null@ */ struct thread_pool *pool);
+
+/* how many jobs can run at once */
+int thread_pool_size( /*@null@ */ const struct thread_pool *pool);
+
+/* call job(data, i) for each i from 0 to jobs - 1, in no
+   particular order, and return when all of them have. */
+void thread_pool_run( /*@null@ */ struct thread_pool *pool, int jobs,
+					 void (*job) (void *data, int i), void *data);
+
+#endif
@@ -54,6 +54,11 @@ extern const char *tls;
    each connection; BIG variables are for ssl (null if not
    used). */
 #define BUF_SIZE 1024
+/* the read buffer starts this big, and doubles when a line
+   won't fit; a line longer than RBUF_MAX is handed over in
+   pieces rather than buffered whole */
+#define RBUF_INITIAL 4096
+#define RBUF_MAX (64 * 1024 * 1024)
 struct connection_state {
 	int sd;
 	char *name;
@@ -64,13 +69,16 @@ struct connection_state {
 	/*@null@ */ void *tls_state;
 	/*@null@ */ void *xcred;
 #endif
-	char unprocessed[BUF_SIZE];
+	/* what has been read but not yet handed out is
+	   rbuf[rstart..rend); taking a line just moves rstart along,
+	   and the leftovers are moved down only when a read needs
+	   room.  rscan is where the search for the next newline
+	   picks up, so a long line isn't rescanned on every read. */
+	char *rbuf;
+	size_t rsize, rstart, rend, rscan;
 	Pop3 pc;					/* mailbox handle for debugging messages */
 };
 
-/* gotta do our own line buffering, sigh */
-int getline_from_buffer(char *readbuffer, char *linebuffer,
-						int linebuflen);
 void handle_gnutls_read_error(int readbytes, struct connection_state *scs);
 
 void tlscomm_close(struct connection_state *scs)
@@ -96,6 +104,8 @@ void tlscomm_close(struct connection_state *scs)
 	scs->sd = -1;
 	scs->tls_state = NULL;
 	scs->xcred = NULL;
+	free(scs->rbuf);
+	scs->rbuf = NULL;
 	free(scs->name);
 	scs->name = NULL;
 	free(scs);
@@ -159,51 +169,163 @@ static int wait_for_it(int sd, int timeoutseconds)
 	return (FD_ISSET(sd, &readfds));
 }
 
-/* exported for testing */
-extern int
-getline_from_buffer(char *readbuffer, char *linebuffer, int linebuflen)
+/* is there data waiting that select() won't know about? */
+static int tls_pending(const struct connection_state *scs)
 {
-	char *p, *q;
-	int i;
-	/* find end of line (stopping if linebuflen is too small. */
-	for (p = readbuffer, i = 0;
-		 *p != '\n' && *p != '\0' && i < linebuflen - 1; p++, i++);
-
-	/* gobble \n if it starts the line. */
-	if (*p == '\n') {
-		/* grab the end of line too! and then advance past
-		   the newline */
-		i++;
-		p++;
+#ifdef USE_GNUTLS
+	if (scs->tls_state)
+		return (gnutls_record_check_pending(scs->tls_state) > 0);
+#endif
+	return 0;
+}
+
+/* read whatever has arrived onto the end of the buffer, making
+   room first, for want bytes in all if that's more than a read's
+   worth; returns the bytes read, 0 if the server closed the
+   connection, and -1 on error */
+static int fill_buffer(struct connection_state *scs, size_t want)
+{
+	size_t buffered = scs->rend - scs->rstart;
+	size_t need = RBUF_INITIAL / 2;
+	int thisreadbytes;
+
+	if (want > buffered + need)
+		need = want - buffered;
+	if (buffered == 0) {
+		scs->rstart = scs->rend = scs->rscan = 0;
+	} else if (scs->rsize - scs->rend < need && scs->rstart > 0) {
+		/* only the start of a line or literal is left over, so
+		   this moves little, and only once per read */
+		memmove(scs->rbuf, scs->rbuf + scs->rstart, buffered);
+		scs->rend -= scs->rstart;
+		scs->rscan -= scs->rstart;
+		scs->rstart = 0;
+	}
+	if (scs->rsize - scs->rend < need) {
+		size_t size = (scs->rsize != 0) ? scs->rsize : RBUF_INITIAL;
+		char *grown;
+		while (size - scs->rend < need)
+			size *= 2;
+		grown = realloc(scs->rbuf, size);
+		if (grown == NULL) {
+			TDM(DEBUG_ERROR, "%s: out of memory for %lu bytes\n",
+				scs->name, (unsigned long) size);
+			return -1;
+		}
+		scs->rbuf = grown;
+		scs->rsize = size;
+	}
+#ifdef USE_GNUTLS
+	if (scs->tls_state) {
+		thisreadbytes = gnutls_read(scs->tls_state, scs->rbuf + scs->rend,
+									scs->rsize - scs->rend);
+		if (thisreadbytes < 0) {
+			handle_gnutls_read_error(thisreadbytes, scs);
+			return -1;
+		}
+	} else
+#endif
+	{
+		thisreadbytes = read(scs->sd, scs->rbuf + scs->rend,
+							 scs->rsize - scs->rend);
+		if (thisreadbytes < 0) {
+			TDM(DEBUG_ERROR, "%s: error reading: %s\n",
+				scs->name, strerror(errno));
+			return -1;
+		}
+	}
+	scs->rend += thisreadbytes;
+	return thisreadbytes;
+}
+
+/* whether a whole line is buffered: the search for its end picks
+   up where the last one stopped */
+static int line_ready(struct connection_state *scs)
+{
+	char *nl = NULL;
+	if (scs->rscan < scs->rend)
+		nl = memchr(scs->rbuf + scs->rscan, '\n', scs->rend - scs->rscan);
+	scs->rscan = (nl != NULL) ? (size_t) (nl - scs->rbuf) : scs->rend;
+	return (nl != NULL);
+}
+
+/* the next line in the buffer, in place, if a whole one has
+   arrived: or at most max bytes of it, or whatever is left if
+   the connection has closed (at_eof).  the line isn't nul
+   terminated, and *len includes the newline. */
+static const char *take_line(struct connection_state *scs, size_t max,
+							 int at_eof, size_t *len)
+{
+	const char *line = scs->rbuf + scs->rstart;
+	size_t buffered = scs->rend - scs->rstart;
+
+	if (line_ready(scs)) {
+		*len = scs->rscan - scs->rstart + 1;
 	} else {
-		/* TODO -- perhaps we should return no line at all
-		   here, as it might be incomplete.  don't want to
-		   break anything though. */
-		DMA(DEBUG_INFO, "expected line doesn't end on its own.\n");
+		if (buffered == 0 || (buffered < max && !at_eof))
+			return NULL;
+		*len = buffered;
 	}
+	if (*len > max)
+		*len = max;
+	scs->rstart += *len;
+	if (scs->rscan < scs->rstart)
+		scs->rscan = scs->rstart;
+	return line;
+}
 
-	if (i != 0) {
-		/* copy a line into the linebuffer */
-		strncpy(linebuffer, readbuffer, (size_t) i);
-		/* sigh, null terminate */
-		linebuffer[i] = '\0';
-		/* shift the rest over; this could be done
-		   instead with strcpy... I think. */
-		q = readbuffer;
-		if (*p != '\0') {
-			while (*p != '\0') {
-				*(q++) = *(p++);
-			}
-		}
-		/* null terminate */
-		*(q++) = *(p++);
-		/* return the length of the line */
+/* a line from the server, waiting up to EXPECT_TIMEOUT for it
+   to arrive; NULL if it doesn't */
+static const char *next_line(struct connection_state *scs, size_t max,
+							 size_t *len)
+{
+	const char *line;
+	while ((line = take_line(scs, max, 0, len)) == NULL) {
+		int got;
+		if (!tls_pending(scs) && !wait_for_it(scs->sd, EXPECT_TIMEOUT))
+			return NULL;
+		got = fill_buffer(scs, 0);
+		if (got < 0)
+			return NULL;
+		if (got == 0)
+			/* the server hung up: hand over what's left */
+			return take_line(scs, max, 1, len);
+	}
+	return line;
+}
+
+const char *tlscomm_line(struct connection_state *scs, size_t *len)
+{
+	const char *line = next_line(scs, RBUF_MAX, len);
+	if (line != NULL)
+		TDM(DEBUG_INFO, "%s: got: %.*s", scs->name, (int) *len, line);
+	return line;
+}
+
+const char *tlscomm_bytes(struct connection_state *scs, size_t n)
+{
+	const char *bytes;
+
+	if (n > RBUF_MAX) {
+		TDM(DEBUG_ERROR, "%s: won't buffer %lu bytes\n", scs->name,
+			(unsigned long) n);
+		return NULL;
 	}
-	if (i < 0 || i > linebuflen) {
-		DM((Pop3) NULL, DEBUG_ERROR, "bork bork bork!: %d %d\n", i,
-		   linebuflen);
+	while (scs->rend - scs->rstart < n) {
+		if (!tls_pending(scs) && !wait_for_it(scs->sd, EXPECT_TIMEOUT))
+			return NULL;
+		if (fill_buffer(scs, n) <= 0) {
+			TDM(DEBUG_ERROR, "%s: %lu bytes expected, the connection "
+				"ended\n", scs->name, (unsigned long) n);
+			return NULL;
+		}
 	}
-	return i;
+	TDM(DEBUG_INFO, "%s: got %lu bytes\n", scs->name, (unsigned long) n);
+	bytes = scs->rbuf + scs->rstart;
+	scs->rstart += n;
+	if (scs->rscan < scs->rstart)
+		scs->rscan = scs->rstart;
+	return bytes;
 }
 
 /* eat lines, until one starting with prefix is found;
@@ -215,77 +337,32 @@ int
 tlscomm_expect(struct connection_state *scs,
 			   const char *prefix, char *linebuf, int buflen)
 {
-	int prefixlen = (int) strlen(prefix);
-	int buffered_bytes = 0;
+	size_t prefixlen = strlen(prefix);
+	const char *line;
+	size_t linebytes;
+
 	memset(linebuf, 0, buflen);
 	TDM(DEBUG_INFO, "%s: expecting: %s\n", scs->name, prefix);
-	/*     if(scs->unprocessed[0]) {
-	   TDM(DEBUG_INFO, "%s: buffered: %s\n", scs->name, scs->unprocessed);
-	   } */
-	while (scs->unprocessed[0] != '\0'
-		   || wait_for_it(scs->sd, EXPECT_TIMEOUT)) {
-		if (scs->unprocessed[buffered_bytes] == '\0') {
-			int thisreadbytes;
-#ifdef USE_GNUTLS
-			if (scs->tls_state) {
-				/* BUF_SIZE - 1 leaves room for trailing \0 */
-				thisreadbytes =
-					gnutls_read(scs->tls_state,
-								&scs->unprocessed[buffered_bytes],
-								BUF_SIZE - 1 - buffered_bytes);
-				if (thisreadbytes < 0) {
-					handle_gnutls_read_error(thisreadbytes, scs);
-					return 0;
-				}
-			} else
-#endif
-			{
-				thisreadbytes =
-					read(scs->sd, &scs->unprocessed[buffered_bytes],
-						 BUF_SIZE - 1 - buffered_bytes);
-				if (thisreadbytes < 0) {
-					TDM(DEBUG_ERROR, "%s: error reading: %s\n",
-						scs->name, strerror(errno));
-					return 0;
-				}
-			}
-			buffered_bytes += thisreadbytes;
-			/* force null termination */
-			scs->unprocessed[buffered_bytes] = '\0';
-			if (buffered_bytes == 0) {
-				return 0;		/* bummer */
-			}
-		} else {
-			buffered_bytes = strlen(scs->unprocessed);
+	/* lines too long for linebuf come over in pieces */
+	while ((line = next_line(scs, buflen - 1, &linebytes)) != NULL) {
+		memcpy(linebuf, line, linebytes);
+		linebuf[linebytes] = '\0';
+		if (linebytes >= prefixlen
+			&& strncmp(linebuf, prefix, prefixlen) == 0) {
+			TDM(DEBUG_INFO, "%s: got: %*s", scs->name,
+				(int) linebytes, linebuf);
+			return 1;			/* got it! */
 		}
-		while (buffered_bytes >= prefixlen) {
-			int linebytes;
-			linebytes =
-				getline_from_buffer(scs->unprocessed, linebuf, buflen);
-			if (linebytes == 0) {
-				buffered_bytes = 0;
-			} else {
-				buffered_bytes -= linebytes;
-				if (strncmp(linebuf, prefix, prefixlen) == 0) {
-					TDM(DEBUG_INFO, "%s: got: %*s", scs->name,
-						linebytes, linebuf);
-					return 1;	/* got it! */
-				}
-				TDM(DEBUG_INFO, "%s: dumped(%d/%d): %.*s", scs->name,
-					linebytes, buffered_bytes, linebytes, linebuf);
-			}
-		}
-	}
-	if (buffered_bytes == -1) {
-		TDM(DEBUG_INFO, "%s: timed out while expecting '%s'\n",
-			scs->name, prefix);
-	} else {
-		TDM(DEBUG_ERROR, "%s: expecting: '%s', saw (%d): %s%s",
-			scs->name, prefix, buffered_bytes, linebuf,
-			/* only print the newline if the linebuf lacks it */
-			(linebuf[strlen(linebuf) - 1] == '\n') ? "\n" : "");
+		TDM(DEBUG_INFO, "%s: dumped(%d/%d): %.*s", scs->name,
+			(int) linebytes, (int) (scs->rend - scs->rstart),
+			(int) linebytes, linebuf);
 	}
-	return 0;					/* wait_for_it failed */
+	TDM(DEBUG_ERROR, "%s: expecting: '%s', saw: %s%s",
+		scs->name, prefix, linebuf,
+		/* only print the newline if the linebuf lacks it */
+		(linebuf[0] == '\0' || linebuf[strlen(linebuf) - 1] != '\n')
+		? "\n" : "");
+	return 0;
 }
 
 int tlscomm_gets(char *buf, int buflen, struct connection_state *scs)
@@ -293,6 +370,45 @@ int tlscomm_gets(char *buf, int buflen, struct connection_state *scs)
 	return (tlscomm_expect(scs, "", buf, buflen));
 }
 
+int tlscomm_fd(const struct connection_state *scs)
+{
+	return (scs->sd);
+}
+
+/* for a connection that sits idle until the server has
+   something to say: takes only what has already arrived, so
+   it's safe to call whenever the socket polls readable */
+int tlscomm_poll(struct connection_state *scs)
+{
+	int thisreadbytes;
+
+	if (line_ready(scs))
+		return 1;
+	if (!tls_pending(scs)) {
+		fd_set readfds;
+		struct timeval tv;
+		int ready;
+		do {
+			FD_ZERO(&readfds);
+			FD_SET(scs->sd, &readfds);
+			tv.tv_sec = 0;
+			tv.tv_usec = 0;
+			ready = select(scs->sd + 1, &readfds, NULL, NULL, &tv);
+		} while (ready == -1 && errno == EINTR);
+		if (ready <= 0 || !FD_ISSET(scs->sd, &readfds))
+			return 0;			/* nothing yet */
+	}
+	thisreadbytes = fill_buffer(scs, 0);
+	if (thisreadbytes < 0)
+		return -1;
+	if (thisreadbytes == 0) {
+		TDM(DEBUG_INFO, "%s: closed by the server\n", scs->name);
+		return -1;
+	}
+	/* otherwise the rest of the line will be along */
+	return line_ready(scs);
+}
+
 void tlscomm_printf(struct connection_state *scs, const char *format, ...)
 {
 	va_list args;
@@ -545,7 +661,7 @@ struct connection_state *initialize_gnutls(intptr_t sd, char *name, Pop3 pc,
 	static int gnutls_initialized;
 	int zok;
 	struct connection_state *scs = malloc(sizeof(struct connection_state));
-	memset(scs, 0, sizeof(struct connection_state));	/* clears the unprocessed buffer */
+	memset(scs, 0, sizeof(struct connection_state));	/* no read buffer yet */
 
 	scs->pc = pc;
 
@@ -677,7 +793,7 @@ struct connection_state *initialize_unencrypted(int sd,
 	struct connection_state *ret = malloc(sizeof(struct connection_state));
 	assert(sd >= 0);
 	assert(ret != NULL);
-	memset(ret, 0, sizeof(struct connection_state));	/* clears the unprocessed buffer */
+	memset(ret, 0, sizeof(struct connection_state));	/* no read buffer yet */
 	ret->sd = sd;
 	ret->name = name;
 	ret->tls_state = NULL;
@@ -45,19 +45,36 @@ void tlscomm_printf(struct connection_state *scs, const char *format, ...);
 int tlscomm_gets( /*@out@ */ char *buf,
 				 int buflen, struct connection_state *scs);
 
+/* like tlscomm_gets, but hands back the line where it sits in
+   the connection's buffer rather than copying it out, however
+   long it is.  it isn't nul terminated, *len includes the
+   newline, and it's only good until the next read on scs. */
+const char *tlscomm_line(struct connection_state *scs,
+						 /*@out@ */ size_t *len);
+
+/* the next n bytes from the server, in place like a line from
+   tlscomm_line; for IMAP's {n} literals, which needn't end in a
+   newline.  NULL if they don't all arrive. */
+const char *tlscomm_bytes(struct connection_state *scs, size_t n);
+
 /* gobbles lines until it finds one starting with {prefix},
    which is returned in buf */
 int tlscomm_expect(struct connection_state *scs, const char *prefix,
 				   /*@out@ */ char *buf,
 				   int buflen);
 
+/* the socket underneath, to poll() on */
+int tlscomm_fd(const struct connection_state *scs);
+
+/* whether a whole line has arrived, reading what's waiting but
+   never waiting for more: 1 if so, 0 if it hasn't yet, and -1
+   if the connection was closed */
+int tlscomm_poll(struct connection_state *scs);
+
 /* terminates the TLS association or just closes the socket,
    and frees the connection state */
 void tlscomm_close( /*@only@ */ struct connection_state *scs);
 
-/* internal function exported for testing */
-int getline_from_buffer(char *readbuffer, char *linebuffer,
-						int linebuflen);
 #ifndef UNUSED
 #ifdef HAVE___ATTRIBUTE__
 #define UNUSED(x) /*@unused@*/  x __attribute__((unused))
@@ -34,6 +34,7 @@
 #include "Client.h"
 #include "charutil.h"
 #include "MessageList.h"
+#include "fileWatch.h"
 
 #ifdef USE_DMALLOC
 #include <dmalloc.h>
@@ -51,10 +52,16 @@ static const int wmbiff_mask_width = 64;
 
 #define BLINK_TIMES 8
 #define DEFAULT_SLEEP_INTERVAL 20000
+/* how often to look at a mailbox anyway when the kernel, or an IMAP
+   server in IDLE, is telling us about its changes, in seconds */
+#define WATCHED_LOOP_INTERVAL 300
 #define BLINK_SLEEP_INTERVAL    200
 #define DEFAULT_LOOP 5
 
 #define MAX_NUM_MAILBOXES 40
+/* IMAP connections that XSleep waits on in IDLE, at most: one for
+   each mailbox */
+#define MAX_IDLE_FDS MAX_NUM_MAILBOXES
 static mbox_t mbox[MAX_NUM_MAILBOXES];
 
 /* this is the normal pixmap. */
@@ -89,6 +96,7 @@ const char *foreground_classic = "#21B3AF";		/* classic foreground cyan */
 const char *background_classic = "#202020";		/* classic background gray */
 static const char *highlight_classic = "yellow";	/* classic highlight color */
 int SkipCertificateCheck = 0;
+int scan_threads = 1;			/* no threads unless asked for */
 int Relax = 0;					/* be not paranoid */
 static int notWithdrawn = 0;
 
@@ -202,6 +210,8 @@ static struct path_demultiplexer paths[] = {
 	{"imaps:", imap4Create},
 	{"sslimap:", imap4Create},
 	{"maildir:", maildirCreate},
+	{"maildir++:", maildirppCreate},
+	{"mh:", mhCreate},
 	{"mbox:", mboxCreate},
 	{NULL, NULL}
 };
@@ -277,6 +287,14 @@ static int Read_Config_File(char *filename, int *loopinterval)
 		} else if (!strcmp(setting, "tls")) {
 			tls = strdup_ordie(value);
 			continue;
+		} else if (!strcmp(setting, "scanthreads")) {
+			scan_threads = atoi(value);
+			continue;
+		} else if (!strcmp(setting, "connecttimeout")) {
+			connect_timeout = atoi(value);
+			if (connect_timeout < 1)
+				connect_timeout = 1;
+			continue;
 		} else if (mbox_index == -1) {
 			DMA(DEBUG_INFO, "Unknown global setting '%s'\n", setting);
 			continue;			/* Didn't read any setting.[0-5] value */
@@ -430,6 +448,7 @@ static void init_biff(char *config_file)
 		memset(mbox[i].fetchcmd, 0, BUF_BIG);
 		mbox[i].loopinterval = 0;
 		mbox[i].getHeaders = NULL;
+		mbox[i].prefetch = NULL;
 		mbox[i].releaseHeaders = NULL;
 		mbox[i].debug = debug_default;
 		mbox[i].askpass = DEFAULT_ASKPASS;
@@ -455,6 +474,9 @@ static void init_biff(char *config_file)
 	}
 #endif
 
+	/* before the mailboxes are created, so they can be watched */
+	filewatch_init();
+
 	DMA(DEBUG_INFO, "config_file = %s.\n", config_file);
 	if (!Read_Config_File(config_file, &loopinterval)) {
 		char *m;
@@ -803,6 +825,32 @@ static int count_mail(unsigned int item)
 	return rc;
 }
 
+static int mailbox_due(unsigned int i, time_t curtime)
+{
+	int interval = mbox[i].loopinterval;
+	if (mbox[i].watched && interval < WATCHED_LOOP_INTERVAL)
+		interval = WATCHED_LOOP_INTERVAL;
+	return curtime >= mbox[i].prevtime + interval;
+}
+
+/* stat the local mailboxes that are due all at once, rather than
+   each in turn as it's checked */
+static void prefetch_due(time_t curtime)
+{
+	struct stat_batch batch;
+	unsigned int i;
+
+	stat_batch_init(&batch);
+	for (i = 0; i < num_mailboxes; i++) {
+		if (mbox[i].label[0] != '\0' && mbox[i].prefetch != NULL
+			&& mailbox_due(i, curtime))
+			mbox[i].prefetch(&mbox[i], &batch);
+	}
+	if (batch.count > 0)
+		stat_batch_run(&batch, scan_thread_pool());
+	stat_batch_free(&batch);
+}
+
 static int periodic_mail_check(void)
 {
 	int NeedRedraw = 0;
@@ -814,9 +862,10 @@ static int periodic_mail_check(void)
 	int NewMail = 0;			/* flag for global notify */
 	unsigned int i;
 	time_t curtime = time(0);
+	prefetch_due(curtime);
 	for (i = 0; i < num_mailboxes; i++) {
 		if (mbox[i].label[0] != '\0') {
-			if (curtime >= mbox[i].prevtime + mbox[i].loopinterval) {
+			if (mailbox_due(i, curtime)) {
 				int mailstat = 0;
 				NeedRedraw = 1;
 				DM(&mbox[i], DEBUG_INFO,
@@ -872,6 +921,8 @@ static int periodic_mail_check(void)
 	if (NewMail == 1)
 		execnotify(globalnotify);
 
+	imap_keepalive(curtime);
+
 	if (Blink_Mode == 0) {
 		for (i = 0; i < num_mailboxes; i++) {
 			mbox[i].blink_stat = 0;
@@ -961,13 +1012,33 @@ static char **CreateBackingXPM(int width, int height,
  */
 static void XSleep(int millisec)
 {
+	int idle_fds[MAX_IDLE_FDS];
+	int nidle = imap_idle_fds(idle_fds, MAX_IDLE_FDS);
+	int i;
 #ifdef HAVE_POLL
-	struct pollfd timeout;
-
-	timeout.fd = ConnectionNumber(display);
-	timeout.events = POLLIN;
+	struct pollfd timeout[2 + MAX_IDLE_FDS];
+	int nfds = 1;
+	int watch = -1;
+
+	timeout[0].fd = ConnectionNumber(display);
+	timeout[0].events = POLLIN;
+	if (filewatch_fd() >= 0) {
+		watch = nfds++;
+		timeout[watch].fd = filewatch_fd();
+		timeout[watch].events = POLLIN;
+	}
+	for (i = 0; i < nidle; i++) {
+		timeout[nfds + i].fd = idle_fds[i];
+		timeout[nfds + i].events = POLLIN;
+	}
 
-	poll(&timeout, 1, millisec);
+	if (poll(timeout, nfds + nidle, millisec) > 0) {
+		if (watch >= 0 && (timeout[watch].revents & POLLIN))
+			(void) filewatch_dispatch();
+		for (i = 0; i < nidle; i++)
+			if (timeout[nfds + i].revents & (POLLIN | POLLHUP | POLLERR))
+				imap_idle_dispatch(idle_fds[i]);
+	}
 #else
 	struct timeval to;
 	struct timeval *timeout = NULL;
@@ -982,8 +1053,24 @@ static void XSleep(int millisec)
 	FD_ZERO(&readfds);
 	FD_SET(ConnectionNumber(display), &readfds);
 	max_fd = ConnectionNumber(display);
+	if (filewatch_fd() >= 0) {
+		FD_SET(filewatch_fd(), &readfds);
+		if (filewatch_fd() > max_fd)
+			max_fd = filewatch_fd();
+	}
+	for (i = 0; i < nidle; i++) {
+		FD_SET(idle_fds[i], &readfds);
+		if (idle_fds[i] > max_fd)
+			max_fd = idle_fds[i];
+	}
 
-	select(max_fd + 1, &readfds, NULL, NULL, timeout);
+	if (select(max_fd + 1, &readfds, NULL, NULL, timeout) > 0) {
+		if (filewatch_fd() >= 0 && FD_ISSET(filewatch_fd(), &readfds))
+			(void) filewatch_dispatch();
+		for (i = 0; i < nidle; i++)
+			if (FD_ISSET(idle_fds[i], &readfds))
+				imap_idle_dispatch(idle_fds[i]);
+	}
 #endif
 }
 